@@ -2,6 +2,11 @@
 from libc.stdint cimport *
 
 cdef extern from "motherboard.h":
+    struct MemorySegment:
+        uint64_t address
+        uint32_t length
+        uint8_t* buffer
+
     struct Device:
         void* device
         uint64_t device_type
@@ -16,11 +21,23 @@ cdef extern from "motherboard.h":
         int32_t (*halt)(void*) nogil
         int32_t (*interrupt)(void*, uint32_t) nogil
         int32_t (*register_motherboard)(void*, void*, MotherboardFunctions*) nogil
+        int32_t (*map_memory)(void*, uint8_t**, uint32_t*, uint32_t*) nogil
+        int32_t (*step)(void*, uint32_t) nogil
+        int32_t (*snapshot)(void*, uint8_t*, uint32_t, uint32_t*) nogil
+        int32_t (*restore)(void*, const uint8_t*, uint32_t) nogil
+        int32_t (*clone)(void*, uint32_t, Device*) nogil
+        int32_t (*destroy)(void*) nogil
+        int32_t (*load_bytes_v)(void*, const MemorySegment*, uint32_t) nogil
+        int32_t (*write_bytes_v)(void*, const MemorySegment*, uint32_t) nogil
+        uint32_t (*read_counters)(void*, uint64_t*, uint32_t) nogil
 
     struct MotherboardFunctions:
         int32_t (*read_bytes)(void*, uint64_t, uint32_t, uint8_t*) nogil
         int32_t (*write_bytes)(void*, uint64_t, uint32_t, uint8_t*) nogil
         int32_t (*send_interrupt)(void*, uint32_t, uint32_t) nogil
+        int32_t (*map_bytes)(void*, uint64_t, uint8_t**, uint32_t*, uint32_t*) nogil
+        int32_t (*read_bytes_v)(void*, const MemorySegment*, uint32_t) nogil
+        int32_t (*write_bytes_v)(void*, const MemorySegment*, uint32_t) nogil
 
 cdef class BaseDevice:
     cdef Device* device
@@ -1,5 +1,6 @@
 #cython: language_level=3
 from libc.stdint cimport *
+from libc.stdlib cimport malloc, free
 from computer.basedevice cimport Device, MotherboardFunctions
 from computer cimport basedevice
 
@@ -52,6 +53,9 @@ cdef class SOMotherboard:
     cdef int32_t (*boot_func)(void*) nogil
     cdef int32_t (*halt_func)(void*) nogil
     cdef int32_t (*reboot_func)(void*) nogil
+    cdef int32_t (*snapshot_func)(void*, const char*) nogil
+    cdef int32_t (*restore_func)(void*, const char*) nogil
+    cdef int32_t (*clone_func)(void*, uint32_t, void**) nogil
 
     cdef readonly str soname
 
@@ -68,6 +72,9 @@ cdef class SOMotherboard:
         self.boot_func = NULL
         self.halt_func = NULL
         self.reboot_func = NULL
+        self.snapshot_func = NULL
+        self.restore_func = NULL
+        self.clone_func = NULL
         self.motherboard = NULL
 
     def __init__(self, soname, constructor_data):
@@ -166,6 +173,30 @@ cdef class SOMotherboard:
                 '{} does not contain required function "bscomp_motherboard_reboot".'
                 .format(self.soname))
 
+        with nogil:
+            self.snapshot_func = <int32_t (*)(void*, const char*) nogil>dlsym(
+                self.shared_object, 'bscomp_motherboard_snapshot')
+        if not self.snapshot_func:
+            raise LoadError(
+                '{} does not contain required function "bscomp_motherboard_snapshot".'
+                .format(self.soname))
+
+        with nogil:
+            self.restore_func = <int32_t (*)(void*, const char*) nogil>dlsym(
+                self.shared_object, 'bscomp_motherboard_restore')
+        if not self.restore_func:
+            raise LoadError(
+                '{} does not contain required function "bscomp_motherboard_restore".'
+                .format(self.soname))
+
+        with nogil:
+            self.clone_func = <int32_t (*)(void*, uint32_t, void**) nogil>dlsym(
+                self.shared_object, 'bscomp_motherboard_clone')
+        if not self.clone_func:
+            raise LoadError(
+                '{} does not contain required function "bscomp_motherboard_clone".'
+                .format(self.soname))
+
         with nogil:
             self.motherboard = self.create_func(<void*>constructor_arg)
         if not self.motherboard:
@@ -193,6 +224,9 @@ cdef class SOMotherboard:
         self.boot_func = NULL
         self.halt_func = NULL
         self.reboot_func = NULL
+        self.snapshot_func = NULL
+        self.restore_func = NULL
+        self.clone_func = NULL
 
         if self.shared_object:
             dlclose(self.shared_object)
@@ -244,6 +278,192 @@ cdef class SOMotherboard:
         if res != 0:
             raise CalledActionError(res, 'bscomp_motherboard_reboot')
 
+    def snapshot(self, path):
+        """Save the booted motherboard to a file."""
+        cdef bytes path_bytes = string_check(path).encode('utf-8')
+        cdef const char* path_cstr = path_bytes
+        cdef int32_t res
+        with nogil:
+            res = self.snapshot_func(self.motherboard, path_cstr)
+        if res != 0:
+            raise CalledActionError(res, 'bscomp_motherboard_snapshot')
+
+    def restore(self, path):
+        """Put the booted motherboard back in a state saved by snapshot."""
+        cdef bytes path_bytes = string_check(path).encode('utf-8')
+        cdef const char* path_cstr = path_bytes
+        cdef int32_t res
+        with nogil:
+            res = self.restore_func(self.motherboard, path_cstr)
+        if res != 0:
+            raise CalledActionError(res, 'bscomp_motherboard_restore')
+
+    def clone(self, uint32_t count):
+        """Make count copies of the booted motherboard, which boot where it left off.
+        Every device needs to support cloning.
+        """
+        cdef void** clones = <void**>malloc(count * sizeof(void*))
+        if clones == NULL and count != 0:
+            raise MemoryError()
+        cdef int32_t res
+        with nogil:
+            res = self.clone_func(self.motherboard, count, clones)
+        if res != 0:
+            free(clones)
+            raise CalledActionError(res, 'bscomp_motherboard_clone')
+
+        copies = []
+        cdef SOMotherboard copy
+        for i in range(count):
+            copy = SOMotherboard.__new__(SOMotherboard)
+            copy.adopt(self, clones[i])
+            copies.append(copy)
+        free(clones)
+        return copies
+
+    cdef adopt(self, SOMotherboard template, void* motherboard):
+        """Take ownership of a motherboard cloned from template."""
+        self.soname = template.soname
+        cdef bytes soname_bytes = self.soname.encode('utf-8')
+        cdef const char* soname_cstr = soname_bytes
+        # Our own reference, so the shared object outlives whichever of us goes last.
+        with nogil:
+            self.shared_object = dlopen(soname_cstr, RTLD_NOW | RTLD_GLOBAL)
+        self.create_func = template.create_func
+        self.destroy_func = template.destroy_func
+        self.num_slots_func = template.num_slots_func
+        self.slots_filled_func = template.slots_filled_func
+        self.is_full_func = template.is_full_func
+        self.add_device_func = template.add_device_func
+        self.boot_func = template.boot_func
+        self.halt_func = template.halt_func
+        self.reboot_func = template.reboot_func
+        self.snapshot_func = template.snapshot_func
+        self.restore_func = template.restore_func
+        self.clone_func = template.clone_func
+        self.motherboard = motherboard
+
+cdef class SORuntime:
+    """Pool of threads to run many SOMotherboards on, as an alternative to giving each
+    one a thread to boot on.
+    """
+    cdef void* shared_object
+    cdef void* (*create_func)(void*) nogil
+    cdef void (*destroy_func)(void*) nogil
+    cdef int32_t (*boot_func)(void*, void*) nogil
+    cdef int32_t (*wait_func)(void*, void*) nogil
+
+    cdef readonly str soname
+
+    cdef void* runtime
+
+    def __cinit__(self):
+        self.shared_object = NULL
+        self.create_func = NULL
+        self.destroy_func = NULL
+        self.boot_func = NULL
+        self.wait_func = NULL
+        self.runtime = NULL
+
+    def __init__(self, soname, constructor_data):
+        """Soname should be the same motherboard library the motherboards to run were
+        loaded from. Constructor data should be a bytes object representing a
+        platform-standard representation of the RuntimeConfig type.
+        """
+        self.soname = string_check(soname)
+        cdef bytes soname_bytes = self.soname.encode('utf-8')
+        cdef const char* soname_cstr = soname_bytes
+
+        cdef char* constructor_arg
+        if constructor_data is None:
+            constructor_arg = NULL
+        elif isinstance(constructor_data, bytes):
+            constructor_arg = constructor_data
+        else:
+            raise TypeError('Constructor data must be bytes or None')
+
+        with nogil:
+            self.shared_object = dlopen(soname_cstr, RTLD_NOW | RTLD_GLOBAL)
+        if not self.shared_object:
+            raise LoadError('Unable to load {}.'.format(self.soname))
+
+        with nogil:
+            self.create_func = <void* (*)(void*) nogil>dlsym(
+                self.shared_object, 'bscomp_runtime_new')
+        if not self.create_func:
+            raise LoadError(
+                '{} does not contain required function "bscomp_runtime_new".'
+                .format(self.soname))
+
+        with nogil:
+            self.destroy_func = <void (*)(void*) nogil>dlsym(
+                self.shared_object, 'bscomp_runtime_destroy')
+        if not self.destroy_func:
+            raise LoadError(
+                '{} does not contain required function "bscomp_runtime_destroy".'
+                .format(self.soname))
+
+        with nogil:
+            self.boot_func = <int32_t (*)(void*, void*) nogil>dlsym(
+                self.shared_object, 'bscomp_runtime_boot')
+        if not self.boot_func:
+            raise LoadError(
+                '{} does not contain required function "bscomp_runtime_boot".'
+                .format(self.soname))
+
+        with nogil:
+            self.wait_func = <int32_t (*)(void*, void*) nogil>dlsym(
+                self.shared_object, 'bscomp_runtime_wait')
+        if not self.wait_func:
+            raise LoadError(
+                '{} does not contain required function "bscomp_runtime_wait".'
+                .format(self.soname))
+
+        with nogil:
+            self.runtime = self.create_func(<void*>constructor_arg)
+        if not self.runtime:
+            raise LoadError('Unable to create a runtime!')
+
+    def __dealloc__(self):
+        if not self.runtime and not self.shared_object:
+            # nothing to deallocate
+            return
+
+        if self.runtime:
+            if self.destroy_func:
+                # Halts and waits for any motherboards still running.
+                with nogil:
+                    self.destroy_func(self.runtime)
+                    self.runtime = NULL
+            else:
+                raise StateError('Cannot deallocate runtime! No destroy function!')
+
+        self.create_func = NULL
+        self.destroy_func = NULL
+        self.boot_func = NULL
+        self.wait_func = NULL
+
+        if self.shared_object:
+            dlclose(self.shared_object)
+
+    def boot(self, SOMotherboard motherboard):
+        """Boot the motherboard on the runtime. Returns as soon as it is running; halt
+        it as usual. The motherboard must be kept alive until it has halted.
+        """
+        cdef int32_t res
+        with nogil:
+            res = self.boot_func(self.runtime, motherboard.motherboard)
+        if res != 0:
+            raise CalledActionError(res, 'bscomp_runtime_boot')
+
+    def wait(self, SOMotherboard motherboard):
+        """Wait for a motherboard booted on the runtime to halt."""
+        cdef int32_t res
+        with nogil:
+            res = self.wait_func(self.runtime, motherboard.motherboard)
+        if res != 0:
+            raise CalledActionError(res, 'bscomp_runtime_wait')
+
 cdef class SODevice(basedevice.BaseDevice):
     cdef void* shared_object
     cdef Device* (*create_func)(void*) nogil
@@ -0,0 +1,566 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "motherboard.h"
+#include "dma.h"
+
+// Largest copy between checks for a halt, and the size of the buffer used when either
+// end of a copy can't be mapped.
+static const uint32_t dma_chunk_size = 1 << 16;
+
+// Copies never cross a 2^32 byte window, since each window is a different device.
+static const uint64_t window_size = 1ull << 32;
+
+struct DmaDevice {
+    uint32_t descriptor_count;
+    uint32_t memory_size;
+    // Registers, then descriptors.
+    uint8_t* memory;
+    uint8_t* buffer;
+
+    void* motherboard;
+    struct MotherboardFunctions mbfuncs;
+
+    // Guards the queue and running, and is waited on for work.
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int running;
+    // Start indices of the chains waiting to run, in a ring of dma_queue_size.
+    uint32_t* queue;
+    uint32_t queue_head;
+    uint32_t queue_length;
+
+    // Only touched by the copying thread, or while it is stopped. The descriptor being
+    // run plus one, or 0 between chains, and how many of its bytes are done.
+    uint32_t current;
+    uint32_t done;
+};
+
+// State saved in a snapshot, ahead of the queue and then the memory.
+static const uint32_t saved_dma_version = 1;
+
+struct SavedDma {
+    uint32_t version;
+    uint32_t descriptor_count;
+    uint32_t current;
+    uint32_t done;
+    uint32_t queue_length;
+};
+
+struct Descriptor {
+    uint64_t source;
+    uint64_t destination;
+    uint32_t length;
+    uint32_t next;
+};
+
+static uint32_t next_device_id = 0;
+
+static int32_t load_bytes(void*, uint32_t, uint32_t, uint8_t*);
+static int32_t write_bytes(void*, uint32_t, uint32_t, uint8_t*);
+static int32_t init(void*);
+static int32_t reset(void*);
+static int32_t cleanup(void*);
+static int32_t boot(void*);
+static int32_t halt(void*);
+static int32_t interrupt(void*, uint32_t);
+static int32_t register_motherboard(void*, void*, struct MotherboardFunctions*);
+static int32_t snapshot(void*, uint8_t*, uint32_t, uint32_t*);
+static int32_t restore(void*, const uint8_t*, uint32_t);
+static int32_t clone_device(void*, uint32_t, struct Device*);
+static int32_t destroy(void*);
+
+// Fill in a device descriptor for dmadev.
+static void describe(struct Device* dev, struct DmaDevice* dmadev) {
+    *dev = (const struct Device){0};
+
+    dev->device = dmadev;
+    dev->export_memory_size = dmadev->memory_size;
+
+    dev->load_bytes = &load_bytes;
+    dev->write_bytes = &write_bytes;
+    dev->init = &init;
+    dev->reset = &reset;
+    dev->cleanup = &cleanup;
+    dev->boot = &boot;
+    dev->halt = &halt;
+    dev->interrupt = &interrupt;
+    dev->register_motherboard = &register_motherboard;
+    dev->snapshot = &snapshot;
+    dev->restore = &restore;
+    dev->clone = &clone_device;
+    dev->destroy = &destroy;
+
+    dev->device_type = dma_device_type_id;
+    dev->device_id = next_device_id++;
+}
+
+static struct DmaDevice* create(uint32_t descriptors) {
+    if (!descriptors
+            || descriptors > (UINT32_MAX - dma_descriptors) / dma_descriptor_size) {
+        return 0;
+    }
+
+    struct DmaDevice* dmadev = malloc(sizeof(struct DmaDevice));
+    if (!dmadev) {
+        return 0;
+    }
+    *dmadev = (const struct DmaDevice){0};
+    dmadev->descriptor_count = descriptors;
+    dmadev->memory_size = dma_descriptors + descriptors * dma_descriptor_size;
+    dmadev->memory = calloc(dmadev->memory_size, 1);
+    dmadev->queue = calloc(dma_queue_size, sizeof(uint32_t));
+    if (!dmadev->memory || !dmadev->queue) {
+        free(dmadev->memory);
+        free(dmadev->queue);
+        free(dmadev);
+        return 0;
+    }
+    pthread_mutex_init(&dmadev->lock, 0);
+    pthread_cond_init(&dmadev->work, 0);
+    return dmadev;
+}
+
+struct Device* bscomp_device_new(const struct DMAConfig* config) {
+    if (!config) {
+        return 0;
+    }
+
+    struct Device* dev = malloc(sizeof(struct Device));
+    struct DmaDevice* dmadev = create(config->descriptors);
+
+    if (!dev || !dmadev) {
+        free(dev);
+        if (dmadev) {
+            destroy(dmadev);
+        }
+        return 0;
+    }
+
+    describe(dev, dmadev);
+
+    return dev;
+}
+
+void bscomp_device_destroy(struct Device* dev) {
+    if (!dev) {
+        return;
+    }
+
+    struct DmaDevice* dmadev = dev->device;
+    if (!dmadev || !dmadev->memory) {
+        // As with RAM, don't make a bad pointer worse.
+        return;
+    }
+
+    destroy(dmadev);
+    dev->device = 0;
+
+    free(dev);
+}
+
+static uint32_t get_register(struct DmaDevice* dd, uint32_t reg) {
+    return __atomic_load_n((uint32_t*)(dd->memory + reg), __ATOMIC_RELAXED);
+}
+
+static void set_register(struct DmaDevice* dd, uint32_t reg, uint32_t value) {
+    __atomic_store_n((uint32_t*)(dd->memory + reg), value, __ATOMIC_RELAXED);
+}
+
+// Queue the chain starting at descriptor index start. Call with the lock held.
+static void queue_chain(struct DmaDevice* dd, uint32_t start) {
+    if (dd->queue_length == dma_queue_size) {
+        set_register(dd, dma_reg_errors, get_register(dd, dma_reg_errors) + 1);
+        return;
+    }
+    dd->queue[(dd->queue_head + dd->queue_length) % dma_queue_size] = start;
+    ++dd->queue_length;
+    set_register(dd, dma_reg_pending, get_register(dd, dma_reg_pending) + 1);
+    pthread_cond_signal(&dd->work);
+}
+
+static int32_t load_bytes(void* dmadev, uint32_t src, uint32_t len, uint8_t* dest) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+
+    if (src >= dd->memory_size) {
+        return 0;
+    }
+    if (len > dd->memory_size - src) {
+        len = dd->memory_size - src;
+    }
+    memcpy(dest, dd->memory + src, len);
+
+    return 0;
+}
+
+static int32_t write_bytes(void* dmadev, uint32_t dest, uint32_t len, uint8_t* src) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+
+    if (dest >= dd->memory_size) {
+        return 0;
+    }
+    if (len > dd->memory_size - dest) {
+        len = dd->memory_size - dest;
+    }
+
+    // Registers take only the bytes they allow; descriptors take everything.
+    uint32_t i = 0;
+    for (; i < len && dest + i < dma_descriptors; ++i) {
+        uint32_t addr = dest + i;
+        if ((addr >= dma_reg_start && addr < dma_reg_start + 4)
+                || (addr >= dma_reg_interrupt_device && addr < dma_reg_interrupt_code + 4)) {
+            dd->memory[addr] = src[i];
+        }
+    }
+    memcpy(dd->memory + dest + i, src + i, len - i);
+
+    // Writing the whole start register starts a chain.
+    if (dest <= dma_reg_start && dest + len >= dma_reg_start + 4) {
+        pthread_mutex_lock(&dd->lock);
+        queue_chain(dd, get_register(dd, dma_reg_start));
+        pthread_mutex_unlock(&dd->lock);
+    }
+
+    return 0;
+}
+
+static int32_t init(void* dmadev) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    if (!dd->buffer) {
+        dd->buffer = malloc(dma_chunk_size);
+    }
+    return dd->buffer ? 0 : -1;
+}
+
+static int32_t reset(void* dmadev) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    memset(dd->memory, 0, dd->memory_size);
+    set_register(dd, dma_reg_interrupt_device, dma_no_interrupt);
+    dd->queue_head = 0;
+    dd->queue_length = 0;
+    dd->current = 0;
+    dd->done = 0;
+
+    return 0;
+}
+
+static int32_t cleanup(void* dmadev) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    free(dd->buffer);
+    dd->buffer = 0;
+
+    return 0;
+}
+
+// Copy up to len bytes of one descriptor, stopping at the end of a chunk or a window.
+// Goes directly between mapped memory when both ends allow it, and through the buffer
+// otherwise. Returns the number of bytes copied, or a negative error.
+static int64_t copy_chunk(struct DmaDevice* dd, uint64_t src, uint64_t dest, uint32_t len) {
+    uint64_t limit = len < dma_chunk_size ? len : dma_chunk_size;
+    if (limit > window_size - src % window_size) {
+        limit = window_size - src % window_size;
+    }
+    if (limit > window_size - dest % window_size) {
+        limit = window_size - dest % window_size;
+    }
+
+    if (dd->mbfuncs.map_bytes) {
+        uint8_t* from = 0;
+        uint8_t* to = 0;
+        uint32_t from_length = 0, to_length = 0, from_flags = 0, to_flags = 0;
+        dd->mbfuncs.map_bytes(dd->motherboard, src, &from, &from_length, &from_flags);
+        dd->mbfuncs.map_bytes(dd->motherboard, dest, &to, &to_length, &to_flags);
+        if (from && to && (from_flags & bscomp_map_readable)
+                && (to_flags & bscomp_map_writable)) {
+            uint64_t n = limit;
+            if (n > from_length) {
+                n = from_length;
+            }
+            if (n > to_length) {
+                n = to_length;
+            }
+            if (n) {
+                memmove(to, from, n);
+                return n;
+            }
+        }
+    }
+
+    int32_t res = dd->mbfuncs.read_bytes(dd->motherboard, src, limit, dd->buffer);
+    if (res) {
+        return res < 0 ? res : -1;
+    }
+    res = dd->mbfuncs.write_bytes(dd->motherboard, dest, limit, dd->buffer);
+    if (res) {
+        return res < 0 ? res : -1;
+    }
+    return limit;
+}
+
+// Run the current descriptor until it is done or the device halts. Returns 1 if it is
+// done, 0 if halted, and -1 if the chain has to be cut short.
+static int32_t run_descriptor(struct DmaDevice* dd) {
+    uint32_t index = dd->current - 1;
+    if (index >= dd->descriptor_count) {
+        return -1;
+    }
+
+    struct Descriptor d;
+    uint8_t* at = dd->memory + dma_descriptors + index * dma_descriptor_size;
+    memcpy(&d.source, at, 8);
+    memcpy(&d.destination, at + 8, 8);
+    memcpy(&d.length, at + 16, 4);
+
+    while (dd->done < d.length) {
+        if (!__atomic_load_n(&dd->running, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+        int64_t copied = copy_chunk(dd, d.source + dd->done, d.destination + dd->done,
+                                    d.length - dd->done);
+        if (copied < 0) {
+            return -1;
+        }
+        dd->done += copied;
+    }
+    return 1;
+}
+
+// Move on from the current descriptor once it has finished or failed, raising the
+// completion interrupt at the end of the chain. Call with the lock held.
+static void finish_descriptor(struct DmaDevice* dd, int32_t result) {
+    uint32_t next = 0;
+    if (result > 0) {
+        memcpy(&next, dd->memory + dma_descriptors + (dd->current - 1) * dma_descriptor_size
+               + 20, 4);
+    } else {
+        set_register(dd, dma_reg_errors, get_register(dd, dma_reg_errors) + 1);
+    }
+
+    dd->done = 0;
+    dd->current = next;
+    if (next) {
+        return;
+    }
+
+    set_register(dd, dma_reg_pending, get_register(dd, dma_reg_pending) - 1);
+    set_register(dd, dma_reg_completed, get_register(dd, dma_reg_completed) + 1);
+    uint32_t target = get_register(dd, dma_reg_interrupt_device);
+    if (target != dma_no_interrupt) {
+        dd->mbfuncs.send_interrupt(dd->motherboard, target,
+                                   get_register(dd, dma_reg_interrupt_code));
+    }
+}
+
+static int32_t boot(void* dmadev) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    pthread_mutex_lock(&dd->lock);
+    __atomic_store_n(&dd->running, 1, __ATOMIC_RELAXED);
+    while (dd->running) {
+        if (!dd->current) {
+            if (!dd->queue_length) {
+                pthread_cond_wait(&dd->work, &dd->lock);
+                continue;
+            }
+            dd->current = dd->queue[dd->queue_head] + 1;
+            dd->queue_head = (dd->queue_head + 1) % dma_queue_size;
+            --dd->queue_length;
+        }
+
+        // Copy without the lock, so the guest can queue more chains meanwhile.
+        pthread_mutex_unlock(&dd->lock);
+        int32_t result = run_descriptor(dd);
+        pthread_mutex_lock(&dd->lock);
+
+        // Halted part way through; the descriptor carries on where it left off next boot.
+        if (result == 0) {
+            break;
+        }
+        finish_descriptor(dd, result);
+    }
+    pthread_mutex_unlock(&dd->lock);
+
+    return 0;
+}
+
+static int32_t halt(void* dmadev) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    pthread_mutex_lock(&dd->lock);
+    __atomic_store_n(&dd->running, 0, __ATOMIC_RELAXED);
+    pthread_cond_signal(&dd->work);
+    pthread_mutex_unlock(&dd->lock);
+
+    return 0;
+}
+
+// Interrupt codes are descriptor indices to start chains at.
+static int32_t interrupt(void* dmadev, uint32_t code) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    pthread_mutex_lock(&dd->lock);
+    queue_chain(dd, code);
+    pthread_mutex_unlock(&dd->lock);
+
+    return 0;
+}
+
+static int32_t register_motherboard(void* dmadev, void* motherboard,
+                                    struct MotherboardFunctions* mbfuncs) {
+    if (!dmadev || !mbfuncs) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    dd->motherboard = motherboard;
+    dd->mbfuncs = *mbfuncs;
+
+    return 0;
+}
+
+// Snapshots are a SavedDma, then the queued chains in order, then the memory.
+static int32_t snapshot(void* dmadev, uint8_t* dest, uint32_t capacity, uint32_t* length) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    uint64_t size = sizeof(struct SavedDma) + dd->queue_length * sizeof(uint32_t)
+        + (uint64_t)dd->memory_size;
+    if (size > UINT32_MAX) {
+        return -2;
+    }
+    *length = size;
+    if (!dest || capacity < size) {
+        return 0;
+    }
+
+    struct SavedDma saved = {0};
+    saved.version = saved_dma_version;
+    saved.descriptor_count = dd->descriptor_count;
+    saved.current = dd->current;
+    saved.done = dd->done;
+    saved.queue_length = dd->queue_length;
+    memcpy(dest, &saved, sizeof(saved));
+    dest += sizeof(saved);
+    for (uint32_t i = 0; i < dd->queue_length; ++i) {
+        memcpy(dest, &dd->queue[(dd->queue_head + i) % dma_queue_size], sizeof(uint32_t));
+        dest += sizeof(uint32_t);
+    }
+    memcpy(dest, dd->memory, dd->memory_size);
+
+    return 0;
+}
+
+static int32_t restore(void* dmadev, const uint8_t* src, uint32_t length) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    struct SavedDma saved;
+    if (length < sizeof(saved)) {
+        return -2;
+    }
+    memcpy(&saved, src, sizeof(saved));
+    if (saved.version != saved_dma_version || saved.descriptor_count != dd->descriptor_count
+            || saved.queue_length > dma_queue_size
+            || length != sizeof(saved) + saved.queue_length * sizeof(uint32_t)
+                + (uint64_t)dd->memory_size) {
+        return -2;
+    }
+    src += sizeof(saved);
+
+    dd->current = saved.current;
+    dd->done = saved.done;
+    dd->queue_head = 0;
+    dd->queue_length = saved.queue_length;
+    memcpy(dd->queue, src, saved.queue_length * sizeof(uint32_t));
+    src += saved.queue_length * sizeof(uint32_t);
+    memcpy(dd->memory, src, dd->memory_size);
+
+    return 0;
+}
+
+static int32_t clone_device(void* dmadev, uint32_t count, struct Device* copies) {
+    if (!dmadev || (count && !copies)) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    uint32_t made = 0;
+    for (; made < count; ++made) {
+        struct DmaDevice* copy = create(dd->descriptor_count);
+        if (!copy || init(copy)) {
+            if (copy) {
+                destroy(copy);
+            }
+            break;
+        }
+
+        memcpy(copy->memory, dd->memory, dd->memory_size);
+        memcpy(copy->queue, dd->queue, dma_queue_size * sizeof(uint32_t));
+        copy->queue_head = dd->queue_head;
+        copy->queue_length = dd->queue_length;
+        copy->current = dd->current;
+        copy->done = dd->done;
+        describe(&copies[made], copy);
+    }
+
+    if (made == count) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < made; ++i) {
+        destroy(copies[i].device);
+    }
+    return -2;
+}
+
+static int32_t destroy(void* dmadev) {
+    if (!dmadev) {
+        return -1;
+    }
+
+    struct DmaDevice* dd = dmadev;
+    cleanup(dd);
+    free(dd->memory);
+    dd->memory = 0;
+    free(dd->queue);
+    dd->queue = 0;
+    pthread_mutex_destroy(&dd->lock);
+    pthread_cond_destroy(&dd->work);
+    free(dd);
+
+    return 0;
+}
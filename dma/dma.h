@@ -0,0 +1,50 @@
+#ifndef bscomp_dma_h
+#define bscomp_dma_h
+
+#include <stdint.h>
+
+#include "motherboard.h"
+
+static const uint64_t dma_device_type_id = (4l << 32) | 1l;
+
+// Exported memory starts with 32 bytes of u32 registers, followed by the descriptors.
+//
+// Write a descriptor index to start the chain beginning there. Sending the device an
+// interrupt with a descriptor index as its code does the same.
+static const uint32_t dma_reg_start = 0;
+// Chains started but not yet finished. Read only.
+static const uint32_t dma_reg_pending = 4;
+// Chains finished since reset, including those cut short. Read only.
+static const uint32_t dma_reg_completed = 8;
+// Chains dropped because too many were pending, or cut short by a bad descriptor index
+// or a failed copy. Read only.
+static const uint32_t dma_reg_errors = 12;
+// Device to interrupt each time a chain finishes, or dma_no_interrupt.
+static const uint32_t dma_reg_interrupt_device = 16;
+// Interrupt code to send it.
+static const uint32_t dma_reg_interrupt_code = 20;
+static const uint32_t dma_no_interrupt = 0xFFFFFFFF;
+
+// Each descriptor is a u64 global source address, a u64 global destination address, a
+// u32 length in bytes, and a u32 holding the index of the next descriptor in the chain
+// plus one, or 0 to end the chain. Copies may cross devices and overlap.
+//
+// Copies go straight into the destination's memory, so a stack CPU which has already run
+// code there won't see them. After the completion interrupt, a guest which copied code
+// must write the destination address to the CPU's write-register 6 (Instruction Cache)
+// before jumping to it.
+static const uint32_t dma_descriptors = 32;
+static const uint32_t dma_descriptor_size = 24;
+
+// Chains which can be pending at once.
+static const uint32_t dma_queue_size = 64;
+
+struct DMAConfig {
+    // Descriptors in exported memory.
+    uint32_t descriptors;
+};
+
+struct Device* bscomp_device_new(const struct DMAConfig* config);
+void bscomp_device_destroy(struct Device* dev);
+
+#endif // bscomp_dma_h
@@ -0,0 +1,262 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "assembler.h"
+
+using namespace std;
+
+namespace {
+
+// Operand sizes, by name, as encoded in an instruction's size byte.
+const map<string, uint8_t> sizes = {
+    {"f32", 2}, {"u8", 3}, {"u16", 4}, {"u32", 5}, {"u64", 6}, {"f64", 7},
+};
+
+// Bytes of immediate pushed by `r` at each size.
+uint32_t immediate_length(uint8_t size) {
+    switch (size) {
+    case 2: return 4;
+    case 3: return 1;
+    case 4: return 2;
+    case 5: return 4;
+    case 6: return 8;
+    case 7: return 8;
+    default: return 0;
+    }
+}
+
+const string sized_opcodes = "+-*/&|^~_<>gl=!CDRWSU$r";
+const string bare_opcodes = "JIiwsu";
+
+struct Line {
+    int number;
+    vector<string> tokens;
+    uint64_t address;
+};
+
+class Assembler {
+public:
+    Assembler(vector<uint8_t>& image, string& error) : image(image), error(error) {}
+
+    bool run(const string& source) {
+        if (!parse(source)) {
+            return false;
+        }
+        // Every line's length is known without its operands' values, so one pass finds
+        // the labels and a second emits the code.
+        for (int pass = 0; pass < 2; ++pass) {
+            image.clear();
+            for (auto& line : lines) {
+                line.address = image.size();
+                if (!emit(line, pass == 1)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    bool parse(const string& source) {
+        istringstream in(source);
+        string text;
+        int number = 0;
+        while (getline(in, text)) {
+            ++number;
+            auto comment = text.find(';');
+            if (comment != string::npos) {
+                text.erase(comment);
+            }
+            istringstream words(text);
+            Line line = {number, {}, 0};
+            string word;
+            while (words >> word) {
+                line.tokens.push_back(word);
+            }
+            // Labels name the address of whatever follows them.
+            while (!line.tokens.empty() && line.tokens[0].size() > 1
+                    && line.tokens[0].back() == ':') {
+                string label = line.tokens[0].substr(0, line.tokens[0].size() - 1);
+                if (symbols.count(label)) {
+                    return fail(number, "duplicate symbol " + label);
+                }
+                symbols[label] = 0;
+                labels.push_back({label, lines.size()});
+                line.tokens.erase(line.tokens.begin());
+            }
+            lines.push_back(line);
+        }
+        return true;
+    }
+
+    bool fail(int number, const string& message) {
+        error = "line " + to_string(number) + ": " + message;
+        return false;
+    }
+
+    // Numbers, symbols, and sums of them. Symbols are only checked once known.
+    bool value(const Line& line, const string& text, bool final, uint64_t& result) {
+        result = 0;
+        size_t start = 0;
+        while (start <= text.size()) {
+            size_t end = text.find('+', start);
+            string term = text.substr(start, end == string::npos ? string::npos : end - start);
+            if (term.empty()) {
+                return fail(line.number, "bad value " + text);
+            }
+            char* rest;
+            uint64_t number = strtoull(term.c_str(), &rest, 0);
+            if (*rest == 0) {
+                result += number;
+            } else if (term[0] == '-' && (number = strtoll(term.c_str(), &rest, 0), *rest == 0)) {
+                result += number;
+            } else if (symbols.count(term)) {
+                result += symbols[term];
+            } else if (final) {
+                return fail(line.number, "unknown symbol " + term);
+            }
+            if (end == string::npos) {
+                break;
+            }
+            start = end + 1;
+        }
+        return true;
+    }
+
+    bool size(const Line& line, const string& name, uint8_t& result) {
+        auto found = sizes.find(name);
+        if (found == sizes.end()) {
+            return fail(line.number, "bad size " + name);
+        }
+        result = found->second;
+        return true;
+    }
+
+    void bytes(const void* data, uint32_t length) {
+        const uint8_t* start = static_cast<const uint8_t*>(data);
+        image.insert(image.end(), start, start + length);
+    }
+
+    bool emit(const Line& line, bool final) {
+        for (const auto& label : labels) {
+            if (&lines[label.second] == &line) {
+                symbols[label.first] = line.address;
+            }
+        }
+        const auto& t = line.tokens;
+        if (t.empty()) {
+            return true;
+        }
+        auto operands = [&](size_t count) {
+            return t.size() == count + 1 || fail(line.number, "expected " + to_string(count)
+                                                 + " operands for " + t[0]);
+        };
+
+        if (t[0] == ".equ") {
+            uint64_t v;
+            if (!operands(2) || !value(line, t[2], final, v)) {
+                return false;
+            }
+            symbols[t[1]] = v;
+            return true;
+        }
+        if (t[0] == ".u32" || t[0] == ".u64") {
+            uint64_t v;
+            if (!operands(1) || !value(line, t[1], final, v)) {
+                return false;
+            }
+            bytes(&v, t[0] == ".u32" ? 4 : 8);
+            return true;
+        }
+        if (t[0] == ".space") {
+            uint64_t v;
+            if (!operands(1) || !value(line, t[1], true, v)) {
+                return false;
+            }
+            image.resize(image.size() + v);
+            return true;
+        }
+        if (t[0] == "nop") {
+            if (!operands(0)) {
+                return false;
+            }
+            image.push_back(0);
+            image.push_back(0);
+            return true;
+        }
+        if (t[0].size() != 1) {
+            return fail(line.number, "unknown instruction " + t[0]);
+        }
+
+        char op = t[0][0];
+        uint8_t encoded = 0;
+        if (op == 'z') {
+            uint8_t from, to;
+            if (!operands(2) || !size(line, t[1], from) || !size(line, t[2], to)) {
+                return false;
+            }
+            encoded = from | (to << 3);
+        } else if (op == 'P' || op == 'p') {
+            uint64_t v;
+            if (!operands(1) || !value(line, t[1], true, v)) {
+                return false;
+            }
+            encoded = v;
+        } else if (op == 'r') {
+            if (!operands(2) || !size(line, t[1], encoded)) {
+                return false;
+            }
+        } else if (sized_opcodes.find(op) != string::npos) {
+            if (!operands(1) || !size(line, t[1], encoded)) {
+                return false;
+            }
+        } else if (bare_opcodes.find(op) != string::npos) {
+            if (!operands(0)) {
+                return false;
+            }
+        } else {
+            return fail(line.number, "unknown instruction " + t[0]);
+        }
+        image.push_back(op);
+        image.push_back(encoded);
+
+        if (op == 'r') {
+            const string& text = t[2];
+            if ((encoded == 2 || encoded == 7) && text.find_first_of(".eE") != string::npos
+                    && text.find("0x") == string::npos) {
+                double d = strtod(text.c_str(), 0);
+                float f = d;
+                if (encoded == 2) {
+                    bytes(&f, sizeof(f));
+                } else {
+                    bytes(&d, sizeof(d));
+                }
+                return true;
+            }
+            uint64_t v;
+            if (!value(line, text, final, v)) {
+                return false;
+            }
+            bytes(&v, immediate_length(encoded));
+        }
+        return true;
+    }
+
+    vector<uint8_t>& image;
+    string& error;
+    vector<Line> lines;
+    map<string, uint64_t> symbols;
+    // Each label, and the index of the line it names.
+    vector<pair<string, size_t>> labels;
+};
+
+} // namespace
+
+bool assemble(const string& source, vector<uint8_t>& image, string& error) {
+    return Assembler(image, error).run(source);
+}
@@ -0,0 +1,29 @@
+#ifndef bscomp_assembler_h
+#define bscomp_assembler_h
+// Assembler for stack CPU programs, for the fleet runner's corpus.
+//
+// One instruction or directive per line, optionally after a `label:`. Comments start
+// with `;`.
+//
+//     r SIZE VALUE       Push an immediate. VALUE may be a number, a symbol, or a sum
+//                        of them such as `ram+8`. Floats are allowed for f32 and f64.
+//     OP SIZE            Any other sized opcode, such as `+ u32` or `R u64`.
+//     z FROM TO          Resize, such as `z u32 u64`.
+//     P N, p N           Read or write register N.
+//     J, I, w, s, u      Opcodes without a size.
+//     nop
+//     .equ NAME VALUE    Define a symbol.
+//     .u32 VALUE, .u64 VALUE
+//                        Emit a value.
+//     .space N           Emit N zero bytes.
+//
+// Sizes are f32, u8, u16, u32, u64 and f64. Programs are assembled to run from address 0.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Returns false, with a message naming the line in error, if the source doesn't assemble.
+bool assemble(const std::string& source, std::vector<uint8_t>& image, std::string& error);
+
+#endif // bscomp_assembler_h
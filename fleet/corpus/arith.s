@@ -0,0 +1,44 @@
+; Integer and floating point arithmetic in a tight loop, with nothing touching memory
+; but the code itself.
+
+.equ iterations 2000000
+.equ exit 0xff04
+
+    r u32 iterations
+loop:
+    ; Work on a copy of the counter, and throw the result away.
+    C u32
+    C u32
+    * u32
+    r u32 7
+    + u32
+    r u32 0x5555
+    ^ u32
+    C u32
+    z u32 f64
+    r f64 1.5
+    * f64
+    r f64 0.25
+    + f64
+    D f64
+    D u32
+
+    ; Count down to zero.
+    r u32 1
+    $ u32
+    - u32
+    C u32
+    r u32 0
+    ! u32
+    r u64 loop
+    J
+
+    D u32
+    r u32 0
+    r u64 exit
+    W u32
+done:
+    w
+    r u32 1
+    r u64 done
+    J
@@ -0,0 +1,53 @@
+; Switches between two contexts: saves the whole internal stack to the memory stack, does
+; a little work in the other context, and brings the first back.
+
+.equ ram 0x100000000
+.equ stack_top ram+0x10000
+.equ iterations 1000000
+.equ exit 0xff04
+
+    r u64 stack_top
+    p 0
+
+    ; Registers of the first context, under its counter.
+    r u32 1
+    r u32 2
+    r u32 3
+    r u32 4
+    r u64 5
+    r u64 6
+    r f64 7.0
+    r u32 iterations
+loop:
+    s
+    ; The other context.
+    r u32 10
+    r u32 20
+    + u32
+    S u32
+    U u32
+    D u32
+    P 0
+    r u64 4
+    + u64
+    p 0
+    u
+
+    r u32 1
+    $ u32
+    - u32
+    C u32
+    r u32 0
+    ! u32
+    r u64 loop
+    J
+
+    D u32
+    r u32 0
+    r u64 exit
+    W u32
+done:
+    w
+    r u32 1
+    r u64 done
+    J
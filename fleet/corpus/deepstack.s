@@ -0,0 +1,81 @@
+; Builds an expression stack far deeper than the internal stack, then sums it back down,
+; over and over. The stack cache spills it to the memory stack and fills it back.
+
+.equ ram 0x100000000
+.equ passes_left ram
+.equ stack_top ram+0x100000
+.equ depth 50000
+; Sum of 1 to depth.
+.equ total 1250025000
+.equ passes 40
+.equ exit 0xff04
+
+    r u64 stack_top
+    p 0
+    ; Stack cache on.
+    r u32 4
+    p 4
+    r u32 passes
+    r u64 passes_left
+    W u32
+
+pass:
+    ; A zero to stop the sum at, then depth down to 1, then the sum so far.
+    r u32 0
+    r u32 depth
+push:
+    C u32
+    r u32 1
+    $ u32
+    - u32
+    C u32
+    r u32 0
+    ! u32
+    r u64 push
+    J
+
+sum:
+    $ u32
+    C u32
+    r u32 0
+    ! u32
+    r u64 add
+    J
+
+    ; Only the zero at the bottom is left under the sum.
+    D u32
+    r u32 total
+    - u32
+    C u32
+    r u64 fail
+    J
+    D u32
+
+    r u64 passes_left
+    R u32
+    r u32 1
+    $ u32
+    - u32
+    C u32
+    r u64 passes_left
+    W u32
+    r u32 0
+    ! u32
+    r u64 pass
+    J
+
+    r u32 0
+fail:
+    r u64 exit
+    W u32
+done:
+    w
+    r u32 1
+    r u64 done
+    J
+
+add:
+    + u32
+    r u32 1
+    r u64 sum
+    J
@@ -0,0 +1,62 @@
+; Asks for a hardware interrupt, waits for it, and does it again. Nearly all the time goes
+; on delivering interrupts, waking the CPU, and running the handler, which does the
+; counting.
+
+.equ ram 0x100000000
+.equ remaining ram
+.equ interrupt_stack_top ram+0x10000
+.equ iterations 200000
+.equ doorbell 0xff00
+.equ exit 0xff04
+
+    ; Handlers for codes 0 and 1, and a stack for them to return through.
+    r u64 table
+    p 2
+    r u32 2
+    p 3
+    r u64 interrupt_stack_top
+    p 1
+    r u32 iterations
+    r u64 remaining
+    W u32
+
+    ; Enable interrupts.
+    r u32 1
+    p 4
+loop:
+    r u32 1
+    r u64 doorbell
+    W u32
+    w
+
+    r u64 remaining
+    R u32
+    r u32 0
+    ! u32
+    r u64 loop
+    J
+
+    r u32 0
+    r u64 exit
+    W u32
+done:
+    w
+    r u32 1
+    r u64 done
+    J
+
+; Code 1, from the doorbell.
+ring:
+    r u64 remaining
+    R u32
+    r u32 1
+    $ u32
+    - u32
+    r u64 remaining
+    W u32
+ignore:
+    i
+
+table:
+    .u64 ignore
+    .u64 ring
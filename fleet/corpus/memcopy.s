@@ -0,0 +1,64 @@
+; Copies a block of RAM to another, a word at a time, over and over. The offset being
+; copied lives on the memory stack, as a local variable would.
+
+.equ ram 0x100000000
+.equ source ram
+.equ destination ram+0x10000
+.equ stack_top ram+0x20000
+.equ bytes 0x8000
+.equ passes 200
+.equ exit 0xff04
+
+    r u64 stack_top
+    p 0
+    r u32 passes
+pass:
+    r u64 0
+    S u64
+copy:
+    U u64
+    r u64 source
+    + u64
+    R u64
+    U u64
+    r u64 destination
+    + u64
+    W u64
+
+    ; Step the offset, in place on the memory stack.
+    U u64
+    r u64 8
+    + u64
+    P 0
+    W u64
+
+    U u64
+    r u64 bytes
+    ! u64
+    r u64 copy
+    J
+
+    ; Drop the offset from the memory stack.
+    P 0
+    r u64 8
+    + u64
+    p 0
+
+    r u32 1
+    $ u32
+    - u32
+    C u32
+    r u32 0
+    ! u32
+    r u64 pass
+    J
+
+    D u32
+    r u32 0
+    r u64 exit
+    W u32
+done:
+    w
+    r u32 1
+    r u64 done
+    J
@@ -0,0 +1,434 @@
+// End-to-end throughput of whole machines. Run with `make bench`.
+//
+// Assembles each guest program given on the command line, then runs it on fleets of
+// machines at once: a motherboard with the program, a RAM device and a stack CPU, without
+// Python in the way. Each run prints one JSON object on its own line, with the aggregate
+// instructions per second, percentiles of the time each machine took to finish, and the
+// host memory in use. Devices log to the same output, so keep just the lines starting
+// with `{`.
+//
+// Guest programs see this memory map:
+//
+//     0x0000_0000 - 0x0000_ffff    The program, read-only. Writing a u32 to 0xff00 sends
+//                                  that interrupt code to the CPU; writing one to 0xff04
+//                                  ends the run, with that exit code.
+//     0x1_0000_0000 -              RAM.
+//
+// The CPU starts at address 0, with interrupts disabled and no memory stack.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dlfcn.h>
+#include <getopt.h>
+
+extern "C" {
+#include "motherboard.h"
+}
+
+// Each device header declares its own bscomp_device_new. Only the configs are used here,
+// as the functions are looked up in the device libraries, so RAM's go in a namespace.
+#include "stacker.h"
+namespace ram {
+#include "ram.h"
+}
+
+#include "assembler.h"
+
+using namespace std;
+
+// Memory exported by the program device, and its command registers.
+static const uint32_t program_memory_size = 1 << 16;
+static const uint32_t program_doorbell = 0xff00;
+static const uint32_t program_exit = 0xff04;
+
+// Each motherboard holds the program device, RAM and the CPU, in that order.
+static const uint32_t cpu_slot = 2;
+
+// Device libraries, relative to the top of the repository.
+static const char* default_ram_library = "ram/libbridgesimram.so";
+static const char* default_cpu_library = "stack-cpu/libbridgesimstackcpu.so";
+
+static int64_t steady_nanoseconds() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Entry points of a device library. Every device library exports bscomp_device_new, so
+// each is opened on its own rather than linked in.
+struct DeviceLibrary {
+    void* handle;
+    Device* (*create)(const void*);
+    void (*destroy)(Device*);
+    // Only in the stack CPU's library.
+    int32_t (*start_trace)(Device*, const char*);
+
+    bool open(const char* path) {
+        handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            fprintf(stderr, "Could not load %s: %s\n", path, dlerror());
+            return false;
+        }
+        create = (Device* (*)(const void*))dlsym(handle, "bscomp_device_new");
+        destroy = (void (*)(Device*))dlsym(handle, "bscomp_device_destroy");
+        if (!create || !destroy) {
+            fprintf(stderr, "%s is not a device library\n", path);
+            return false;
+        }
+        start_trace = (int32_t (*)(Device*, const char*))dlsym(handle,
+                                                               "bscomp_stackcpu_start_trace");
+        return true;
+    }
+};
+
+// Holds the program at address 0 and takes commands from the guest. The image is shared
+// by every machine, and mapped read-only.
+struct ProgramDevice {
+    const vector<uint8_t>* image;
+    void* motherboard;
+    MotherboardFunctions funcs;
+    // When the guest wrote the exit register, or 0 if it hasn't yet.
+    atomic<int64_t> finished;
+    atomic<uint32_t> exit_code;
+};
+
+extern "C" {
+    static int32_t program_load(void* dev, uint32_t addr, uint32_t len, uint8_t* dest) {
+        const vector<uint8_t>& image = *static_cast<ProgramDevice*>(dev)->image;
+        for (uint32_t i = 0; i < len; ++i) {
+            dest[i] = uint64_t(addr) + i < image.size() ? image[addr + i] : 0;
+        }
+        return 0;
+    }
+
+    static int32_t program_write(void* dev, uint32_t addr, uint32_t len, uint8_t* src) {
+        ProgramDevice* program = static_cast<ProgramDevice*>(dev);
+        if (len != sizeof(uint32_t)) {
+            return 0;
+        }
+        uint32_t value;
+        memcpy(&value, src, sizeof(value));
+        if (addr == program_doorbell) {
+            program->funcs.send_interrupt(program->motherboard, cpu_slot, value);
+        } else if (addr == program_exit) {
+            program->exit_code.store(value, memory_order_relaxed);
+            program->finished.store(steady_nanoseconds(), memory_order_release);
+            program->funcs.send_interrupt(program->motherboard, ~0u, 0);
+        }
+        return 0;
+    }
+
+    static int32_t program_register(void* dev, void* motherboard,
+                                    MotherboardFunctions* funcs) {
+        ProgramDevice* program = static_cast<ProgramDevice*>(dev);
+        program->motherboard = motherboard;
+        program->funcs = *funcs;
+        return 0;
+    }
+
+    static int32_t program_map(void* dev, uint8_t** base, uint32_t* len, uint32_t* flags) {
+        const vector<uint8_t>& image = *static_cast<ProgramDevice*>(dev)->image;
+        *base = const_cast<uint8_t*>(image.data());
+        *len = image.size();
+        *flags = bscomp_map_readable;
+        return 0;
+    }
+}
+
+struct Options {
+    vector<uint32_t> machines = {1, 2, 4, 8};
+    // Run on a runtime with this many threads, or boot every machine on its own thread.
+    bool runtime = true;
+    uint32_t threads = 0;
+    uint32_t step_budget = 0;
+    uint32_t jit_mode = stack_cpu_jit_off;
+    uint32_t ram_size = 1 << 20;
+    uint32_t stack_size = 256;
+    const char* ram_library = default_ram_library;
+    const char* cpu_library = default_cpu_library;
+    // If set, the first machine of each run is traced to a file starting with this.
+    const char* trace_prefix = 0;
+    vector<string> programs;
+};
+
+struct Workload {
+    string name;
+    vector<uint8_t> image;
+};
+
+struct Machine {
+    void* motherboard;
+    Device* ram;
+    Device* cpu;
+    ProgramDevice program;
+};
+
+// Resident and peak resident bytes of this process.
+static void memory_usage(uint64_t& rss, uint64_t& peak) {
+    rss = peak = 0;
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        uint64_t kb = 0;
+        if (sscanf(line.c_str(), "VmRSS: %llu kB", (unsigned long long*)&kb) == 1) {
+            rss = kb << 10;
+        } else if (sscanf(line.c_str(), "VmHWM: %llu kB", (unsigned long long*)&kb) == 1) {
+            peak = kb << 10;
+        }
+    }
+}
+
+// Percentile of sorted samples.
+static double percentile(const vector<double>& sorted, double p) {
+    return sorted[min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+static bool build_machine(Machine& machine, const Workload& workload, const Options& options,
+                          DeviceLibrary& ram_library, DeviceLibrary& cpu_library) {
+    machine.motherboard = 0;
+    machine.program.image = &workload.image;
+    machine.program.finished.store(0, memory_order_relaxed);
+    machine.program.exit_code.store(0, memory_order_relaxed);
+
+    ram::RAMConfig ram_config = {options.ram_size, 0, 0};
+    machine.ram = ram_library.create(&ram_config);
+    StackCPUConfig cpu_config = {};
+    cpu_config.stack_size = options.stack_size;
+    cpu_config.jit_mode = options.jit_mode;
+    machine.cpu = cpu_library.create(&cpu_config);
+    if (!machine.ram || !machine.cpu) {
+        return false;
+    }
+
+    Device program = {};
+    program.device = &machine.program;
+    program.device_type = 1;
+    program.export_memory_size = workload.image.size();
+    program.load_bytes = &program_load;
+    program.write_bytes = &program_write;
+    program.register_motherboard = &program_register;
+    program.map_memory = &program_map;
+
+    MotherboardConfig config = {3};
+    machine.motherboard = bscomp_motherboard_new(&config);
+    // Added in slot order.
+    return machine.motherboard
+        && !bscomp_motherboard_add_device(machine.motherboard, &program)
+        && !bscomp_motherboard_add_device(machine.motherboard, machine.ram)
+        && !bscomp_motherboard_add_device(machine.motherboard, machine.cpu);
+}
+
+static void destroy_machine(Machine& machine, DeviceLibrary& ram_library,
+                            DeviceLibrary& cpu_library) {
+    if (machine.motherboard) {
+        bscomp_motherboard_destroy(machine.motherboard);
+    }
+    ram_library.destroy(machine.ram);
+    cpu_library.destroy(machine.cpu);
+}
+
+static bool run(const Workload& workload, uint32_t count, const Options& options,
+                DeviceLibrary& ram_library, DeviceLibrary& cpu_library) {
+    vector<Machine> machines(count);
+    bool built = true;
+    for (auto& machine : machines) {
+        built = build_machine(machine, workload, options, ram_library, cpu_library) && built;
+    }
+
+    if (built && options.trace_prefix) {
+        string path = string(options.trace_prefix) + workload.name + "-" + to_string(count)
+            + ".trace";
+        if (!cpu_library.start_trace || cpu_library.start_trace(machines[0].cpu, path.c_str())) {
+            fprintf(stderr, "Could not trace to %s\n", path.c_str());
+        }
+    }
+
+    int64_t start = 0, end = 0;
+    if (built) {
+        if (options.runtime) {
+            RuntimeConfig config = {options.threads, options.step_budget};
+            void* runtime = bscomp_runtime_new(&config);
+            start = steady_nanoseconds();
+            for (auto& machine : machines) {
+                bscomp_runtime_boot(runtime, machine.motherboard);
+            }
+            for (auto& machine : machines) {
+                bscomp_runtime_wait(runtime, machine.motherboard);
+            }
+            end = steady_nanoseconds();
+            bscomp_runtime_destroy(runtime);
+        } else {
+            vector<thread> threads;
+            start = steady_nanoseconds();
+            for (auto& machine : machines) {
+                void* motherboard = machine.motherboard;
+                threads.emplace_back([motherboard]() { bscomp_motherboard_boot(motherboard); });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            end = steady_nanoseconds();
+        }
+    }
+
+    uint64_t rss, peak_rss;
+    memory_usage(rss, peak_rss);
+
+    uint64_t instructions = 0;
+    uint32_t failed = 0;
+    vector<double> latencies;
+    for (auto& machine : machines) {
+        if (!built) {
+            break;
+        }
+        uint64_t counters[3] = {};
+        if (machine.cpu->read_counters) {
+            machine.cpu->read_counters(machine.cpu->device, counters, 3);
+        }
+        instructions += counters[0];
+        int64_t finished = machine.program.finished.load(memory_order_acquire);
+        if (!finished || machine.program.exit_code.load(memory_order_relaxed)) {
+            ++failed;
+        } else {
+            latencies.push_back((finished - start) / 1e6);
+        }
+    }
+    for (auto& machine : machines) {
+        destroy_machine(machine, ram_library, cpu_library);
+    }
+
+    if (!built) {
+        fprintf(stderr, "Could not build %u machines for %s\n", count, workload.name.c_str());
+        return false;
+    }
+    if (latencies.empty()) {
+        latencies.push_back(0);
+    }
+    sort(latencies.begin(), latencies.end());
+    double seconds = (end - start) / 1e9;
+    printf("{\"suite\": \"fleet\", \"workload\": \"%s\", \"machines\": %u, \"mode\": \"%s\", "
+           "\"jit\": %u, \"seconds\": %.4f, \"instructions\": %llu, \"mips\": %.2f, "
+           "\"latency_p50_ms\": %.2f, \"latency_p90_ms\": %.2f, \"latency_p99_ms\": %.2f, "
+           "\"latency_max_ms\": %.2f, \"failed\": %u, \"rss_bytes\": %llu, "
+           "\"peak_rss_bytes\": %llu}\n",
+           workload.name.c_str(), count, options.runtime ? "runtime" : "boot",
+           options.jit_mode, seconds, (unsigned long long)instructions,
+           instructions / seconds / 1e6, percentile(latencies, 0.5),
+           percentile(latencies, 0.9), percentile(latencies, 0.99), latencies.back(), failed,
+           (unsigned long long)rss, (unsigned long long)peak_rss);
+    fflush(stdout);
+    return !failed;
+}
+
+static bool load_workload(const string& path, Workload& workload) {
+    ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "Could not read %s\n", path.c_str());
+        return false;
+    }
+    stringstream source;
+    source << in.rdbuf();
+
+    string error;
+    if (!assemble(source.str(), workload.image, error)) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+        return false;
+    }
+    if (workload.image.size() > program_doorbell) {
+        fprintf(stderr, "%s: program overlaps the command registers\n", path.c_str());
+        return false;
+    }
+    workload.image.resize(program_memory_size);
+
+    // Named after the file, less its directory and extension.
+    auto slash = path.find_last_of('/');
+    workload.name = path.substr(slash == string::npos ? 0 : slash + 1);
+    workload.name = workload.name.substr(0, workload.name.find('.'));
+    return true;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [options] PROGRAM.s...\n"
+            "  -m COUNTS   Comma separated machine counts to run (default 1,2,4,8)\n"
+            "  -b          Boot each machine on its own threads, rather than a runtime\n"
+            "  -t THREADS  Runtime threads (default one per host CPU)\n"
+            "  -s BUDGET   Runtime step budget (default the runtime's)\n"
+            "  -j MODE     Stack CPU JIT mode: 0 off, 1 on, 2 differential (default 0)\n"
+            "  -r BYTES    RAM per machine (default 1 MiB)\n"
+            "  -R PATH     RAM device library (default %s)\n"
+            "  -C PATH     Stack CPU device library (default %s)\n"
+            "  -T PREFIX   Trace the first machine of each run to PREFIX<workload>-<machines>.trace\n",
+            name, default_ram_library, default_cpu_library);
+}
+
+static bool parse_options(int argc, char** argv, Options& options) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:bt:s:j:r:R:C:T:h")) != -1) {
+        switch (opt) {
+        case 'm': {
+            options.machines.clear();
+            stringstream counts(optarg);
+            string count;
+            while (getline(counts, count, ',')) {
+                uint32_t n = strtoul(count.c_str(), 0, 0);
+                if (!n) {
+                    return false;
+                }
+                options.machines.push_back(n);
+            }
+            break;
+        }
+        case 'b': options.runtime = false; break;
+        case 't': options.threads = strtoul(optarg, 0, 0); break;
+        case 's': options.step_budget = strtoul(optarg, 0, 0); break;
+        case 'j': options.jit_mode = strtoul(optarg, 0, 0); break;
+        case 'r': options.ram_size = strtoul(optarg, 0, 0); break;
+        case 'R': options.ram_library = optarg; break;
+        case 'C': options.cpu_library = optarg; break;
+        case 'T': options.trace_prefix = optarg; break;
+        default: return false;
+        }
+    }
+    for (int i = optind; i < argc; ++i) {
+        options.programs.push_back(argv[i]);
+    }
+    return !options.programs.empty() && !options.machines.empty();
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    DeviceLibrary ram_library, cpu_library;
+    if (!ram_library.open(options.ram_library) || !cpu_library.open(options.cpu_library)) {
+        return 1;
+    }
+
+    vector<Workload> workloads(options.programs.size());
+    for (size_t i = 0; i < workloads.size(); ++i) {
+        if (!load_workload(options.programs[i], workloads[i])) {
+            return 1;
+        }
+    }
+
+    bool ok = true;
+    for (const auto& workload : workloads) {
+        for (uint32_t count : options.machines) {
+            ok = run(workload, count, options, ram_library, cpu_library) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
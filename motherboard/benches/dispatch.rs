@@ -0,0 +1,285 @@
+//! Cost of the motherboard's memory and interrupt dispatch. Run with `cargo bench`.
+//!
+//! Boots a motherboard holding a probe device and a few kinds of memory device. The probe
+//! times the motherboard callbacks from its boot thread, just as a CPU would make them,
+//! then halts the machine. Each result is printed as one JSON object on its own line;
+//! the motherboard's own messages are mixed in, and don't start with `{`.
+
+extern crate libc;
+extern crate motherboard;
+
+use libc::c_void;
+use std::ptr;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use motherboard::{
+    Device, MemorySegment, Motherboard, MotherboardConfig, MotherboardFunctions,
+    bscomp_motherboard_add_device, bscomp_motherboard_boot, bscomp_motherboard_destroy,
+    bscomp_motherboard_halt, bscomp_motherboard_new,
+};
+
+/// Each measurement runs for at least this long, and the fastest of `REPEATS`
+/// measurements is reported.
+const MIN_TIME: Duration = Duration::from_millis(20);
+const REPEATS: usize = 3;
+
+/// Bytes of memory exported by each memory device.
+const MEMORY_SIZE: usize = 1 << 20;
+/// Segments per vectored call; the transfer size is split evenly between them.
+const SEGMENTS: usize = 16;
+const SIZES: [usize; 6] = [4, 8, 64, 512, 4096, 65536];
+
+/// Device type of a device which exports memory.
+const MAPS_MEMORY: u64 = 1 << 0;
+
+/// Slots on the motherboard, in the order they're added. Memory devices are also mapped
+/// in this order, so the first is at global address 0 and the second at 1 << 32.
+const PROBE: u32 = 0;
+const SCALAR_MEMORY: u64 = 0;
+const VECTORED_MEMORY: u64 = 1;
+const INFO_BLOCK: u64 = 0xffffffff;
+const UNMAPPED: u64 = 0x1000;
+
+struct Probe {
+    motherboard: *mut Motherboard,
+    funcs: Option<MotherboardFunctions>,
+    interrupts: AtomicU64,
+}
+
+fn blank_device() -> Device {
+    Device {
+        device: ptr::null_mut(),
+        device_type: 0,
+        device_id: 0,
+        export_memory_size: 0,
+        load_bytes: None,
+        write_bytes: None,
+        init: None,
+        reset: None,
+        cleanup: None,
+        boot: None,
+        halt: None,
+        interrupt: None,
+        register_motherboard: None,
+        map_memory: None,
+        step: None,
+        snapshot: None,
+        restore: None,
+        clone: None,
+        destroy: None,
+        load_bytes_v: None,
+        write_bytes_v: None,
+        read_counters: None,
+    }
+}
+
+// Memory devices: a plain byte vector behind the scalar callbacks, and optionally the
+// vectored ones.
+
+extern fn memory_load(dev: *mut c_void, addr: u32, len: u32, dest: *mut u8) -> i32 {
+    let memory = unsafe { &*(dev as *const Vec<u8>) };
+    let start = addr as usize;
+    let end = std::cmp::min(start + len as usize, memory.len());
+    if start < end {
+        unsafe { ptr::copy_nonoverlapping(memory[start..].as_ptr(), dest, end - start) };
+    }
+    0
+}
+
+extern fn memory_write(dev: *mut c_void, addr: u32, len: u32, src: *const u8) -> i32 {
+    let memory = unsafe { &mut *(dev as *mut Vec<u8>) };
+    let start = addr as usize;
+    let end = std::cmp::min(start + len as usize, memory.len());
+    if start < end {
+        unsafe { ptr::copy_nonoverlapping(src, memory[start..].as_mut_ptr(), end - start) };
+    }
+    0
+}
+
+extern fn memory_load_v(dev: *mut c_void, segments: *const MemorySegment, count: u32) -> i32 {
+    let segments = unsafe { std::slice::from_raw_parts(segments, count as usize) };
+    for segment in segments {
+        memory_load(dev, segment.address as u32, segment.length, segment.buffer);
+    }
+    0
+}
+
+extern fn memory_write_v(dev: *mut c_void, segments: *const MemorySegment, count: u32) -> i32 {
+    let segments = unsafe { std::slice::from_raw_parts(segments, count as usize) };
+    for segment in segments {
+        memory_write(dev, segment.address as u32, segment.length, segment.buffer);
+    }
+    0
+}
+
+fn memory_device(memory: &mut Vec<u8>, vectored: bool) -> Device {
+    let mut device = blank_device();
+    device.device = memory as *mut Vec<u8> as *mut c_void;
+    device.device_type = MAPS_MEMORY;
+    device.export_memory_size = memory.len() as u32;
+    device.load_bytes = Some(memory_load);
+    device.write_bytes = Some(memory_write);
+    if vectored {
+        device.load_bytes_v = Some(memory_load_v);
+        device.write_bytes_v = Some(memory_write_v);
+    }
+    device
+}
+
+// The probe device.
+
+extern fn probe_register(dev: *mut c_void, mb: *mut Motherboard,
+                         funcs: *mut MotherboardFunctions) -> i32 {
+    let probe = unsafe { &mut *(dev as *mut Probe) };
+    probe.motherboard = mb;
+    probe.funcs = Some(unsafe { *funcs });
+    0
+}
+
+extern fn probe_interrupt(dev: *mut c_void, _code: u32) -> i32 {
+    let probe = unsafe { &*(dev as *const Probe) };
+    probe.interrupts.fetch_add(1, Ordering::Relaxed);
+    0
+}
+
+extern fn probe_halt(_dev: *mut c_void) -> i32 {
+    0
+}
+
+extern fn probe_boot(dev: *mut c_void) -> i32 {
+    let probe = unsafe { &*(dev as *const Probe) };
+    run_benches(probe);
+    bscomp_motherboard_halt(probe.motherboard);
+    0
+}
+
+/// Nanoseconds per call of `op`, from the fastest run.
+fn measure<F: FnMut(u64)>(mut op: F) -> f64 {
+    let mut iterations = 1u64;
+    let mut best = 0f64;
+    for _ in 0..REPEATS {
+        loop {
+            let start = Instant::now();
+            for i in 0..iterations {
+                op(i);
+            }
+            let elapsed = start.elapsed();
+            if elapsed >= MIN_TIME {
+                let ns = (elapsed.as_secs() as f64 * 1e9 + elapsed.subsec_nanos() as f64)
+                    / iterations as f64;
+                if best == 0.0 || ns < best {
+                    best = ns;
+                }
+                break;
+            }
+            iterations *= 2;
+        }
+    }
+    best
+}
+
+fn report(bench: &str, target: &str, bytes: usize, ns: f64) {
+    println!("{{\"suite\": \"motherboard\", \"bench\": \"{}\", \"target\": \"{}\", \
+              \"bytes\": {}, \"ns_per_op\": {:.2}, \"bytes_per_second\": {:.0}}}",
+             bench, target, bytes, ns, bytes as f64 / ns * 1e9);
+}
+
+fn run_benches(probe: &Probe) {
+    let mb = probe.motherboard;
+    let funcs = probe.funcs.unwrap();
+    let read_bytes = funcs.read_bytes.unwrap();
+    let write_bytes = funcs.write_bytes.unwrap();
+    let read_bytes_v = funcs.read_bytes_v.unwrap();
+    let write_bytes_v = funcs.write_bytes_v.unwrap();
+    let send_interrupt = funcs.send_interrupt.unwrap();
+
+    let mut buffer = vec![0x5au8; *SIZES.last().unwrap()];
+    // Name, base address, and whether to step through memory rather than hitting the
+    // same bytes every time. The information block is small, so reads always start at
+    // its beginning.
+    let targets = [
+        ("scalar_device", SCALAR_MEMORY << 32, true),
+        ("vectored_device", VECTORED_MEMORY << 32, true),
+        ("info_block", INFO_BLOCK << 32, false),
+        ("unmapped", UNMAPPED << 32, true),
+    ];
+
+    for &(target, base, step) in targets.iter() {
+        for &size in SIZES.iter() {
+            let address = |i: u64| if step {
+                base + (i * size as u64) % (MEMORY_SIZE - size) as u64
+            } else {
+                base
+            };
+            let buf = buffer.as_mut_ptr();
+
+            let ns = measure(|i| { read_bytes(mb, address(i), size as u32, buf); });
+            report("read_bytes", target, size, ns);
+            let ns = measure(|i| { write_bytes(mb, address(i), size as u32, buf); });
+            report("write_bytes", target, size, ns);
+
+            if size < SEGMENTS {
+                continue;
+            }
+            let length = size / SEGMENTS;
+            let mut segments: Vec<MemorySegment> = (0..SEGMENTS).map(|s| MemorySegment {
+                address: 0,
+                length: length as u32,
+                buffer: unsafe { buf.offset((s * length) as isize) },
+            }).collect();
+            let place = |segments: &mut Vec<MemorySegment>, i: u64| {
+                for (s, segment) in segments.iter_mut().enumerate() {
+                    segment.address = address(i) + (s * length) as u64;
+                }
+            };
+
+            let ns = measure(|i| {
+                place(&mut segments, i);
+                read_bytes_v(mb, segments.as_ptr(), SEGMENTS as u32);
+            });
+            report("read_bytes_v", target, size, ns);
+            let ns = measure(|i| {
+                place(&mut segments, i);
+                write_bytes_v(mb, segments.as_ptr(), SEGMENTS as u32);
+            });
+            report("write_bytes_v", target, size, ns);
+        }
+    }
+
+    let ns = measure(|i| { send_interrupt(mb, PROBE, i as u32); });
+    println!("{{\"suite\": \"motherboard\", \"bench\": \"send_interrupt\", \
+              \"ns_per_op\": {:.2}, \"delivered\": {}}}",
+             ns, probe.interrupts.load(Ordering::Relaxed));
+}
+
+fn main() {
+    let mut probe = Box::new(Probe {
+        motherboard: ptr::null_mut(),
+        funcs: None,
+        interrupts: AtomicU64::new(0),
+    });
+    let mut scalar_memory = vec![0u8; MEMORY_SIZE];
+    let mut vectored_memory = vec![0u8; MEMORY_SIZE];
+
+    let mut probe_device = blank_device();
+    probe_device.device = &mut *probe as *mut Probe as *mut c_void;
+    probe_device.register_motherboard = Some(probe_register);
+    probe_device.boot = Some(probe_boot);
+    probe_device.halt = Some(probe_halt);
+    probe_device.interrupt = Some(probe_interrupt);
+
+    let mut devices = [
+        probe_device,
+        memory_device(&mut scalar_memory, false),
+        memory_device(&mut vectored_memory, true),
+    ];
+
+    let config = MotherboardConfig { max_devices: devices.len() as u32 };
+    let mb = bscomp_motherboard_new(&config);
+    for device in devices.iter_mut() {
+        bscomp_motherboard_add_device(mb, device);
+    }
+    bscomp_motherboard_boot(mb);
+    bscomp_motherboard_destroy(mb);
+}
@@ -6,6 +6,16 @@
 
 struct MotherboardFunctions;
 
+// One range of memory in a vectored read or write.
+struct MemorySegment {
+    // Global address for the motherboard's callbacks, local address for a device's.
+    uint64_t address;
+    // Number of bytes.
+    uint32_t length;
+    // Bytes to read into, or to write from.
+    uint8_t* buffer;
+};
+
 struct MotherboardConfig {
     uint32_t max_devices;
 };
@@ -112,8 +122,92 @@ struct Device {
     //
     // This function is called before init, reset, or boot.
     int32_t (*register_motherboard)(void*, void*, struct MotherboardFunctions*);
+
+    // Device, Base, Length, Flags
+    // Optional function to give other devices direct access to exported memory.
+    //
+    // Stores a pointer to the start of the exported memory, its length in bytes, and
+    // bscomp_map_* flags saying how it may be accessed. The memory must not move between
+    // init and cleanup.
+    //
+    // Devices which need to see every access should not provide this. Everyone else will
+    // still use load_bytes and write_bytes for anything the flags don't allow.
+    int32_t (*map_memory)(void*, uint8_t**, uint32_t*, uint32_t*);
+
+    // Device, Budget
+    // Optional function to run the device for a while and then return, as an alternative
+    // to boot for motherboards run on a runtime.
+    //
+    // The budget says how much work to do before returning, in units chosen by the
+    // device (instructions, for a CPU). Returns bscomp_step_ready if the device has more
+    // to do, bscomp_step_idle if it has nothing to do until it is sent an interrupt, or a
+    // negative simulator error, after which it is not stepped again until the motherboard
+    // reboots.
+    //
+    // Devices which provide this should still provide boot and halt for motherboards
+    // booted on their own. Devices which don't are booted on their own threads as usual.
+    int32_t (*step)(void*, uint32_t);
+
+    // Device, Buffer, Buffer Length, Snapshot Length
+    // Optional function to save the device's state for a snapshot.
+    //
+    // Always stores the length of the device's snapshot, but only writes the snapshot if
+    // it fits in the buffer. Only called while the device is booted but not running, so
+    // the state can't change between calls.
+    int32_t (*snapshot)(void*, uint8_t*, uint32_t, uint32_t*);
+
+    // Device, Saved State, Length
+    // Optional function to put the device back in a state saved by snapshot.
+    //
+    // Called in the same conditions as snapshot, instead of reset. The saved state is
+    // only valid until the function returns.
+    int32_t (*restore)(void*, const uint8_t*, uint32_t);
+
+    // Device, Count, Copies
+    // Optional function to make copies of the device, for cloning a whole machine.
+    //
+    // Fills in count Devices describing copies which are initialized and in the same
+    // state as the original, ready to boot without init or reset. Called in the same
+    // conditions as snapshot. Copies must provide destroy, and should share as much as
+    // they can with the original and each other until they diverge. On failure, returns
+    // nonzero having already destroyed any copies it made; the motherboard won't touch
+    // the Devices it passed in.
+    int32_t (*clone)(void*, uint32_t, struct Device*);
+
+    // Device
+    // Function to free a device made by clone. Called by the motherboard which owns the
+    // copy when it is destroyed, after any cleanup.
+    int32_t (*destroy)(void*);
+
+    // Device, Segments, Segment Count
+    // Optional function to load several ranges of the device's memory in one call.
+    //
+    // Segments have local addresses. Each should be treated as a call to load_bytes, in
+    // order. Devices without it get one load_bytes call per segment.
+    int32_t (*load_bytes_v)(void*, const struct MemorySegment*, uint32_t);
+
+    // Device, Segments, Segment Count
+    // Optional function to write several ranges of the device's memory in one call, as
+    // load_bytes_v does for write_bytes.
+    int32_t (*write_bytes_v)(void*, const struct MemorySegment*, uint32_t);
+
+    // Device, Counters, Capacity
+    // Optional function to read the device's own performance counters. Copies up to
+    // capacity of them and returns how many the device has, which must not change once
+    // it is created. Called from any thread, at any time.
+    uint32_t (*read_counters)(void*, uint64_t*, uint32_t);
 };
 
+// Directly mapped memory may be read through the pointer.
+static const uint32_t bscomp_map_readable = 1 << 0;
+// Directly mapped memory may be written through the pointer.
+static const uint32_t bscomp_map_writable = 1 << 1;
+
+// The stepped device has more work to do.
+static const int32_t bscomp_step_ready = 0;
+// The stepped device has nothing to do until it receives an interrupt.
+static const int32_t bscomp_step_idle = 1;
+
 struct MotherboardFunctions {
     // Callback for a device to read a byte of memory.
     //
@@ -136,6 +230,32 @@ struct MotherboardFunctions {
     // Motherboard, Target Device, Interrupt Code.
     // Callback for a device to send an interrupt to another device.
     int32_t (*send_interrupt)(void*, uint32_t, uint32_t);
+
+    // Callback for a device to get direct access to memory.
+    //
+    // Should take five arguments:
+    // - The motherboard
+    // - The (global) address to map
+    // - Where to store a pointer to the byte at that address
+    // - Where to store the number of bytes which may be accessed through the pointer
+    // - Where to store the bscomp_map_* flags for those bytes
+    //
+    // If the memory can't be mapped, stores a null pointer and a length of 0, and the
+    // caller should use read_bytes and write_bytes instead. The pointer stays valid until
+    // the caller's boot function returns.
+    int32_t (*map_bytes)(void*, uint64_t, uint8_t**, uint32_t*, uint32_t*);
+
+    // Motherboard, Segments, Segment Count
+    // Callback for a device to read several ranges of memory at once.
+    //
+    // Segments have global addresses. Equivalent to calling read_bytes for each segment
+    // in order, but calls each device once for each run of segments in its memory.
+    int32_t (*read_bytes_v)(void*, const struct MemorySegment*, uint32_t);
+
+    // Motherboard, Segments, Segment Count
+    // Callback for a device to write several ranges of memory at once, as read_bytes_v
+    // does for write_bytes.
+    int32_t (*write_bytes_v)(void*, const struct MemorySegment*, uint32_t);
 };
 
 // Create a motherboard with a pluggable device capacity of max_devices
@@ -182,4 +302,77 @@ int32_t bscomp_motherboard_halt(void* motherboard);
 // Reboot the motherboard
 int32_t bscomp_motherboard_reboot(void* motherboard);
 
+// Save a booted motherboard to the file at path.
+//
+// Every device is stopped while the snapshot is taken, and started again where it left
+// off afterwards. Must not be called from a device's boot or step function. The format is
+// described in motherboard/src/snapshot.rs.
+int32_t bscomp_motherboard_snapshot(void* motherboard, const char* path);
+
+// Put a booted motherboard back in the state saved in the file at path.
+//
+// The motherboard must have the same devices, in the same slots, as the one the snapshot
+// was taken of. Every device is stopped while the snapshot is restored, and started again
+// without being reset. Must not be called from a device's boot or step function.
+int32_t bscomp_motherboard_restore(void* motherboard, const char* path);
+
+// Make count copies of a booted motherboard, storing them in clones.
+//
+// Every device is stopped while it is copied, and started again where it left off
+// afterwards. The copies boot where the original was, rather than initializing and
+// resetting their devices. Fails with -2, making no copies, if any device doesn't provide
+// clone. Must not be called from a device's boot or step function.
+//
+// Each copy must be passed to bscomp_motherboard_destroy, which also frees its devices.
+int32_t bscomp_motherboard_clone(void* motherboard, uint32_t count, void** clones);
+
+// Traffic through the motherboard to one device.
+struct DeviceTraffic {
+    // Calls which read the device's memory, and the bytes they asked for.
+    uint64_t loads;
+    uint64_t bytes_loaded;
+    // Calls which wrote the device's memory, and the bytes they asked to write.
+    uint64_t writes;
+    uint64_t bytes_written;
+    // Interrupts sent to the device.
+    uint64_t interrupts;
+};
+
+// Copy the traffic the motherboard has passed to a device since it was booted.
+//
+// Accesses through directly mapped memory don't pass through the motherboard, and so
+// aren't counted. The same counters are readable from inside the machine, in the
+// information block described in motherboard/src/memoryhandling.md.
+int32_t bscomp_motherboard_device_traffic(
+    void* motherboard, uint32_t device, struct DeviceTraffic* traffic);
+
+struct RuntimeConfig {
+    // Threads to run motherboards on. 0 uses one per host CPU.
+    uint32_t threads;
+    // Budget passed to each device's step function. 0 picks a default.
+    uint32_t step_budget;
+};
+
+// Create a pool of threads to run many motherboards on, as an alternative to booting
+// each with bscomp_motherboard_boot.
+//
+// Motherboards on a runtime have their devices stepped in turn on the pool's threads.
+// Devices which can't be stepped are booted on their own threads, as usual. Halt and
+// reboot motherboards on a runtime as usual.
+//
+// To dealocate a runtime created with this function, always pass the resulting pointer
+// to bscomp_runtime_destroy.
+void* bscomp_runtime_new(struct RuntimeConfig* config);
+
+// Halt any motherboards still on the runtime, wait for them, and free the runtime.
+void bscomp_runtime_destroy(void* runtime);
+
+// Boot a motherboard on the runtime. Returns as soon as it's running.
+//
+// The motherboard must not be destroyed until it has halted.
+int32_t bscomp_runtime_boot(void* runtime, void* motherboard);
+
+// Wait for a motherboard booted on the runtime to halt.
+int32_t bscomp_runtime_wait(void* runtime, void* motherboard);
+
 #endif // bscomp_motherboard_h
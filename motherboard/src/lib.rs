@@ -2,16 +2,29 @@ extern crate libc;
 
 use libc::c_void;
 use std::mem;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
 use std::sync::mpsc;
-use std::sync::Mutex;
+use std::sync::{Arc, Mutex};
 use std::thread;
 
+mod runtime;
+mod snapshot;
+
+pub use runtime::{
+    RuntimeConfig, Runtime, bscomp_runtime_new, bscomp_runtime_destroy, bscomp_runtime_boot,
+    bscomp_runtime_wait,
+};
+pub use snapshot::{bscomp_motherboard_snapshot, bscomp_motherboard_restore};
+
 // Rusty Section
 
 /// Enum to send to the motherboard to change state.
 enum MotherboardInterrupt {
     Halt,
     Reboot,
+    /// Stop every device without resetting it, say so on the first channel, and start
+    /// them again once the second one hears back or hangs up.
+    Pause(mpsc::Sender<()>, mpsc::Receiver<()>),
 }
 
 #[repr(C)]
@@ -120,8 +133,138 @@ pub struct Device {
     /// contents copied; the pointer to it should not be saved.
     pub register_motherboard: Option<extern fn(
         *mut c_void, *mut Motherboard, *mut MotherboardFunctions) -> i32>,
+
+    /// Optional function to give other devices direct access to exported memory.
+    ///
+    /// Should take four arguments: the device pointer, and places to store a pointer to
+    /// the start of the exported memory, its length in bytes, and `MAP_*` flags saying
+    /// how it may be accessed. The memory must not move between `init` and `cleanup`.
+    ///
+    /// Devices which need to see every access should not provide this. Everyone else
+    /// will still use `load_bytes` and `write_bytes` for anything the flags don't allow.
+    pub map_memory: Option<extern fn(*mut c_void, *mut *mut u8, *mut u32, *mut u32) -> i32>,
+
+    /// Optional function to run the device for a while and then return, as an
+    /// alternative to `boot` for motherboards run on a `Runtime`.
+    ///
+    /// Should take two arguments: the device pointer, and a budget saying how much work
+    /// to do before returning, in units chosen by the device (instructions, for a CPU).
+    /// Returns `STEP_READY` if the device has more to do, `STEP_IDLE` if it has nothing to
+    /// do until it is sent an interrupt, or a negative simulator error, after which it is
+    /// not stepped again until the motherboard reboots.
+    ///
+    /// Devices which provide this should still provide `boot` and `halt` for motherboards
+    /// booted on their own. Devices which don't are booted on their own threads as usual.
+    pub step: Option<extern fn(*mut c_void, u32) -> i32>,
+
+    /// Optional function to save the device's state for a snapshot.
+    ///
+    /// Should take four arguments: the device pointer, a buffer, the buffer's length, and
+    /// where to store the length of the device's snapshot. Always stores the length, but
+    /// only writes the snapshot if it fits. Only called while the device is booted but
+    /// not running, so the state can't change between calls.
+    pub snapshot: Option<extern fn(*mut c_void, *mut u8, u32, *mut u32) -> i32>,
+
+    /// Optional function to put the device back in a state saved by `snapshot`.
+    ///
+    /// Should take three arguments: the device pointer, the saved state, and its length.
+    /// Called in the same conditions as `snapshot`, instead of `reset`. The saved state
+    /// is only valid until the function returns.
+    pub restore: Option<extern fn(*mut c_void, *const u8, u32) -> i32>,
+
+    /// Optional function to make copies of the device, for cloning a whole machine.
+    ///
+    /// Should take three arguments: the device pointer, the number of copies to make, and
+    /// an array of that many `Device`s to fill in. Each copy should be initialized and in
+    /// the same state as the original, ready to boot without `init` or `reset`. Called in
+    /// the same conditions as `snapshot`. Copies must provide `destroy`.
+    ///
+    /// Copies should share as much as they can with the original and each other until
+    /// they diverge, so that cloning costs little.
+    pub clone: Option<extern fn(*mut c_void, u32, *mut Device) -> i32>,
+
+    /// Function to free a device made by `clone`. Called by the motherboard that owns the
+    /// copy when it is destroyed, after any `cleanup`.
+    pub destroy: Option<extern fn(*mut c_void) -> i32>,
+
+    /// Optional function to load several ranges of the device's memory in one call.
+    ///
+    /// Should take three arguments: the device pointer, an array of segments with local
+    /// addresses, and the number of segments. Each segment should be treated as a call to
+    /// `load_bytes`, in order. Devices without it get one `load_bytes` call per segment.
+    pub load_bytes_v: Option<extern fn(*mut c_void, *const MemorySegment, u32) -> i32>,
+
+    /// Optional function to write several ranges of the device's memory in one call, as
+    /// `load_bytes_v` does for `write_bytes`.
+    pub write_bytes_v: Option<extern fn(*mut c_void, *const MemorySegment, u32) -> i32>,
+
+    /// Optional function to read the device's own performance counters.
+    ///
+    /// Should take three arguments: the device pointer, a place to copy counters to, and
+    /// how many it has room for. Returns how many counters the device has, which must not
+    /// change once it is created. Called from any thread, at any time.
+    pub read_counters: Option<extern fn(*mut c_void, *mut u64, u32) -> u32>,
+}
+
+/// One range of memory in a vectored read or write.
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct MemorySegment {
+    /// Global address for the motherboard's callbacks, local address for a device's.
+    pub address: u64,
+    /// Number of bytes.
+    pub length: u32,
+    /// Bytes to read into, or to write from.
+    pub buffer: *mut u8,
+}
+
+/// Traffic through the motherboard to one device, for the host.
+#[repr(C)]
+#[derive(Copy, Clone, Default)]
+pub struct DeviceTraffic {
+    /// Calls which read the device's memory, and the bytes they asked for.
+    pub loads: u64,
+    pub bytes_loaded: u64,
+    /// Calls which wrote the device's memory, and the bytes they asked to write.
+    pub writes: u64,
+    pub bytes_written: u64,
+    /// Interrupts sent to the device.
+    pub interrupts: u64,
 }
 
+/// `DeviceTraffic` as the motherboard keeps it. Any device may be calling through the
+/// motherboard at once, so these are only ever added to, with relaxed atomics.
+#[derive(Default)]
+struct Traffic {
+    loads: AtomicU64,
+    bytes_loaded: AtomicU64,
+    writes: AtomicU64,
+    bytes_written: AtomicU64,
+    interrupts: AtomicU64,
+}
+
+impl Traffic {
+    fn load(&self) -> DeviceTraffic {
+        DeviceTraffic {
+            loads: self.loads.load(Ordering::Relaxed),
+            bytes_loaded: self.bytes_loaded.load(Ordering::Relaxed),
+            writes: self.writes.load(Ordering::Relaxed),
+            bytes_written: self.bytes_written.load(Ordering::Relaxed),
+            interrupts: self.interrupts.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// Directly mapped memory may be read through the pointer.
+pub const MAP_READABLE: u32 = 1 << 0;
+/// Directly mapped memory may be written through the pointer.
+pub const MAP_WRITABLE: u32 = 1 << 1;
+
+/// The stepped device has more work to do.
+pub const STEP_READY: i32 = 0;
+/// The stepped device has nothing to do until it receives an interrupt.
+pub const STEP_IDLE: i32 = 1;
+
 impl Device {
     /// Tells if the device should be memory mapped.
     fn maps_memory(&self) -> bool {
@@ -157,6 +300,32 @@ pub struct MotherboardFunctions {
     /// Should take three arguments: the motherboard, the index in the device table of the
     /// target device, and the interrupt code to send.
     pub send_interrupt: Option<extern fn(*mut Motherboard, u32, u32) -> i32>,
+
+    /// Callback for a device to get direct access to memory.
+    ///
+    /// Should take five arguments:
+    /// - The motherboard
+    /// - The (global) address to map
+    /// - Where to store a pointer to the byte at that address
+    /// - Where to store the number of bytes which may be accessed through the pointer
+    /// - Where to store the `MAP_*` flags for those bytes
+    ///
+    /// If the memory can't be mapped, stores a null pointer and a length of 0, and the
+    /// caller should use `read_bytes` and `write_bytes` instead. The pointer stays valid
+    /// until the caller's boot function returns.
+    pub map_bytes: Option<extern fn(*mut Motherboard, u64, *mut *mut u8, *mut u32, *mut u32) -> i32>,
+
+    /// Callback for a device to read several ranges of memory at once.
+    ///
+    /// Should take three arguments: the motherboard, an array of segments with global
+    /// addresses, and the number of segments. Equivalent to calling `read_bytes` for each
+    /// segment in order, but calls each device once for each run of segments in its
+    /// memory.
+    pub read_bytes_v: Option<extern fn(*mut Motherboard, *const MemorySegment, u32) -> i32>,
+
+    /// Callback for a device to write several ranges of memory at once, as `read_bytes_v`
+    /// does for `write_bytes`.
+    pub write_bytes_v: Option<extern fn(*mut Motherboard, *const MemorySegment, u32) -> i32>,
 }
 
 /// Represents a motherboard in the bridgesim computer.
@@ -169,6 +338,33 @@ pub struct Motherboard {
     ram_mappings: Vec<usize>,
     deviceinfo_memory: Vec<u8>,
     interrupt_chan: Mutex<Option<mpsc::Sender<MotherboardInterrupt>>>,
+
+    /// The runtime running this motherboard, if it was booted on one rather than with
+    /// `boot`.
+    runtime: Mutex<Option<Arc<runtime::Shared>>>,
+    /// Halt or reboot requested of a motherboard on a runtime, as a `runtime::CONTROL_*`
+    /// value.
+    control: AtomicUsize,
+    /// Where the motherboard is in its runtime's schedule, as a `runtime::*` state.
+    schedule: AtomicUsize,
+    /// Pause waiting to be handled by the runtime.
+    pause: Mutex<Option<(mpsc::Sender<()>, mpsc::Receiver<()>)>>,
+    /// Threads running devices' boot functions, with the index of the device each runs.
+    boot_threads: Vec<(usize, thread::JoinHandle<()>)>,
+    /// Devices to step, rather than boot, which haven't failed since the last reset.
+    stepping: Vec<bool>,
+    /// Set if the devices were cloned from a booted machine, and so are already
+    /// initialized and shouldn't be reset on the first boot.
+    cloned: bool,
+    /// Set if the devices were made by cloning, and so are the motherboard's to destroy.
+    owns_devices: bool,
+    /// Traffic to each device since the motherboard was last booted.
+    traffic: Vec<Traffic>,
+    /// Offset of the counter table in the information block. Everything from here to the
+    /// end of the block is filled in as it is read.
+    counters_start: usize,
+    /// Offset in the information block, and number, of each device's own counters.
+    device_counters: Vec<(usize, u32)>,
 }
 
 impl Motherboard {
@@ -179,6 +375,17 @@ impl Motherboard {
             ram_mappings: Vec::new(),
             deviceinfo_memory: Vec::new(),
             interrupt_chan: Mutex::new(None),
+            runtime: Mutex::new(None),
+            control: AtomicUsize::new(runtime::CONTROL_NONE),
+            schedule: AtomicUsize::new(runtime::STOPPED),
+            pause: Mutex::new(None),
+            boot_threads: Vec::new(),
+            stepping: Vec::new(),
+            cloned: false,
+            owns_devices: false,
+            traffic: Vec::new(),
+            counters_start: 0,
+            device_counters: Vec::new(),
         }
     }
 
@@ -242,6 +449,16 @@ impl Motherboard {
             for (d, s) in (start_addr as usize..end_addr as usize).enumerate() {
                 dest[d] = self.deviceinfo_memory[s];
             }
+
+            // The counter table changes as the machine runs, so it's only put together
+            // when someone reads it.
+            if (end_addr as usize) > self.counters_start {
+                let counters = self.counter_table();
+                let start = std::cmp::max(start_addr as usize, self.counters_start);
+                for s in start..end_addr as usize {
+                    dest[s - start_addr as usize] = counters[s - self.counters_start];
+                }
+            }
             0
         } else if (ram_index as usize) < self.ram_mappings.len() {
             // Find the appropriate device.
@@ -251,6 +468,7 @@ impl Motherboard {
             // Even though devices are expected to ignore invalid reads anyway, limit to
             // mapped memory.
             let read_size = std::cmp::min(dest.len() as u32, device.export_memory_size);
+            self.count_loads(device_index, 1, read_size as u64);
 
             match device.load_bytes {
                 Some(load_bytes) => {
@@ -291,6 +509,7 @@ impl Motherboard {
             // Clamp to mapped memory (even though devices should ignore invalid writes).
             let read_size = std::cmp::min(
                 source.len() as u32, device.export_memory_size - start_addr);
+            self.count_writes(device_index, 1, read_size as u64);
 
             match device.write_bytes {
                 Some(load_bytes) => {
@@ -307,54 +526,247 @@ impl Motherboard {
         }
     }
 
+    /// Read or write several segments of memory.
+    ///
+    /// Each run of segments in the memory of a device with vectored callbacks goes to
+    /// that device in one call. Everything else goes through `load_bytes` or
+    /// `write_bytes` one segment at a time.
+    fn transfer_v(&self, segments: &[MemorySegment], write: bool) -> i32 {
+        let mut local = Vec::new();
+        let mut i = 0;
+        while i < segments.len() {
+            let ram_index = (segments[i].address >> 32) as u32;
+            let device_index = if ram_index != !0u32
+                    && (ram_index as usize) < self.ram_mappings.len() {
+                Some(self.ram_mappings[ram_index as usize])
+            } else {
+                None
+            };
+            let device = device_index.map(|i| self.devices[i]);
+            let vectored = device.and_then(|d| if write { d.write_bytes_v } else { d.load_bytes_v });
+
+            let result = match (device, vectored) {
+                (Some(device), Some(transfer)) => {
+                    local.clear();
+                    let mut bytes = 0u64;
+                    while i < segments.len() && (segments[i].address >> 32) as u32 == ram_index {
+                        let segment = segments[i];
+                        let start = segment.address as u32;
+                        // Limit to mapped memory, as for single reads and writes.
+                        let length = if start < device.export_memory_size {
+                            std::cmp::min(segment.length, device.export_memory_size - start)
+                        } else {
+                            0
+                        };
+                        local.push(MemorySegment {
+                            address: start as u64,
+                            length: length,
+                            buffer: segment.buffer,
+                        });
+                        bytes += length as u64;
+                        i += 1;
+                    }
+                    let index = device_index.unwrap();
+                    if write {
+                        self.count_writes(index, 1, bytes);
+                    } else {
+                        self.count_loads(index, 1, bytes);
+                    }
+                    transfer(device.device, local.as_ptr(), local.len() as u32)
+                },
+                _ => {
+                    let segment = segments[i];
+                    i += 1;
+                    if segment.length == 0 {
+                        continue;
+                    }
+                    let buffer = unsafe {
+                        std::slice::from_raw_parts_mut(segment.buffer, segment.length as usize)
+                    };
+                    if write {
+                        self.write_bytes(segment.address, buffer)
+                    } else {
+                        self.load_bytes(segment.address, buffer)
+                    }
+                },
+            };
+            if result != 0 {
+                return result;
+            }
+        }
+        0
+    }
+
+    fn count_loads(&self, device: usize, calls: u64, bytes: u64) {
+        if let Some(traffic) = self.traffic.get(device) {
+            traffic.loads.fetch_add(calls, Ordering::Relaxed);
+            traffic.bytes_loaded.fetch_add(bytes, Ordering::Relaxed);
+        }
+    }
+
+    fn count_writes(&self, device: usize, calls: u64, bytes: u64) {
+        if let Some(traffic) = self.traffic.get(device) {
+            traffic.writes.fetch_add(calls, Ordering::Relaxed);
+            traffic.bytes_written.fetch_add(bytes, Ordering::Relaxed);
+        }
+    }
+
+    /// The counter table of the information block as it stands, laid out as described in
+    /// memoryhandling.md.
+    fn counter_table(&self) -> Vec<u8> {
+        let mut table = Vec::with_capacity(self.deviceinfo_memory.len() - self.counters_start);
+        table.extend(unsafe { mem::transmute::<u32, [u8; 4]>(self.traffic.len() as u32) }.iter());
+        for (i, traffic) in self.traffic.iter().enumerate() {
+            let traffic = traffic.load();
+            for value in [traffic.loads, traffic.bytes_loaded, traffic.writes,
+                          traffic.bytes_written, traffic.interrupts].iter() {
+                table.extend(unsafe { mem::transmute::<u64, [u8; 8]>(*value) }.iter());
+            }
+            let (offset, _) = self.device_counters[i];
+            let address = if offset != 0 { offset as u64 + 0xffffffff00000000u64 } else { 0 };
+            table.extend(unsafe { mem::transmute::<u64, [u8; 8]>(address) }.iter());
+        }
+
+        for (device, &(offset, count)) in self.devices.iter().zip(self.device_counters.iter()) {
+            if offset == 0 {
+                continue;
+            }
+            let mut values = vec![0u64; count as usize];
+            if let Some(read_counters) = device.read_counters {
+                read_counters(device.device, values.as_mut_ptr(), count);
+            }
+            table.extend(unsafe { mem::transmute::<u32, [u8; 4]>(count) }.iter());
+            for value in values {
+                table.extend(unsafe { mem::transmute::<u64, [u8; 8]>(value) }.iter());
+            }
+        }
+        table
+    }
+
+    /// Find a host pointer to the memory at a global address.
+    ///
+    /// Leaves `ptr` null if the memory can't be mapped directly, which is not an error.
+    fn map_bytes(&self, addr: u64, ptr: &mut *mut u8, len: &mut u32, flags: &mut u32) -> i32 {
+        *ptr = std::ptr::null_mut();
+        *len = 0;
+        *flags = 0;
+
+        // Shift down to get the device index.
+        let ram_index = (addr >> 32) as u32;
+        let start_addr = addr as u32;
+
+        // Motherboard memory is never mapped, and isn't in the mapping table.
+        if (ram_index as usize) >= self.ram_mappings.len() {
+            return 0;
+        }
+
+        let device_index = self.ram_mappings[ram_index as usize];
+        let device = self.devices[device_index];
+
+        let map_memory = match device.map_memory {
+            Some(map_memory) => map_memory,
+            None => return 0,
+        };
+
+        let mut base: *mut u8 = std::ptr::null_mut();
+        let mut size = 0u32;
+        let mut access = 0u32;
+        let result = map_memory(device.device, &mut base, &mut size, &mut access);
+        if result != 0 {
+            return result;
+        }
+
+        // Never hand out more than is mapped.
+        let size = std::cmp::min(size, device.export_memory_size);
+        if base.is_null() || start_addr >= size {
+            return 0;
+        }
+
+        *ptr = unsafe { base.offset(start_addr as isize) };
+        *len = size - start_addr;
+        *flags = access;
+        0
+    }
+
     /// Send an interrupt to some device.
     ///
     /// If the device is `0xffffffff`, send to the motherboard.
     fn send_interrupt(&self, device: u32, code: u32) -> i32 {
         if device == !0u32 {
-            // ignore unknow interrupts.
-            if code > 1 {
-                return 0;
-            }
-
-            let ic = self.interrupt_chan.lock().unwrap();
-            match *ic {
-                Some(ref ch) => {
-                    let ch = (*ch).clone();
-                    let code = match code {
-                        0 => MotherboardInterrupt::Halt,
-                        1 => MotherboardInterrupt::Reboot,
-                        // We have assured this never happens above, so just use halt as
-                        // the default.
-                        _ => MotherboardInterrupt::Halt,
-                    };
-
-                    match ch.send(code) {
-                        Ok(_) => 0,
-                        // Dissconnected = not booted
-                        Err(_) => -1,
-                    }
-                },
-                // No channel = not booted
-                None => -1,
+            match code {
+                0 => self.request(MotherboardInterrupt::Halt),
+                1 => self.request(MotherboardInterrupt::Reboot),
+                // ignore unknow interrupts.
+                _ => 0,
             }
         } else if (device as usize) < self.devices.len() {
-            let device = self.devices[device as usize];
+            let target = self.devices[device as usize];
+            if let Some(traffic) = self.traffic.get(device as usize) {
+                traffic.interrupts.fetch_add(1, Ordering::Relaxed);
+            }
 
-            match device.interrupt {
-                Some(interrupt) => interrupt(device.device, code),
+            let result = match target.interrupt {
+                Some(interrupt) => interrupt(target.device, code),
                 None => 0,
+            };
+
+            // A stepped device may have been idle waiting for this.
+            if target.step.is_some() {
+                let rt = self.runtime.lock().unwrap();
+                if let Some(ref rt) = *rt {
+                    rt.wake(self);
+                }
             }
+            result
         } else {
             0
         }
     }
 
+    /// Ask the motherboard to halt, reboot, or pause, however it was booted.
+    fn request(&self, action: MotherboardInterrupt) -> i32 {
+        {
+            let rt = self.runtime.lock().unwrap();
+            if let Some(ref rt) = *rt {
+                let control = match action {
+                    MotherboardInterrupt::Halt => runtime::CONTROL_HALT,
+                    MotherboardInterrupt::Reboot => runtime::CONTROL_REBOOT,
+                    MotherboardInterrupt::Pause(ack, resume) => {
+                        *self.pause.lock().unwrap() = Some((ack, resume));
+                        runtime::CONTROL_PAUSE
+                    },
+                };
+                // A halt isn't overridden by anything less.
+                self.control.fetch_max(control, Ordering::SeqCst);
+                rt.wake(self);
+                return 0;
+            }
+        }
+
+        let ic = self.interrupt_chan.lock().unwrap();
+        match *ic {
+            Some(ref ch) => {
+                let ch = (*ch).clone();
+                match ch.send(action) {
+                    Ok(_) => 0,
+                    // Dissconnected = not booted
+                    Err(_) => -1,
+                }
+            },
+            // No channel = not booted
+            None => -1,
+        }
+    }
+
     /// Start the computer
     ///
     /// This function inits an maps each device, then starts calling tick on them until a
     /// shutdown message is received on the machine's shutdown channel.
     fn boot(&mut self) -> Result<(), &'static str> {
+        if self.runtime.lock().unwrap().is_some() {
+            return Err("The motherboard is already running on a runtime.");
+        }
+
         // Set a channel to use to trigger shutdown.
         let (interrupt_chan_tx, interrupt_chan) =  mpsc::channel();
         {
@@ -362,10 +774,64 @@ impl Motherboard {
             *ic = Some(interrupt_chan_tx.clone());
         }
 
+        let mut reset = match self.prepare() {
+            Ok(reset) => reset,
+            Err(e) => {
+                let mut ic = self.interrupt_chan.lock().unwrap();
+                *ic = None;
+                return Err(e);
+            },
+        };
+
+        loop {
+            self.start_devices(false, reset);
+            reset = true;
+
+            let action = loop {
+                match interrupt_chan.recv() {
+                    Ok(MotherboardInterrupt::Pause(ack, resume)) => {
+                        self.stop_devices();
+                        let _ = ack.send(());
+                        let _ = resume.recv();
+                        self.start_devices(false, false);
+                    },
+                    Ok(action) => break action,
+                    Err(_) => break MotherboardInterrupt::Halt,
+                }
+            };
+
+            self.stop_devices();
+
+            match action {
+                MotherboardInterrupt::Halt => break,
+                _ => {},
+            };
+        }
+
+        self.shut_down();
+
+        {
+            let mut ic = self.interrupt_chan.lock().unwrap();
+            *ic = None;
+        }
+
+        println!("Shutdown.");
+
+        Ok(())
+    }
+
+    /// Checks, registers with, maps, and inits every device ahead of their first reset.
+    ///
+    /// Returns whether the devices need resetting before they start, which they don't if
+    /// they were cloned from a booted machine.
+    fn prepare(&mut self) -> Result<bool, &'static str> {
         let mut mbfuncs = MotherboardFunctions {
             read_bytes: Some(bscomp_motherboard_load_bytes),
             write_bytes: Some(bscomp_motherboard_write_bytes),
             send_interrupt: Some(bscomp_motherboard_send_interrupt),
+            map_bytes: Some(bscomp_motherboard_map_bytes),
+            read_bytes_v: Some(bscomp_motherboard_read_bytes_v),
+            write_bytes_v: Some(bscomp_motherboard_write_bytes_v),
         };
 
         let sp: *mut Motherboard = self;
@@ -413,9 +879,11 @@ impl Motherboard {
 
         // Compute according to the layout described in memoryhandling.md the address of
         // each table which will be in the system's low memory.
-        let ramstart: u64 = 2 * mem::size_of::<u64>() as u64 + 0xffffffff00000000u64;
+        let ramstart: u64 = 3 * mem::size_of::<u64>() as u64 + 0xffffffff00000000u64;
         let devstart: u64 = ramstart
             + (self.ram_mappings.len() as u64 + 1) * mem::size_of::<u32>() as u64;
+        let counterstart: u64 = devstart + mem::size_of::<u32>() as u64
+            + self.devices.len() as u64 * 16;
 
         // Clean out any old mapping to ensure we start fresh.
         self.deviceinfo_memory.clear();
@@ -425,6 +893,8 @@ impl Motherboard {
             unsafe { mem::transmute::<u64, [u8; 8]>(ramstart) }.iter());
         self.deviceinfo_memory.extend(
             unsafe { mem::transmute::<u64, [u8; 8]>(devstart) }.iter());
+        self.deviceinfo_memory.extend(
+            unsafe { mem::transmute::<u64, [u8; 8]>(counterstart) }.iter());
 
         self.deviceinfo_memory.extend(unsafe {
             mem::transmute::<u32, [u8; 4]>(self.ram_mappings.len() as u32)
@@ -456,8 +926,34 @@ impl Motherboard {
             }.iter());
         }
 
+        // Counters are filled in as they're read; only their places are set aside here.
+        self.counters_start = self.deviceinfo_memory.len();
+        let mut counters_end = self.counters_start + mem::size_of::<u32>()
+            + self.devices.len() * 6 * mem::size_of::<u64>();
+        self.device_counters.clear();
+        for device in self.devices.iter() {
+            let count = match device.read_counters {
+                Some(read_counters) => read_counters(device.device, std::ptr::null_mut(), 0),
+                None => 0,
+            };
+            if count == 0 {
+                self.device_counters.push((0, 0));
+            } else {
+                self.device_counters.push((counters_end, count));
+                counters_end += mem::size_of::<u32>() + count as usize * mem::size_of::<u64>();
+            }
+        }
+        self.deviceinfo_memory.resize(counters_end, 0);
+        self.traffic = self.devices.iter().map(|_| Traffic::default()).collect();
+
         println!("Prepared Motherboard Memory.");
 
+        if self.cloned {
+            // Cloned devices arrive initialized and running.
+            self.cloned = false;
+            return Ok(false);
+        }
+
         for device in self.devices.iter() {
             match device.init {
                 // errors will just be ignored....
@@ -467,8 +963,13 @@ impl Motherboard {
         }
 
         println!("Initialized devices.");
+        Ok(true)
+    }
 
-        loop {
+    /// Resets every device if `reset` is set, then boots each one on its own thread. If
+    /// `stepped` is set, devices which can be stepped are left for the runtime instead.
+    fn start_devices(&mut self, stepped: bool, reset: bool) {
+        if reset {
             for device in self.devices.iter() {
                 match device.reset {
                     Some(reset) => { reset(device.device); },
@@ -477,53 +978,75 @@ impl Motherboard {
             }
 
             println!("Reset devices.");
+        }
 
-            // Boot the devices.
-            let mut thread_handles = Vec::new();
-
-            for device in self.devices.iter() {
-                match device.boot {
-                    Some(boot) => {
-                        let boot = boot;
-
-                        // Coherce this pointer to a reference because pointers are not
-                        // "send". Then send the reference and coherce it back to a
-                        // pointer.
-                        let device = unsafe { &mut *device.device };
-                        let thread_handle = thread::spawn(move || {
-                            let device = device;
-                            boot(device);
-                        });
+        // Failed devices stay failed until a reset. Cloned devices start without one.
+        if reset || self.stepping.len() != self.devices.len() {
+            self.stepping = self.devices.iter()
+                .map(|device| stepped && device.step.is_some())
+                .collect();
+        }
 
-                        thread_handles.push(thread_handle);
-                    },
-                    None => {},
-                }
+        for (i, device) in self.devices.iter().enumerate() {
+            if stepped && device.step.is_some() {
+                continue;
             }
 
-            let action = match interrupt_chan.recv() {
-                Ok(action) => action,
-                Err(_) => MotherboardInterrupt::Halt,
-            };
+            match device.boot {
+                Some(boot) => {
+                    let boot = boot;
 
-            // Order all devices to halt.
-            for device in self.devices.iter() {
-                if device.boot.is_some() {
-                    // Have already assured that hatl is Some before booting.
-                    device.halt.unwrap()(device.device);
-                }
+                    // Coherce this pointer to a reference because pointers are not
+                    // "send". Then send the reference and coherce it back to a
+                    // pointer.
+                    let device = unsafe { &mut *device.device };
+                    let thread_handle = thread::spawn(move || {
+                        let device = device;
+                        boot(device);
+                    });
+
+                    self.boot_threads.push((i, thread_handle));
+                },
+                None => {},
             }
+        }
+    }
 
-            for handle in thread_handles.into_iter() {
-                let _ = handle.join();
+    /// Steps each stepped device once. Returns true if every one of them is idle.
+    fn step_devices(&mut self, budget: u32) -> bool {
+        let mut idle = true;
+        for (i, device) in self.devices.iter().enumerate() {
+            if !self.stepping[i] {
+                continue;
+            }
+            // Only devices with a step function are ever marked for stepping.
+            let result = device.step.unwrap()(device.device, budget);
+            if result < 0 {
+                println!("Device {} failed with code {}; no longer stepping it.", i, result);
+                self.stepping[i] = false;
+            } else if result != STEP_IDLE {
+                idle = false;
             }
+        }
+        idle
+    }
 
-            match action {
-                MotherboardInterrupt::Halt => break,
-                _ => {},
-            };
+    /// Stops every device started by `start_devices`.
+    fn stop_devices(&mut self) {
+        // Order all devices to halt.
+        for &(i, _) in self.boot_threads.iter() {
+            let device = self.devices[i];
+            // Have already assured that hatl is Some before booting.
+            device.halt.unwrap()(device.device);
+        }
+
+        for (_, handle) in self.boot_threads.drain(..) {
+            let _ = handle.join();
         }
+    }
 
+    /// Cleans up every device once the motherboard has halted.
+    fn shut_down(&mut self) {
         println!("Halted.");
 
         for device in self.devices.iter() {
@@ -534,48 +1057,86 @@ impl Motherboard {
         }
 
         println!("Cleaned up devices.");
+    }
 
-        {
-            let mut ic = self.interrupt_chan.lock().unwrap();
-            *ic = None;
+    /// Stop every device, run `f`, and start them again where they left off. This method
+    /// is threadsafe, but must not be called from a device's boot or step function.
+    ///
+    /// Returns -1 without running `f` if the motherboard isn't booted or halts first.
+    fn paused<F: FnOnce(&Motherboard) -> i32>(&self, f: F) -> i32 {
+        let (ack_tx, ack) = mpsc::channel();
+        let (resume, resume_rx) = mpsc::channel();
+        let result = self.request(MotherboardInterrupt::Pause(ack_tx, resume_rx));
+        if result != 0 {
+            return result;
+        }
+        if ack.recv().is_err() {
+            return -1;
+        }
+        let result = f(self);
+        let _ = resume.send(());
+        result
+    }
+
+    /// Make `count` copies of a paused motherboard and all of its devices. The copies
+    /// boot where this one left off.
+    fn clone_machine(&self, count: u32) -> Result<Vec<Motherboard>, i32> {
+        if self.devices.iter().any(|d| d.clone.is_none()) {
+            return Err(-2);
         }
 
-        println!("Shutdown.");
+        // copies[i][j] is copy j of device i.
+        let mut copies: Vec<Vec<Device>> = Vec::with_capacity(self.devices.len());
+        for device in self.devices.iter() {
+            let mut made: Vec<Device> = (0..count).map(|_| unsafe { mem::zeroed() }).collect();
+            let result = device.clone.unwrap()(device.device, count, made.as_mut_ptr());
+            if result == 0 && made.iter().all(|d| d.destroy.is_some()) {
+                copies.push(made);
+                continue;
+            }
 
-        Ok(())
+            // Don't leak the copies made so far. A clone which failed has already freed
+            // its own.
+            let failed = if result == 0 { Some(&made) } else { None };
+            for made in copies.iter().chain(failed.into_iter()) {
+                for copy in made.iter() {
+                    if let Some(destroy) = copy.destroy {
+                        destroy(copy.device);
+                    }
+                }
+            }
+            return Err(if result != 0 { result } else { -2 });
+        }
+
+        Ok((0..count as usize).map(|j| {
+            let mut mb = Motherboard::new(self.num_slots());
+            for made in copies.iter() {
+                mb.devices.push(made[j]);
+            }
+            mb.cloned = true;
+            mb.owns_devices = true;
+            mb
+        }).collect())
     }
 
     /// Halt the machine. This method is threadsafe!
     fn halt(&self) -> i32 {
-        let ic = self.interrupt_chan.lock().unwrap();
-        match *ic {
-            Some(ref ch) => {
-                let ch = (*ch).clone();
-                match ch.send(MotherboardInterrupt::Halt) {
-                    Ok(_) => 0,
-                    // Dissconnected = not booted
-                    Err(_) => -1,
-                    }
-            },
-            // No channel = not booted
-            None => -1,
-        }
+        self.request(MotherboardInterrupt::Halt)
     }
 
     /// Reboot the machine. This method is threadsafe!
     fn reboot(&self) -> i32 {
-        let ic = self.interrupt_chan.lock().unwrap();
-        match *ic {
-            Some(ref ch) => {
-                let ch = (*ch).clone();
-                match ch.send(MotherboardInterrupt::Reboot) {
-                    Ok(_) => 0,
-                    // Dissconnected = not booted
-                    Err(_) => -1,
-                    }
-            },
-            // No channel = not booted
-            None => -1,
+        self.request(MotherboardInterrupt::Reboot)
+    }
+}
+
+impl Drop for Motherboard {
+    fn drop(&mut self) {
+        if self.owns_devices {
+            for device in self.devices.iter() {
+                // Cloning made sure every copy can be destroyed.
+                device.destroy.unwrap()(device.device);
+            }
         }
     }
 }
@@ -697,6 +1258,61 @@ pub extern fn bscomp_motherboard_add_device(
     }
 }
 
+/// Clone a booted motherboard into `count` new ones, stored in `clones`.
+///
+/// Every device is stopped while it is copied, and started again where it left off
+/// afterwards. The copies are in the same state, and boot where the original was rather
+/// than initializing and resetting their devices. Fails with -2, making no copies, if any
+/// device can't be cloned. Must not be called from a device's boot or step function.
+///
+/// # Safety
+///
+/// `clones` must have room for `count` pointers. Each copy must be passed to
+/// `bscomp_motherboard_destroy`, which also frees its devices.
+#[no_mangle]
+pub extern fn bscomp_motherboard_clone(
+    mb: *mut Motherboard, count: u32, clones: *mut *mut Motherboard) -> i32 {
+
+    if mb.is_null() || clones.is_null() {
+        return -1;
+    }
+    let mb = unsafe { &*mb };
+    let clones = unsafe { std::slice::from_raw_parts_mut(clones, count as usize) };
+
+    mb.paused(|mb| {
+        match mb.clone_machine(count) {
+            Ok(copies) => {
+                for (slot, copy) in clones.iter_mut().zip(copies.into_iter()) {
+                    *slot = Box::into_raw(Box::new(copy));
+                }
+                0
+            },
+            Err(e) => e,
+        }
+    })
+}
+
+/// Copy the traffic the motherboard has passed to one of its devices since it was booted.
+///
+/// Accesses through directly mapped memory don't pass through the motherboard, and so
+/// aren't counted.
+#[no_mangle]
+pub extern fn bscomp_motherboard_device_traffic(
+    mb: *mut Motherboard, device: u32, traffic: *mut DeviceTraffic) -> i32 {
+
+    if mb.is_null() || traffic.is_null() {
+        return -1;
+    }
+    let mb = unsafe { &*mb };
+    match mb.traffic.get(device as usize) {
+        Some(counted) => {
+            unsafe { *traffic = counted.load() };
+            0
+        },
+        None => -2,
+    }
+}
+
 /// C-callable load-bytes method
 pub extern fn bscomp_motherboard_load_bytes(
     mb: *mut Motherboard, addr: u64, bytes_count: u32, destination: *mut u8) -> i32 {
@@ -733,6 +1349,40 @@ pub extern fn bscomp_motherboard_write_bytes(
     }
 }
 
+/// C-callable vectored read method
+pub extern fn bscomp_motherboard_read_bytes_v(
+    mb: *mut Motherboard, segments: *const MemorySegment, count: u32) -> i32 {
+
+    if mb.is_null() {
+        -1
+    } else if segments.is_null() && count != 0 {
+        -2
+    } else if count == 0 {
+        0
+    } else {
+        let mb = unsafe { &mut *mb };
+        let segments = unsafe { std::slice::from_raw_parts(segments, count as usize) };
+        mb.transfer_v(segments, false)
+    }
+}
+
+/// C-callable vectored write method
+pub extern fn bscomp_motherboard_write_bytes_v(
+    mb: *mut Motherboard, segments: *const MemorySegment, count: u32) -> i32 {
+
+    if mb.is_null() {
+        -1
+    } else if segments.is_null() && count != 0 {
+        -2
+    } else if count == 0 {
+        0
+    } else {
+        let mb = unsafe { &mut *mb };
+        let segments = unsafe { std::slice::from_raw_parts(segments, count as usize) };
+        mb.transfer_v(segments, true)
+    }
+}
+
 /// C-callable send-interrupt method
 pub extern fn bscomp_motherboard_send_interrupt(
     mb: *mut Motherboard, device: u32, code: u32) -> i32 {
@@ -745,6 +1395,20 @@ pub extern fn bscomp_motherboard_send_interrupt(
     }
 }
 
+/// C-callable map-bytes method
+pub extern fn bscomp_motherboard_map_bytes(
+    mb: *mut Motherboard, addr: u64, ptr: *mut *mut u8, len: *mut u32, flags: *mut u32) -> i32 {
+
+    if mb.is_null() {
+        -1
+    } else if ptr.is_null() || len.is_null() || flags.is_null() {
+        -2
+    } else {
+        let mb = unsafe { &mut *mb };
+        unsafe { mb.map_bytes(addr, &mut *ptr, &mut *len, &mut *flags) }
+    }
+}
+
 /// Boot the motherboard -- hangs until shutdown.
 #[no_mangle]
 pub extern fn bscomp_motherboard_boot(mb: *mut Motherboard) -> i32 {
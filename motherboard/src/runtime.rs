@@ -0,0 +1,361 @@
+//! Runs many motherboards on a fixed pool of threads.
+//!
+//! Each motherboard booted on a runtime is one task. Running the task steps each of the
+//! motherboard's stepped devices once, then puts the motherboard back at the end of the
+//! running thread's queue. Threads which run out of work take it from the other end of
+//! another thread's queue. A motherboard whose stepped devices are all idle is left out
+//! of the queues until something wakes it.
+//!
+//! Devices which can't be stepped are still booted on threads of their own.
+
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::Duration;
+
+use super::{Motherboard, MotherboardInterrupt};
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct RuntimeConfig {
+    /// Threads to run motherboards on. 0 uses one per host CPU.
+    pub threads: u32,
+    /// Budget passed to each device's step function. 0 picks a default.
+    pub step_budget: u32,
+}
+
+const DEFAULT_STEP_BUDGET: u32 = 10000;
+
+/// How often idle motherboards are stepped anyway, in case one of their devices was sent
+/// an interrupt without going through the motherboard.
+const IDLE_POLL: u64 = 10;
+
+// Values for `Motherboard::control`, in increasing priority.
+pub const CONTROL_NONE: usize = 0;
+pub const CONTROL_PAUSE: usize = 1;
+pub const CONTROL_REBOOT: usize = 2;
+pub const CONTROL_HALT: usize = 3;
+
+// Values for `Motherboard::schedule`.
+//
+// Not on a runtime, or halted.
+pub const STOPPED: usize = 0;
+// Waiting to be woken.
+pub const IDLE: usize = 1;
+// In one of the queues.
+pub const QUEUED: usize = 2;
+// Being stepped.
+pub const RUNNING: usize = 3;
+// Being stepped, and woken since; goes back in a queue even if it finishes idle.
+pub const WOKEN: usize = 4;
+
+/// Motherboard pointer which can be passed between threads. Motherboards stay put until
+/// their runtime is done with them.
+#[derive(Copy, Clone, PartialEq)]
+struct Board(*mut Motherboard);
+
+unsafe impl Send for Board {}
+
+/// State shared between a runtime's threads and the motherboards running on it.
+pub struct Shared {
+    queues: Vec<Mutex<VecDeque<Board>>>,
+    /// Queue for the next motherboard queued from outside the pool.
+    next_queue: AtomicUsize,
+    /// Every motherboard on the runtime which hasn't halted.
+    boards: Mutex<Vec<Board>>,
+    halted: Condvar,
+    /// Threads with nothing to do wait on `work`; anyone adding work notifies it while
+    /// holding `sleep_lock`, so the work can't be missed.
+    sleep_lock: Mutex<()>,
+    work: Condvar,
+    shutdown: AtomicBool,
+    step_budget: u32,
+}
+
+impl Shared {
+    /// Puts the motherboard back in the schedule if it is idle, or makes sure it goes
+    /// back in once it finishes if it is running.
+    pub fn wake(&self, mb: &Motherboard) {
+        loop {
+            match mb.schedule.load(Ordering::SeqCst) {
+                IDLE => {
+                    if mb.schedule.compare_exchange(
+                            IDLE, QUEUED, Ordering::SeqCst, Ordering::SeqCst).is_ok() {
+                        let board = Board(mb as *const Motherboard as *mut Motherboard);
+                        let index = self.next_queue.fetch_add(1, Ordering::Relaxed);
+                        self.push(board, index % self.queues.len());
+                        return;
+                    }
+                },
+                RUNNING => {
+                    if mb.schedule.compare_exchange(
+                            RUNNING, WOKEN, Ordering::SeqCst, Ordering::SeqCst).is_ok() {
+                        return;
+                    }
+                },
+                _ => return,
+            }
+        }
+    }
+
+    fn push(&self, board: Board, queue: usize) {
+        self.queues[queue].lock().unwrap().push_back(board);
+        let _sleep = self.sleep_lock.lock().unwrap();
+        self.work.notify_one();
+    }
+
+    /// Takes from the front of our own queue, or failing that the back of someone
+    /// else's.
+    fn find_work(&self, queue: usize) -> Option<Board> {
+        if let Some(board) = self.queues[queue].lock().unwrap().pop_front() {
+            return Some(board);
+        }
+        for i in 1..self.queues.len() {
+            let victim = (queue + i) % self.queues.len();
+            if let Some(board) = self.queues[victim].lock().unwrap().pop_back() {
+                return Some(board);
+            }
+        }
+        None
+    }
+
+    fn has_work(&self) -> bool {
+        self.queues.iter().any(|q| !q.lock().unwrap().is_empty())
+    }
+
+    fn worker(&self, queue: usize) {
+        while !self.shutdown.load(Ordering::SeqCst) {
+            match self.find_work(queue) {
+                Some(board) => self.run(board, queue),
+                None => {
+                    let sleep = self.sleep_lock.lock().unwrap();
+                    if self.has_work() || self.shutdown.load(Ordering::SeqCst) {
+                        continue;
+                    }
+                    let (_sleep, timeout) = self.work.wait_timeout(
+                        sleep, Duration::from_millis(IDLE_POLL)).unwrap();
+                    if timeout.timed_out() {
+                        drop(_sleep);
+                        self.poll_idle();
+                    }
+                },
+            }
+        }
+    }
+
+    fn poll_idle(&self) {
+        let boards = self.boards.lock().unwrap().clone();
+        for board in boards {
+            self.wake(unsafe { &*board.0 });
+        }
+    }
+
+    /// Handles any halt or reboot, then steps the motherboard's devices once.
+    fn run(&self, board: Board, queue: usize) {
+        let mb = unsafe { &mut *board.0 };
+        mb.schedule.store(RUNNING, Ordering::SeqCst);
+
+        match mb.control.swap(CONTROL_NONE, Ordering::SeqCst) {
+            CONTROL_HALT => {
+                mb.stop_devices();
+                mb.shut_down();
+                self.finish(board);
+                return;
+            },
+            CONTROL_REBOOT => {
+                mb.stop_devices();
+                mb.start_devices(true, true);
+            },
+            _ => {},
+        }
+
+        // Pauses block this thread until whoever asked for them is done.
+        let pause = mb.pause.lock().unwrap().take();
+        if let Some((ack, resume)) = pause {
+            mb.stop_devices();
+            let _ = ack.send(());
+            let _ = resume.recv();
+            mb.start_devices(true, false);
+        }
+
+        let idle = mb.step_devices(self.step_budget);
+        if idle && mb.schedule.compare_exchange(
+                RUNNING, IDLE, Ordering::SeqCst, Ordering::SeqCst).is_ok() {
+            return;
+        }
+        mb.schedule.store(QUEUED, Ordering::SeqCst);
+        self.push(board, queue);
+    }
+
+    /// Takes a halted motherboard off the runtime.
+    fn finish(&self, board: Board) {
+        let mb = unsafe { &*board.0 };
+        mb.schedule.store(STOPPED, Ordering::SeqCst);
+        *mb.runtime.lock().unwrap() = None;
+        // Hanging up tells anyone waiting on a pause that it isn't happening.
+        mb.pause.lock().unwrap().take();
+
+        let mut boards = self.boards.lock().unwrap();
+        boards.retain(|b| *b != board);
+        self.halted.notify_all();
+        println!("Shutdown.");
+    }
+}
+
+/// A pool of threads running motherboards.
+pub struct Runtime {
+    shared: Arc<Shared>,
+    threads: Vec<thread::JoinHandle<()>>,
+}
+
+impl Runtime {
+    fn new(config: &RuntimeConfig) -> Runtime {
+        let threads = if config.threads != 0 {
+            config.threads as usize
+        } else {
+            thread::available_parallelism().map(|n| n.get()).unwrap_or(1)
+        };
+
+        let shared = Arc::new(Shared {
+            queues: (0..threads).map(|_| Mutex::new(VecDeque::new())).collect(),
+            next_queue: AtomicUsize::new(0),
+            boards: Mutex::new(Vec::new()),
+            halted: Condvar::new(),
+            sleep_lock: Mutex::new(()),
+            work: Condvar::new(),
+            shutdown: AtomicBool::new(false),
+            step_budget: if config.step_budget != 0 {
+                config.step_budget
+            } else {
+                DEFAULT_STEP_BUDGET
+            },
+        });
+
+        let handles = (0..threads).map(|i| {
+            let shared = shared.clone();
+            thread::spawn(move || shared.worker(i))
+        }).collect();
+
+        Runtime {
+            shared: shared,
+            threads: handles,
+        }
+    }
+
+    /// Prepare the motherboard and start it running on the runtime. Returns once the
+    /// motherboard is running; halt it as usual.
+    fn boot(&self, mb: &mut Motherboard) -> Result<(), &'static str> {
+        {
+            let mut rt = mb.runtime.lock().unwrap();
+            if rt.is_some() || mb.interrupt_chan.lock().unwrap().is_some() {
+                return Err("The motherboard is already running.");
+            }
+            *rt = Some(self.shared.clone());
+        }
+
+        let reset = match mb.prepare() {
+            Ok(reset) => reset,
+            Err(e) => {
+                *mb.runtime.lock().unwrap() = None;
+                return Err(e);
+            },
+        };
+        mb.control.store(CONTROL_NONE, Ordering::SeqCst);
+        mb.start_devices(true, reset);
+
+        self.shared.boards.lock().unwrap().push(Board(mb));
+        mb.schedule.store(IDLE, Ordering::SeqCst);
+        self.shared.wake(mb);
+        Ok(())
+    }
+
+    /// Wait for a motherboard on this runtime to halt.
+    fn wait(&self, mb: *mut Motherboard) {
+        let mut boards = self.shared.boards.lock().unwrap();
+        while boards.contains(&Board(mb)) {
+            boards = self.shared.halted.wait(boards).unwrap();
+        }
+    }
+
+    /// Halts every motherboard still running, then stops the threads.
+    fn shut_down(&mut self) {
+        let boards = self.shared.boards.lock().unwrap().clone();
+        for board in boards.iter() {
+            unsafe { (*board.0).request(MotherboardInterrupt::Halt) };
+        }
+        for board in boards {
+            self.wait(board.0);
+        }
+
+        self.shared.shutdown.store(true, Ordering::SeqCst);
+        {
+            let _sleep = self.shared.sleep_lock.lock().unwrap();
+            self.shared.work.notify_all();
+        }
+        for handle in self.threads.drain(..) {
+            let _ = handle.join();
+        }
+    }
+}
+
+// CFFI
+
+/// Creates a runtime and starts its threads.
+///
+/// # Safety
+///
+/// As with motherboards, the result must always be passed to `bscomp_runtime_destroy`.
+#[no_mangle]
+pub extern fn bscomp_runtime_new(config: *const RuntimeConfig) -> *mut Runtime {
+    if config.is_null() {
+        std::ptr::null_mut()
+    } else {
+        let config = unsafe { &*config };
+        Box::into_raw(Box::new(Runtime::new(config)))
+    }
+}
+
+/// Halts every motherboard still on the runtime, waits for them, and frees the runtime.
+#[no_mangle]
+pub extern fn bscomp_runtime_destroy(rt: *mut Runtime) {
+    if !rt.is_null() {
+        let mut rt = unsafe { Box::from_raw(rt) };
+        rt.shut_down();
+        drop(rt);
+    }
+}
+
+/// Boot a motherboard on the runtime. Unlike `bscomp_motherboard_boot`, returns as soon
+/// as the motherboard is running.
+///
+/// # Safety
+///
+/// The motherboard must not be destroyed until it has halted, which
+/// `bscomp_runtime_wait` can be used to wait for.
+#[no_mangle]
+pub extern fn bscomp_runtime_boot(rt: *mut Runtime, mb: *mut Motherboard) -> i32 {
+    if rt.is_null() || mb.is_null() {
+        -1
+    } else {
+        let rt = unsafe { &*rt };
+        let mb = unsafe { &mut *mb };
+        match rt.boot(mb) {
+            Ok(_) => 0,
+            Err(_) => -2,
+        }
+    }
+}
+
+/// Wait for a motherboard booted on the runtime to halt. Returns at once if it isn't
+/// running on the runtime.
+#[no_mangle]
+pub extern fn bscomp_runtime_wait(rt: *mut Runtime, mb: *mut Motherboard) -> i32 {
+    if rt.is_null() || mb.is_null() {
+        -1
+    } else {
+        let rt = unsafe { &*rt };
+        rt.wait(mb);
+        0
+    }
+}
@@ -0,0 +1,288 @@
+//! Whole-machine snapshots.
+//!
+//! A snapshot file is a header followed by sections. Integers are in host byte order, like
+//! the rest of the motherboard's memory, so snapshots only move between hosts which
+//! agree on it.
+//!
+//! - Header: the magic bytes `BSCSNAP\0`, the format version as a u32, and the number of
+//!   sections as a u32.
+//! - Each section: its kind, the index of the device it belongs to, and the device's type,
+//!   as u32, u32 and u64; then the length of its data as a u64, and the data itself,
+//!   padded with zeros to a multiple of 8 bytes so every section header stays aligned.
+//!
+//! There is one `SECTION_MOTHERBOARD`, holding the memory mapping table and the device
+//! information memory, then a `SECTION_DEVICE` for each device which can be snapshotted,
+//! holding whatever that device's `snapshot` function wrote.
+//!
+//! Snapshots are written in one pass of large sequential writes, and restored straight
+//! out of a read-only mapping of the file.
+
+use libc::{c_char, c_void};
+use std::ffi::CStr;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::mem;
+use std::os::unix::io::AsRawFd;
+use std::slice;
+
+use super::Motherboard;
+
+const MAGIC: &'static [u8; 8] = b"BSCSNAP\0";
+const VERSION: u32 = 1;
+
+const SECTION_MOTHERBOARD: u32 = 1;
+const SECTION_DEVICE: u32 = 2;
+
+const HEADER_SIZE: usize = 16;
+const SECTION_HEADER_SIZE: usize = 24;
+
+/// Size of the buffer between us and the file. Device sections bigger than this skip it.
+const WRITE_BUFFER_SIZE: usize = 1 << 20;
+
+// Errors, beyond those from devices.
+//
+// Couldn't open, read, write or map the file.
+const IO_ERROR: i32 = -2;
+// Not a snapshot, a snapshot from another version, or cut short.
+const FORMAT_ERROR: i32 = -3;
+// A snapshot of a different machine.
+const MISMATCH_ERROR: i32 = -4;
+
+fn padding(len: usize) -> usize {
+    (8 - len % 8) % 8
+}
+
+fn u32_bytes(value: u32) -> [u8; 4] {
+    unsafe { mem::transmute::<u32, [u8; 4]>(value) }
+}
+
+fn u64_bytes(value: u64) -> [u8; 8] {
+    unsafe { mem::transmute::<u64, [u8; 8]>(value) }
+}
+
+fn read_u32(data: &[u8], at: usize) -> u32 {
+    let mut bytes = [0u8; 4];
+    bytes.copy_from_slice(&data[at..at + 4]);
+    unsafe { mem::transmute::<[u8; 4], u32>(bytes) }
+}
+
+fn read_u64(data: &[u8], at: usize) -> u64 {
+    let mut bytes = [0u8; 8];
+    bytes.copy_from_slice(&data[at..at + 8]);
+    unsafe { mem::transmute::<[u8; 8], u64>(bytes) }
+}
+
+/// The motherboard's own section: the mapping table, then device information memory.
+fn motherboard_section(mb: &Motherboard) -> Vec<u8> {
+    let mut data = Vec::new();
+    data.extend(u32_bytes(mb.ram_mappings.len() as u32).iter());
+    for mapping in mb.ram_mappings.iter() {
+        data.extend(u32_bytes(*mapping as u32).iter());
+    }
+    data.extend(mb.deviceinfo_memory.iter());
+    data
+}
+
+fn write_section<W: Write>(out: &mut W, kind: u32, index: u32, device_type: u64, data: &[u8])
+    -> std::io::Result<()> {
+
+    out.write_all(&u32_bytes(kind))?;
+    out.write_all(&u32_bytes(index))?;
+    out.write_all(&u64_bytes(device_type))?;
+    out.write_all(&u64_bytes(data.len() as u64))?;
+    out.write_all(data)?;
+    out.write_all(&[0u8; 8][..padding(data.len())])
+}
+
+/// Write a snapshot of a paused motherboard to `path`.
+fn write_snapshot(mb: &Motherboard, path: &str) -> i32 {
+    // Gather every section before touching the file, so a failing device doesn't leave
+    // half a snapshot behind.
+    let mut sections = Vec::new();
+    for (i, device) in mb.devices.iter().enumerate() {
+        let snapshot = match device.snapshot {
+            Some(snapshot) => snapshot,
+            None => continue,
+        };
+
+        let mut len = 0u32;
+        let result = snapshot(device.device, std::ptr::null_mut(), 0, &mut len);
+        if result != 0 {
+            return result;
+        }
+        let mut data = vec![0u8; len as usize];
+        let result = snapshot(device.device, data.as_mut_ptr(), len, &mut len);
+        if result != 0 {
+            return result;
+        }
+        data.truncate(len as usize);
+        sections.push((i, data));
+    }
+
+    let file = match File::create(path) {
+        Ok(file) => file,
+        Err(_) => return IO_ERROR,
+    };
+    let mut out = BufWriter::with_capacity(WRITE_BUFFER_SIZE, file);
+
+    let written = (|| -> std::io::Result<()> {
+        out.write_all(MAGIC)?;
+        out.write_all(&u32_bytes(VERSION))?;
+        out.write_all(&u32_bytes(sections.len() as u32 + 1))?;
+        write_section(&mut out, SECTION_MOTHERBOARD, !0u32, 0, &motherboard_section(mb))?;
+        for &(i, ref data) in sections.iter() {
+            write_section(&mut out, SECTION_DEVICE, i as u32, mb.devices[i].device_type, data)?;
+        }
+        out.flush()
+    })();
+
+    match written {
+        Ok(_) => 0,
+        Err(_) => IO_ERROR,
+    }
+}
+
+/// Restore a paused motherboard from a snapshot mapped into memory.
+fn apply_snapshot(mb: &Motherboard, data: &[u8]) -> i32 {
+    if data.len() < HEADER_SIZE || &data[0..8] != &MAGIC[..] || read_u32(data, 8) != VERSION {
+        return FORMAT_ERROR;
+    }
+    let count = read_u32(data, 12);
+
+    // Find every section before restoring anything, so a bad file leaves the machine as
+    // it was.
+    let mut sections = Vec::new();
+    let mut at = HEADER_SIZE;
+    for _ in 0..count {
+        if data.len() - at < SECTION_HEADER_SIZE {
+            return FORMAT_ERROR;
+        }
+        let kind = read_u32(data, at);
+        let index = read_u32(data, at + 4);
+        let device_type = read_u64(data, at + 8);
+        let len = read_u64(data, at + 16);
+        at += SECTION_HEADER_SIZE;
+        if len > (data.len() - at) as u64 {
+            return FORMAT_ERROR;
+        }
+        let len = len as usize;
+        sections.push((kind, index, device_type, &data[at..at + len]));
+        at += len + padding(len);
+        at = std::cmp::min(at, data.len());
+    }
+
+    let mut restores = Vec::new();
+    let mut saw_motherboard = false;
+    for &(kind, index, device_type, section) in sections.iter() {
+        match kind {
+            SECTION_MOTHERBOARD => {
+                // The machine has to be put together the same way it was.
+                if section != &motherboard_section(mb)[..] {
+                    return MISMATCH_ERROR;
+                }
+                saw_motherboard = true;
+            },
+            SECTION_DEVICE => {
+                if (index as usize) >= mb.devices.len() || section.len() > (!0u32 as usize) {
+                    return MISMATCH_ERROR;
+                }
+                let device = mb.devices[index as usize];
+                match device.restore {
+                    Some(restore) if device.device_type == device_type => {
+                        restores.push((restore, device.device, section));
+                    },
+                    _ => return MISMATCH_ERROR,
+                }
+            },
+            // Sections from later versions of the format get a new version number, so
+            // anything else is corruption.
+            _ => return FORMAT_ERROR,
+        }
+    }
+    if !saw_motherboard {
+        return FORMAT_ERROR;
+    }
+
+    for (restore, device, section) in restores {
+        let result = restore(device, section.as_ptr(), section.len() as u32);
+        if result != 0 {
+            return result;
+        }
+    }
+    0
+}
+
+/// Map a snapshot file and restore the motherboard from it.
+fn read_snapshot(mb: &Motherboard, path: &str) -> i32 {
+    let file = match File::open(path) {
+        Ok(file) => file,
+        Err(_) => return IO_ERROR,
+    };
+    let len = match file.metadata() {
+        Ok(metadata) => metadata.len() as usize,
+        Err(_) => return IO_ERROR,
+    };
+    if len == 0 {
+        return FORMAT_ERROR;
+    }
+
+    let base = unsafe {
+        libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ, libc::MAP_PRIVATE,
+                   file.as_raw_fd(), 0)
+    };
+    if base == libc::MAP_FAILED {
+        return IO_ERROR;
+    }
+
+    let result = {
+        let data = unsafe { slice::from_raw_parts(base as *const u8, len) };
+        apply_snapshot(mb, data)
+    };
+
+    unsafe { libc::munmap(base as *mut c_void, len) };
+    result
+}
+
+fn path_str<'a>(path: *const c_char) -> Option<&'a str> {
+    if path.is_null() {
+        None
+    } else {
+        unsafe { CStr::from_ptr(path) }.to_str().ok()
+    }
+}
+
+/// Save a booted motherboard to the file at `path`.
+///
+/// Every device is stopped while the snapshot is taken, and started again where it left
+/// off afterwards. Must not be called from a device's boot or step function.
+#[no_mangle]
+pub extern fn bscomp_motherboard_snapshot(mb: *mut Motherboard, path: *const c_char) -> i32 {
+    if mb.is_null() {
+        return -1;
+    }
+    let path = match path_str(path) {
+        Some(path) => path,
+        None => return IO_ERROR,
+    };
+    let mb = unsafe { &*mb };
+    mb.paused(|mb| write_snapshot(mb, path))
+}
+
+/// Put a booted motherboard back in the state saved in the file at `path`.
+///
+/// The motherboard must have the same devices, in the same slots, as the one the
+/// snapshot was taken of. Every device is stopped while the snapshot is restored, and
+/// started again without being reset. Must not be called from a device's boot or step
+/// function.
+#[no_mangle]
+pub extern fn bscomp_motherboard_restore(mb: *mut Motherboard, path: *const c_char) -> i32 {
+    if mb.is_null() {
+        return -1;
+    }
+    let path = match path_str(path) {
+        Some(path) => path,
+        None => return IO_ERROR,
+    };
+    let mb = unsafe { &*mb };
+    mb.paused(|mb| read_snapshot(mb, path))
+}
@@ -0,0 +1,145 @@
+// Throughput of the RAM device's memory callbacks. Run with `make bench`.
+//
+// Prints one JSON object per line for each combination of memory layout, operation and
+// transfer size, giving the time per call and the bytes moved per second.
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "motherboard.h"
+#include "ram.h"
+
+static const uint32_t bench_memory_size = 64u << 20;
+// Each measurement runs for at least this long, and the fastest of bench_repeats
+// measurements is reported.
+static const double bench_min_seconds = 0.05;
+static const int bench_repeats = 3;
+
+struct Bench {
+    struct Device* dev;
+    uint8_t* buffer;
+    uint32_t size;
+    // Vectored calls split the transfer evenly between all of these.
+    struct MemorySegment segments[16];
+};
+
+static const uint32_t bench_segments = sizeof(((struct Bench*)0)->segments)
+    / sizeof(struct MemorySegment);
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Transfers step through memory rather than hitting the same bytes every time.
+static uint32_t bench_address(struct Bench* b, uint64_t i) {
+    return (i * b->size) % (bench_memory_size - b->size);
+}
+
+static void run_load(struct Bench* b, uint64_t i) {
+    b->dev->load_bytes(b->dev->device, bench_address(b, i), b->size, b->buffer);
+}
+
+static void run_write(struct Bench* b, uint64_t i) {
+    b->dev->write_bytes(b->dev->device, bench_address(b, i), b->size, b->buffer);
+}
+
+static void fill_segments(struct Bench* b, uint64_t i) {
+    uint32_t address = bench_address(b, i);
+    uint32_t length = b->size / bench_segments;
+    for (uint32_t s = 0; s < bench_segments; ++s) {
+        b->segments[s].address = address + s * length;
+        b->segments[s].length = length;
+        b->segments[s].buffer = b->buffer + s * length;
+    }
+}
+
+static void run_load_v(struct Bench* b, uint64_t i) {
+    fill_segments(b, i);
+    b->dev->load_bytes_v(b->dev->device, b->segments, bench_segments);
+}
+
+static void run_write_v(struct Bench* b, uint64_t i) {
+    fill_segments(b, i);
+    b->dev->write_bytes_v(b->dev->device, b->segments, bench_segments);
+}
+
+// Nanoseconds per call of the fastest run.
+static double measure(struct Bench* b, void (*op)(struct Bench*, uint64_t)) {
+    uint64_t iterations = 1;
+    double best = 0;
+    for (int repeat = 0; repeat < bench_repeats; ++repeat) {
+        while (1) {
+            double start = now_seconds();
+            for (uint64_t i = 0; i < iterations; ++i) {
+                op(b, i);
+            }
+            double elapsed = now_seconds() - start;
+            if (elapsed >= bench_min_seconds) {
+                double ns = elapsed * 1e9 / iterations;
+                if (!best || ns < best) {
+                    best = ns;
+                }
+                break;
+            }
+            iterations *= 2;
+        }
+    }
+    return best;
+}
+
+int main(void) {
+    static const char* layouts[] = {"flat", "sparse", "tracked"};
+    static const uint32_t sizes[] = {8, 64, 512, 4096, 65536, 1u << 20};
+    static const struct {
+        const char* name;
+        void (*op)(struct Bench*, uint64_t);
+        int vectored;
+    } ops[] = {
+        {"load_bytes", &run_load, 0},
+        {"write_bytes", &run_write, 0},
+        {"load_bytes_v", &run_load_v, 1},
+        {"write_bytes_v", &run_write_v, 1},
+    };
+
+    struct Bench b;
+    b.buffer = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    if (!b.buffer) {
+        return 1;
+    }
+    memset(b.buffer, 0x5a, sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+    for (int layout = 0; layout < 3; ++layout) {
+        struct RAMConfig config = {bench_memory_size, layout == 1, layout == 2};
+        b.dev = bscomp_device_new(&config);
+        if (!b.dev) {
+            fprintf(stderr, "Could not create %s RAM\n", layouts[layout]);
+            return 1;
+        }
+        b.dev->reset(b.dev->device);
+
+        for (size_t op = 0; op < sizeof(ops) / sizeof(ops[0]); ++op) {
+            for (size_t size = 0; size < sizeof(sizes) / sizeof(sizes[0]); ++size) {
+                b.size = sizes[size];
+                if (ops[op].vectored && b.size < bench_segments) {
+                    continue;
+                }
+                double ns = measure(&b, ops[op].op);
+                printf("{\"suite\": \"ram\", \"bench\": \"%s\", \"layout\": \"%s\", "
+                       "\"bytes\": %u, \"ns_per_op\": %.2f, \"bytes_per_second\": %.0f}\n",
+                       ops[op].name, layouts[layout], b.size, ns, b.size / ns * 1e9);
+                fflush(stdout);
+            }
+        }
+
+        bscomp_device_destroy(b.dev);
+    }
+
+    free(b.buffer);
+    return 0;
+}
@@ -1,51 +1,248 @@
+// For memfd_create and MAP_ANONYMOUS.
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "motherboard.h"
 #include "ram.h"
 
+// Sparse memory is allocated in pages of 2^sparse_page_bits bytes.
+static const uint32_t sparse_page_bits = 16;
+static const uint32_t sparse_page_size = 1u << sparse_page_bits;
+static const uint32_t sparse_page_mask = (1u << sparse_page_bits) - 1;
+
+// Pages tracked for writes are 2^ram_dirty_page_bits bytes.
+static const uint32_t ram_dirty_page_bits = 12;
+
 struct RamDevice {
     uint32_t memory_size;
+    // Flat memory, or null if sparse. Mapped rather than allocated so clones can share
+    // pages with their template until either writes to them.
     uint8_t* memory;
+    // Sparse memory, or null if flat: a table of pages, each null until first written.
+    // Pages are only ever added while the device runs, so readers need no lock.
+    uint8_t** pages;
+    uint32_t page_count;
+    uint64_t resident_pages;
+
+    // Bitmaps of the pages written since the last reset, and since the dirty set was
+    // last collected, or null if writes aren't tracked. Tracked memory is only mapped
+    // for reading, so every write comes through write_bytes.
+    uint64_t* touched;
+    uint64_t* dirty;
+    uint32_t dirty_words;
 };
 
 static uint32_t next_device_id = 0;
 
 static int32_t load_bytes(void*, uint32_t, uint32_t, uint8_t*);
 static int32_t write_bytes(void*, uint32_t, uint32_t, uint8_t*);
+static int32_t load_bytes_v(void*, const struct MemorySegment*, uint32_t);
+static int32_t write_bytes_v(void*, const struct MemorySegment*, uint32_t);
 static int32_t reset(void*);
+static int32_t map_memory(void*, uint8_t**, uint32_t*, uint32_t*);
+static int32_t snapshot(void*, uint8_t*, uint32_t, uint32_t*);
+static int32_t restore(void*, const uint8_t*, uint32_t);
+static int32_t clone_device(void*, uint32_t, struct Device*);
+static int32_t destroy(void*);
 
-struct Device* bscomp_device_new(const struct RAMConfig* config) {
-    if (!config || !config->memory_size) {
-        return 0;
+// Fill in a device descriptor for ramdev.
+static void describe(struct Device* dev, struct RamDevice* ramdev) {
+    *dev = (const struct Device){0};
+
+    dev->device = ramdev;
+    dev->export_memory_size = ramdev->memory_size;
+
+    dev->load_bytes = &load_bytes;
+    dev->write_bytes = &write_bytes;
+    dev->load_bytes_v = &load_bytes_v;
+    dev->write_bytes_v = &write_bytes_v;
+    dev->reset = &reset;
+    // Sparse memory isn't contiguous, so every access has to come through us.
+    dev->map_memory = ramdev->pages ? 0 : &map_memory;
+    dev->snapshot = &snapshot;
+    dev->restore = &restore;
+    dev->clone = &clone_device;
+    dev->destroy = &destroy;
+
+    dev->device_type = ram_device_type_id;
+    dev->device_id = next_device_id++;
+}
+
+// Start tracking writes to ramdev, with nothing written yet.
+static int32_t track(struct RamDevice* ramdev) {
+    uint64_t pages = ((uint64_t)ramdev->memory_size + ram_dirty_page_size - 1)
+        >> ram_dirty_page_bits;
+    ramdev->dirty_words = (uint32_t)((pages + 63) / 64);
+    ramdev->touched = calloc(ramdev->dirty_words, sizeof(uint64_t));
+    ramdev->dirty = calloc(ramdev->dirty_words, sizeof(uint64_t));
+    if (!ramdev->touched || !ramdev->dirty) {
+        free(ramdev->touched);
+        free(ramdev->dirty);
+        ramdev->touched = 0;
+        ramdev->dirty = 0;
+        return -1;
     }
+    return 0;
+}
 
-    struct Device* dev = malloc(sizeof(struct Device));
+// Set the bits for the pages under a write which has already landed, so whoever
+// collects a bit reads the page after the write.
+static void mark(uint64_t* bitmap, uint32_t addr, uint32_t len) {
+    uint32_t first = addr >> ram_dirty_page_bits;
+    uint32_t last = (uint32_t)(((uint64_t)addr + len - 1) >> ram_dirty_page_bits);
+    for (uint32_t page = first; page <= last; ++page) {
+        uint64_t bit = 1ull << (page % 64);
+        // Most writes land on pages already marked; only write the word if not.
+        if (!(__atomic_load_n(&bitmap[page / 64], __ATOMIC_RELAXED) & bit)) {
+            __atomic_fetch_or(&bitmap[page / 64], bit, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void mark_written(struct RamDevice* rd, uint32_t addr, uint32_t len) {
+    if (rd->touched && len) {
+        mark(rd->touched, addr, len);
+        mark(rd->dirty, addr, len);
+    }
+}
+
+// Allocate zeroed memory of either kind.
+static struct RamDevice* create(uint32_t memory_size, int sparse, int track_writes) {
     struct RamDevice* ramdev = malloc(sizeof(struct RamDevice));
-    uint8_t* mem = malloc(config->memory_size);
+    if (!ramdev) {
+        return 0;
+    }
+    *ramdev = (const struct RamDevice){0};
+    ramdev->memory_size = memory_size;
 
-    if (!dev || !ramdev || !mem) {
-        free(dev);
-        free(ramdev);
-        free(mem);
+    if (sparse) {
+        ramdev->page_count = (uint32_t)(((uint64_t)memory_size + sparse_page_mask)
+                                        >> sparse_page_bits);
+        ramdev->pages = calloc(ramdev->page_count, sizeof(uint8_t*));
+        if (!ramdev->pages) {
+            free(ramdev);
+            return 0;
+        }
+    } else {
+        // Anonymous pages are zeroed, and only take up memory once touched.
+        uint8_t* mem = mmap(0, memory_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            free(ramdev);
+            return 0;
+        }
+        ramdev->memory = mem;
+    }
+
+    if (track_writes && track(ramdev)) {
+        destroy(ramdev);
         return 0;
     }
 
-    *dev = (const struct Device){0};
+    return ramdev;
+}
 
-    ramdev->memory_size = config->memory_size;
-    ramdev->memory = mem;
+// Free every sparse page, leaving the memory all zeros.
+static void drop_pages(struct RamDevice* rd) {
+    for (uint32_t i = 0; i < rd->page_count; ++i) {
+        free(rd->pages[i]);
+        rd->pages[i] = 0;
+    }
+    rd->resident_pages = 0;
+}
 
-    dev->device = ramdev;
-    dev->export_memory_size = config->memory_size;
+// Get a sparse page for writing, allocating it if this is the first write. Null if out
+// of memory.
+static uint8_t* sparse_page(struct RamDevice* rd, uint32_t index) {
+    uint8_t* page = __atomic_load_n(&rd->pages[index], __ATOMIC_ACQUIRE);
+    if (page) {
+        return page;
+    }
 
-    dev->load_bytes = &load_bytes;
-    dev->write_bytes = &write_bytes;
-    dev->reset = &reset;
+    uint8_t* fresh = calloc(1, sparse_page_size);
+    if (!fresh) {
+        return 0;
+    }
+    // Two writers may race to allocate the same page; the loser uses the winner's.
+    if (__atomic_compare_exchange_n(&rd->pages[index], &page, fresh, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&rd->resident_pages, 1, __ATOMIC_RELAXED);
+        return fresh;
+    }
+    free(fresh);
+    return page;
+}
 
-    dev->device_type = ram_device_type_id;
-    dev->device_id = next_device_id++;
+// Untouched pages read as zeros, without allocating them.
+static void sparse_load(struct RamDevice* rd, uint32_t src, uint32_t len, uint8_t* dest) {
+    while (len) {
+        uint32_t offset = src & sparse_page_mask;
+        uint32_t chunk = sparse_page_size - offset < len ? sparse_page_size - offset : len;
+        uint8_t* page = __atomic_load_n(&rd->pages[src >> sparse_page_bits], __ATOMIC_ACQUIRE);
+        if (page) {
+            memcpy(dest, page + offset, chunk);
+        } else {
+            memset(dest, 0, chunk);
+        }
+        src += chunk;
+        dest += chunk;
+        len -= chunk;
+    }
+}
+
+static int all_zero(const uint8_t* bytes, uint32_t len) {
+    for (uint32_t i = 0; i < len; ++i) {
+        if (bytes[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Writing zeros to an untouched page leaves it untouched.
+static int32_t sparse_write(struct RamDevice* rd, uint32_t dest, uint32_t len,
+                            const uint8_t* src) {
+    while (len) {
+        uint32_t offset = dest & sparse_page_mask;
+        uint32_t chunk = sparse_page_size - offset < len ? sparse_page_size - offset : len;
+        uint32_t index = dest >> sparse_page_bits;
+        if (__atomic_load_n(&rd->pages[index], __ATOMIC_ACQUIRE) || !all_zero(src, chunk)) {
+            uint8_t* page = sparse_page(rd, index);
+            if (!page) {
+                return -2;
+            }
+            memcpy(page + offset, src, chunk);
+        }
+        dest += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+struct Device* bscomp_device_new(const struct RAMConfig* config) {
+    if (!config || !config->memory_size) {
+        return 0;
+    }
+
+    struct Device* dev = malloc(sizeof(struct Device));
+    struct RamDevice* ramdev = create(config->memory_size, config->sparse,
+                                      config->track_writes);
+
+    if (!dev || !ramdev) {
+        free(dev);
+        if (ramdev) {
+            destroy(ramdev);
+        }
+        return 0;
+    }
+
+    describe(dev, ramdev);
 
     return dev;
 }
@@ -56,7 +253,7 @@ void bscomp_device_destroy(struct Device* dev) {
     }
 
     struct RamDevice* ramdev = dev->device;
-    if (!ramdev || !ramdev->memory) {
+    if (!ramdev || (!ramdev->memory && !ramdev->pages)) {
         // Things are borked already, we're not even going to try to fix it by cleaning
         // stuff up. That might just make things worse if we have the wrong kind of
         // pointer.
@@ -65,10 +262,7 @@ void bscomp_device_destroy(struct Device* dev) {
 
     // Clear pointers after free, even thoug we know we're freeing the object that
     // contains them too.
-    free(ramdev->memory);
-    ramdev->memory = 0;
-
-    free(ramdev);
+    destroy(ramdev);
     dev->device = 0;
 
     free(dev);
@@ -81,8 +275,16 @@ static int32_t load_bytes(void* ramdev, uint32_t src, uint32_t len, uint8_t* des
 
     struct RamDevice* rd = ramdev;
 
-    for (uint32_t i = 0; i < len && src + i < rd->memory_size; i++) {
-        dest[i] = rd->memory[i];
+    if (src >= rd->memory_size) {
+        return 0;
+    }
+    if (len > rd->memory_size - src) {
+        len = rd->memory_size - src;
+    }
+    if (rd->pages) {
+        sparse_load(rd, src, len, dest);
+    } else {
+        memcpy(dest, rd->memory + src, len);
     }
 
     return 0;
@@ -95,20 +297,345 @@ static int32_t write_bytes(void* ramdev, uint32_t dest, uint32_t len, uint8_t* s
 
     struct RamDevice* rd = ramdev;
 
-    for (uint32_t i = 0; i < len && dest + i < rd->memory_size; i++) {
-        rd->memory[i] = src[i];
+    if (dest >= rd->memory_size) {
+        return 0;
     }
+    if (len > rd->memory_size - dest) {
+        len = rd->memory_size - dest;
+    }
+    int32_t result = 0;
+    if (rd->pages) {
+        result = sparse_write(rd, dest, len, src);
+    } else {
+        memcpy(rd->memory + dest, src, len);
+    }
+    mark_written(rd, dest, len);
+
+    return result;
+}
 
+// Vectored accesses save the calls, not the copies.
+static int32_t load_bytes_v(void* ramdev, const struct MemorySegment* segments,
+                            uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t result = load_bytes(ramdev, segments[i].address, segments[i].length,
+                                    segments[i].buffer);
+        if (result) {
+            return result;
+        }
+    }
     return 0;
 }
 
+static int32_t write_bytes_v(void* ramdev, const struct MemorySegment* segments,
+                             uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t result = write_bytes(ramdev, segments[i].address, segments[i].length,
+                                     segments[i].buffer);
+        if (result) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+// Zero just the pages written since the last reset, which keeps the rest of the
+// memory's pages where they are rather than faulting them all in again.
+static void reset_touched(struct RamDevice* rd) {
+    for (uint32_t i = 0; i < rd->dirty_words; ++i) {
+        for (uint64_t bits = rd->touched[i]; bits; bits &= bits - 1) {
+            uint64_t addr = ((uint64_t)i * 64 + __builtin_ctzll(bits)) << ram_dirty_page_bits;
+            uint64_t len = ram_dirty_page_size;
+            if (len > rd->memory_size - addr) {
+                len = rd->memory_size - addr;
+            }
+            memset(rd->memory + addr, 0, len);
+        }
+    }
+}
+
 static int32_t reset(void* ramdev) {
     if (!ramdev) {
         return -1;
     }
 
     struct RamDevice* rd = ramdev;
-    memset(rd->memory, 0, rd->memory_size);
+    int tracked = rd->touched != 0;
+    if (tracked) {
+        // Whatever was written is about to change back to zeros.
+        for (uint32_t i = 0; i < rd->dirty_words; ++i) {
+            rd->dirty[i] |= rd->touched[i];
+        }
+        if (!rd->pages) {
+            reset_touched(rd);
+        }
+        memset(rd->touched, 0, rd->dirty_words * sizeof(uint64_t));
+    }
+
+    if (rd->pages) {
+        drop_pages(rd);
+    } else if (!tracked) {
+        // Swap in fresh zero pages rather than writing zeros, so memory the guest never
+        // touches again costs nothing, and any pages shared with a clone image are let
+        // go.
+        void* mem = mmap(rd->memory, rd->memory_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (mem == MAP_FAILED) {
+            memset(rd->memory, 0, rd->memory_size);
+        }
+    }
 
     return 0;
 }
+
+static int32_t map_memory(void* ramdev, uint8_t** base, uint32_t* length, uint32_t* flags) {
+    if (!ramdev) {
+        return -1;
+    }
+
+    // Mapped with the device, and only ever remapped in place, so it never moves.
+    struct RamDevice* rd = ramdev;
+    *base = rd->memory;
+    *length = rd->memory_size;
+    *flags = rd->touched ? bscomp_map_readable : bscomp_map_readable | bscomp_map_writable;
+
+    return 0;
+}
+
+// The snapshot is just the memory.
+static int32_t snapshot(void* ramdev, uint8_t* dest, uint32_t capacity, uint32_t* length) {
+    if (!ramdev) {
+        return -1;
+    }
+
+    struct RamDevice* rd = ramdev;
+    *length = rd->memory_size;
+    if (dest && capacity >= rd->memory_size) {
+        if (rd->pages) {
+            sparse_load(rd, 0, rd->memory_size, dest);
+        } else {
+            memcpy(dest, rd->memory, rd->memory_size);
+        }
+    }
+
+    return 0;
+}
+
+static int32_t restore(void* ramdev, const uint8_t* src, uint32_t length) {
+    if (!ramdev) {
+        return -1;
+    }
+
+    struct RamDevice* rd = ramdev;
+    if (length != rd->memory_size) {
+        return -2;
+    }
+    int32_t result = 0;
+    if (rd->pages) {
+        // Only pages with something in them come back.
+        drop_pages(rd);
+        result = sparse_write(rd, 0, length, src);
+    } else {
+        memcpy(rd->memory, src, length);
+    }
+    mark_written(rd, 0, length);
+
+    return result;
+}
+
+// Clones have written everything the template has, and all of it is news to whoever
+// collects their dirty pages.
+static void copy_tracking(struct RamDevice* copy, const struct RamDevice* rd) {
+    if (rd->touched) {
+        memcpy(copy->touched, rd->touched, rd->dirty_words * sizeof(uint64_t));
+        memcpy(copy->dirty, rd->touched, rd->dirty_words * sizeof(uint64_t));
+    }
+}
+
+// Sparse clones get their own copy of every page the template has written.
+static int32_t clone_sparse(struct RamDevice* rd, uint32_t count, struct Device* copies) {
+    uint32_t made = 0;
+    for (; made < count; ++made) {
+        struct RamDevice* copy = create(rd->memory_size, 1, rd->touched != 0);
+        if (!copy) {
+            break;
+        }
+        describe(&copies[made], copy);
+        copy_tracking(copy, rd);
+
+        for (uint32_t i = 0; i < rd->page_count; ++i) {
+            if (!rd->pages[i]) {
+                continue;
+            }
+            copy->pages[i] = malloc(sparse_page_size);
+            if (!copy->pages[i]) {
+                break;
+            }
+            memcpy(copy->pages[i], rd->pages[i], sparse_page_size);
+            ++copy->resident_pages;
+        }
+        if (copy->resident_pages != rd->resident_pages) {
+            destroy(copy);
+            break;
+        }
+    }
+
+    if (made == count) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < made; ++i) {
+        destroy(copies[i].device);
+    }
+    return -2;
+}
+
+// Write the memory to an in-memory file, then map the file privately for the template
+// and every clone. They all share the file's pages until they write to them.
+static int32_t clone_device(void* ramdev, uint32_t count, struct Device* copies) {
+    if (!ramdev || (count && !copies)) {
+        return -1;
+    }
+
+    struct RamDevice* rd = ramdev;
+    if (rd->pages) {
+        return clone_sparse(rd, count, copies);
+    }
+
+    int fd = memfd_create("bscomp-ram", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -2;
+    }
+    if (ftruncate(fd, rd->memory_size) != 0) {
+        close(fd);
+        return -2;
+    }
+    for (uint32_t written = 0; written < rd->memory_size;) {
+        ssize_t res = write(fd, rd->memory + written, rd->memory_size - written);
+        if (res <= 0) {
+            close(fd);
+            return -2;
+        }
+        written += res;
+    }
+
+    uint32_t made = 0;
+    for (; made < count; ++made) {
+        struct RamDevice* copy = malloc(sizeof(struct RamDevice));
+        uint8_t* mem = mmap(0, rd->memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (!copy || mem == MAP_FAILED) {
+            free(copy);
+            if (mem != MAP_FAILED) {
+                munmap(mem, rd->memory_size);
+            }
+            break;
+        }
+
+        *copy = (const struct RamDevice){0};
+        copy->memory_size = rd->memory_size;
+        copy->memory = mem;
+        if (rd->touched && track(copy)) {
+            destroy(copy);
+            break;
+        }
+        describe(&copies[made], copy);
+        copy_tracking(copy, rd);
+    }
+
+    int32_t result = made == count ? 0 : -2;
+    if (!result) {
+        // Same contents, same address, but now backed by the shared image, so the pages
+        // the template has already written stop taking up memory of their own. If that
+        // fails the old mapping may already be gone, so the clone fails with it.
+        void* mem = mmap(rd->memory, rd->memory_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_FIXED, fd, 0);
+        if (mem == MAP_FAILED) {
+            result = -2;
+        }
+    }
+    if (result) {
+        for (uint32_t i = 0; i < made; ++i) {
+            destroy(copies[i].device);
+        }
+    }
+
+    // The mappings keep the file alive.
+    close(fd);
+    return result;
+}
+
+static int32_t destroy(void* ramdev) {
+    if (!ramdev) {
+        return -1;
+    }
+
+    struct RamDevice* rd = ramdev;
+    if (rd->pages) {
+        drop_pages(rd);
+        free(rd->pages);
+        rd->pages = 0;
+    } else {
+        munmap(rd->memory, rd->memory_size);
+        rd->memory = 0;
+    }
+    free(rd->touched);
+    free(rd->dirty);
+    free(rd);
+
+    return 0;
+}
+
+uint64_t bscomp_ram_resident_bytes(const struct Device* dev) {
+    if (!dev || !dev->device || dev->device_type != ram_device_type_id) {
+        return 0;
+    }
+
+    struct RamDevice* rd = dev->device;
+    if (rd->pages) {
+        return __atomic_load_n(&rd->resident_pages, __ATOMIC_RELAXED) << sparse_page_bits;
+    }
+
+    // Ask the kernel which pages of the mapping it has backed.
+    uint64_t host_page = sysconf(_SC_PAGESIZE);
+    uint64_t host_pages = (rd->memory_size + host_page - 1) / host_page;
+    unsigned char* resident = malloc(host_pages);
+    if (!resident) {
+        return 0;
+    }
+    uint64_t count = 0;
+    if (mincore(rd->memory, rd->memory_size, resident) == 0) {
+        for (uint64_t i = 0; i < host_pages; ++i) {
+            count += resident[i] & 1;
+        }
+    }
+    free(resident);
+    return count * host_page;
+}
+
+uint32_t bscomp_ram_dirty_words(const struct Device* dev) {
+    if (!dev || !dev->device || dev->device_type != ram_device_type_id) {
+        return 0;
+    }
+
+    struct RamDevice* rd = dev->device;
+    return rd->touched ? rd->dirty_words : 0;
+}
+
+int32_t bscomp_ram_collect_dirty(const struct Device* dev, uint64_t* bitmap, uint32_t words) {
+    if (!dev || !dev->device || dev->device_type != ram_device_type_id || !bitmap) {
+        return -1;
+    }
+
+    struct RamDevice* rd = dev->device;
+    if (!rd->touched) {
+        return -1;
+    }
+    if (words < rd->dirty_words) {
+        return -2;
+    }
+
+    // A write racing with this lands in this collection or the next, never neither.
+    for (uint32_t i = 0; i < rd->dirty_words; ++i) {
+        bitmap[i] = __atomic_exchange_n(&rd->dirty[i], 0, __ATOMIC_ACQUIRE);
+    }
+    return 0;
+}
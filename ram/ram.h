@@ -9,9 +9,35 @@ static const uint64_t ram_device_type_id = (1l << 32) | 1l;
 
 struct RAMConfig {
     uint32_t memory_size;
+    // Nonzero to allocate memory in 64 KiB pages as they are first written, rather than
+    // all up front. Untouched pages read as zeros and reset frees every page, so large
+    // memories only cost what the guest uses. Sparse memory can't be directly mapped,
+    // so every access goes through the motherboard.
+    uint32_t sparse;
+    // Nonzero to track which pages are written. Reset then only clears pages written
+    // since the last reset, and bscomp_ram_collect_dirty reports pages written since it
+    // was last called. Tracked memory is only directly mapped for reading, so writes
+    // from other devices go through the motherboard.
+    uint32_t track_writes;
 };
 
+// Size of the pages tracked for writes.
+static const uint32_t ram_dirty_page_size = 1u << 12;
+
 struct Device* bscomp_device_new(const struct RAMConfig* config);
 void bscomp_device_destroy(struct Device* dev);
 
+// Bytes of host memory holding the device's memory. For flat memory this counts every
+// page the host has backed, including pages only ever read.
+uint64_t bscomp_ram_resident_bytes(const struct Device* dev);
+
+// Words of dirty page bitmap for a device which tracks writes, or 0 if it doesn't.
+uint32_t bscomp_ram_dirty_words(const struct Device* dev);
+
+// Store a bitmap of the pages written since the last call, bit i % 64 of word i / 64
+// standing for page i, and start afresh. Each page is written in full before its bit is
+// set, so reading the marked pages after this returns sees at least those writes.
+// Returns -1 if the device doesn't track writes and -2 if the bitmap is too small.
+int32_t bscomp_ram_collect_dirty(const struct Device* dev, uint64_t* bitmap, uint32_t words);
+
 #endif // bscomp_ram_h
@@ -0,0 +1,229 @@
+// For fstat and friends.
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "motherboard.h"
+#include "rom.h"
+
+// An image file mapped into memory. Every ROM made from the same file points at the same
+// image, which is unmapped when the last of them is destroyed.
+struct RomImage {
+    // Which file this is. A file replaced under the same path is a different image.
+    dev_t file_device;
+    ino_t file_inode;
+
+    uint8_t* memory;
+    uint32_t memory_size;
+    uint32_t references;
+
+    struct RomImage* next;
+};
+
+// Every image in use. Only touched when ROMs come and go, never while they're read.
+static struct RomImage* images = 0;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t next_device_id = 0;
+
+static int32_t load_bytes(void*, uint32_t, uint32_t, uint8_t*);
+static int32_t write_bytes(void*, uint32_t, uint32_t, uint8_t*);
+static int32_t load_bytes_v(void*, const struct MemorySegment*, uint32_t);
+static int32_t map_memory(void*, uint8_t**, uint32_t*, uint32_t*);
+static int32_t clone_device(void*, uint32_t, struct Device*);
+static int32_t destroy(void*);
+
+// Fill in a device descriptor for image.
+static void describe(struct Device* dev, struct RomImage* image) {
+    *dev = (const struct Device){0};
+
+    dev->device = image;
+    dev->export_memory_size = image->memory_size;
+
+    dev->load_bytes = &load_bytes;
+    dev->write_bytes = &write_bytes;
+    dev->load_bytes_v = &load_bytes_v;
+    dev->map_memory = &map_memory;
+    // There's no state to reset or snapshot.
+    dev->clone = &clone_device;
+    dev->destroy = &destroy;
+
+    dev->device_type = rom_device_type_id;
+    dev->device_id = __atomic_fetch_add(&next_device_id, 1, __ATOMIC_RELAXED);
+}
+
+// Take a reference to the image of the file at path, mapping it if nothing else has.
+static struct RomImage* acquire(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0
+        || (uint64_t)st.st_size > UINT32_MAX) {
+        close(fd);
+        return 0;
+    }
+
+    pthread_mutex_lock(&images_lock);
+    struct RomImage* image = images;
+    while (image && (image->file_device != st.st_dev || image->file_inode != st.st_ino)) {
+        image = image->next;
+    }
+
+    if (image) {
+        ++image->references;
+    } else {
+        image = malloc(sizeof(struct RomImage));
+        uint8_t* mem = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (image && mem != MAP_FAILED) {
+            *image = (const struct RomImage){0};
+            image->file_device = st.st_dev;
+            image->file_inode = st.st_ino;
+            image->memory = mem;
+            image->memory_size = (uint32_t)st.st_size;
+            image->references = 1;
+            image->next = images;
+            images = image;
+        } else {
+            free(image);
+            image = 0;
+            if (mem != MAP_FAILED) {
+                munmap(mem, st.st_size);
+            }
+        }
+    }
+    pthread_mutex_unlock(&images_lock);
+
+    // The mapping keeps the file open.
+    close(fd);
+    return image;
+}
+
+struct Device* bscomp_device_new(const struct ROMConfig* config) {
+    if (!config || !config->path) {
+        return 0;
+    }
+
+    struct Device* dev = malloc(sizeof(struct Device));
+    struct RomImage* image = dev ? acquire(config->path) : 0;
+
+    if (!dev || !image) {
+        free(dev);
+        return 0;
+    }
+
+    describe(dev, image);
+
+    return dev;
+}
+
+void bscomp_device_destroy(struct Device* dev) {
+    if (!dev) {
+        return;
+    }
+
+    if (dev->device) {
+        destroy(dev->device);
+        dev->device = 0;
+    }
+
+    free(dev);
+}
+
+static int32_t load_bytes(void* romimage, uint32_t src, uint32_t len, uint8_t* dest) {
+    if (!romimage) {
+        return -1;
+    }
+
+    struct RomImage* image = romimage;
+
+    if (src >= image->memory_size) {
+        return 0;
+    }
+    if (len > image->memory_size - src) {
+        len = image->memory_size - src;
+    }
+    memcpy(dest, image->memory + src, len);
+
+    return 0;
+}
+
+// Writes are ignored.
+static int32_t write_bytes(void* romimage, uint32_t dest, uint32_t len, uint8_t* src) {
+    return romimage ? 0 : -1;
+}
+
+static int32_t load_bytes_v(void* romimage, const struct MemorySegment* segments,
+                            uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t result = load_bytes(romimage, segments[i].address, segments[i].length,
+                                    segments[i].buffer);
+        if (result) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+static int32_t map_memory(void* romimage, uint8_t** base, uint32_t* length, uint32_t* flags) {
+    if (!romimage) {
+        return -1;
+    }
+
+    struct RomImage* image = romimage;
+    *base = image->memory;
+    *length = image->memory_size;
+    *flags = bscomp_map_readable;
+
+    return 0;
+}
+
+// Copies are just more references to the same image.
+static int32_t clone_device(void* romimage, uint32_t count, struct Device* copies) {
+    if (!romimage || (count && !copies)) {
+        return -1;
+    }
+
+    struct RomImage* image = romimage;
+    pthread_mutex_lock(&images_lock);
+    image->references += count;
+    pthread_mutex_unlock(&images_lock);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        describe(&copies[i], image);
+    }
+    return 0;
+}
+
+// Drops a reference to the image, unmapping it if this was the last.
+static int32_t destroy(void* romimage) {
+    if (!romimage) {
+        return -1;
+    }
+
+    struct RomImage* image = romimage;
+    pthread_mutex_lock(&images_lock);
+    if (--image->references) {
+        pthread_mutex_unlock(&images_lock);
+        return 0;
+    }
+    struct RomImage** link = &images;
+    while (*link != image) {
+        link = &(*link)->next;
+    }
+    *link = image->next;
+    pthread_mutex_unlock(&images_lock);
+
+    munmap(image->memory, image->memory_size);
+    free(image);
+
+    return 0;
+}
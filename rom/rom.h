@@ -0,0 +1,23 @@
+#ifndef bscomp_rom_h
+#define bscomp_rom_h
+
+#include <stdint.h>
+
+#include "motherboard.h"
+
+static const uint64_t rom_device_type_id = (3l << 32) | 1l;
+
+struct ROMConfig {
+    // Image file to export, read-only. The file is mapped rather than read, and every ROM
+    // in the process made from the same file shares the one mapping, so many machines
+    // booting the same image cost one copy of it in the host's page cache. Replace the
+    // file rather than writing to it while ROMs made from it are around.
+    //
+    // The image must not be empty, and must be under 4 GiB.
+    const char* path;
+};
+
+struct Device* bscomp_device_new(const struct ROMConfig* config);
+void bscomp_device_destroy(struct Device* dev);
+
+#endif // bscomp_rom_h
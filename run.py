@@ -6,11 +6,14 @@ import time
 from computer import sodevice, rdmadevice
 
 def main():
-    ram_config = struct.pack('@I', 4 * (1<<10))
+    # Memory size, flat rather than sparse, and writes untracked.
+    ram_config = struct.pack('@III', 4 * (1<<10), 0, 0)
     ramdev = sodevice.SODevice('ram/libbridgesimram.so', ram_config)
     rdmadev = rdmadevice.RDMADevice('127.0.0.1', 8080)
 
-    cpu_config = struct.pack('@I', 32)
+    # Stack size, JIT mode (off), JIT threshold and interrupt vector size (defaults), an
+    # unclocked CPU, and interrupts not coalesced.
+    cpu_config = struct.pack('@IIIIIII', 32, 0, 0, 0, 0, 0, 0)
     cpudev = sodevice.SODevice('stack-cpu/libbridgesimstackcpu.so', cpu_config)
 
 
@@ -0,0 +1,330 @@
+// Microbenchmarks for the stack CPU. Run with `make bench`.
+//
+// Prints one JSON object per line: the cost of each opcode at each operand size, run
+// through its handler as the interpreter would, the cost of entering and leaving an
+// interrupt handler, and the latency of hardware interrupts from being sent to being taken.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "motherboard.h"
+}
+
+#include "stacker.h"
+#include "stackcpu.h"
+
+using namespace std;
+
+// Each measurement runs for at least this long, and the fastest of bench_repeats
+// measurements is reported.
+static const chrono::milliseconds bench_min_time(20);
+static const int bench_repeats = 3;
+
+// Round trips timed for the interrupt latency benchmarks.
+static const uint32_t interrupt_samples = 20000;
+
+// Guest memory, directly mapped as the RAM device would be.
+static const uint32_t bench_memory_size = 1 << 16;
+// Where memory operands point, and where the memory stack starts.
+static const uint64_t bench_data_address = 0x1000;
+static const uint64_t bench_stack_address = 0x8000;
+// Words on the internal stack when shift-all runs.
+static const uint32_t bench_shift_all_words = 8;
+
+static vector<uint8_t> memory(bench_memory_size);
+
+extern "C" {
+    static int32_t bench_read(void*, uint64_t addr, uint32_t len, uint8_t* buf) {
+        for (uint32_t i = 0; i < len; ++i) {
+            buf[i] = addr + i < memory.size() ? memory[addr + i] : 0;
+        }
+        return 0;
+    }
+
+    static int32_t bench_write(void*, uint64_t addr, uint32_t len, uint8_t* buf) {
+        for (uint32_t i = 0; i < len; ++i) {
+            if (addr + i < memory.size()) {
+                memory[addr + i] = buf[i];
+            }
+        }
+        return 0;
+    }
+
+    static int32_t bench_send_interrupt(void*, uint32_t, uint32_t) {
+        return 0;
+    }
+
+    static int32_t bench_map(void*, uint64_t addr, uint8_t** base, uint32_t* len,
+                             uint32_t* flags) {
+        if (addr >> 32) {
+            *base = 0;
+            *len = 0;
+            *flags = 0;
+        } else {
+            *base = memory.data();
+            *len = memory.size();
+            *flags = bscomp_map_readable | bscomp_map_writable;
+        }
+        return 0;
+    }
+}
+
+static const char* size_name(uint8_t size) {
+    static const char* names[] = {0, 0, "f32", "u8", "u16", "u32", "u64", "f64"};
+    return size < 8 ? names[size] : 0;
+}
+
+// Nanoseconds per call of op, from the fastest run.
+template<typename F>
+static double measure(F op) {
+    uint64_t iterations = 1;
+    double best = 0;
+    for (int repeat = 0; repeat < bench_repeats; ++repeat) {
+        while (true) {
+            auto start = chrono::steady_clock::now();
+            for (uint64_t i = 0; i < iterations; ++i) {
+                op();
+            }
+            chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+            if (elapsed >= bench_min_time) {
+                double ns = elapsed.count() / iterations;
+                if (!best || ns < best) {
+                    best = ns;
+                }
+                break;
+            }
+            iterations *= 2;
+        }
+    }
+    return best;
+}
+
+static Device* make_cpu(StackCPUConfig& config) {
+    Device* dev = bscomp_device_new(&config);
+    if (!dev) {
+        return 0;
+    }
+    MotherboardFunctions funcs = {};
+    funcs.read_bytes = &bench_read;
+    funcs.write_bytes = &bench_write;
+    funcs.send_interrupt = &bench_send_interrupt;
+    funcs.map_bytes = &bench_map;
+    dev->register_motherboard(dev->device, 0, &funcs);
+    dev->init(dev->device);
+    dev->reset(dev->device);
+    return dev;
+}
+
+// Runs one instruction over and over from the same state: enough words on the stack for
+// it to pop, with memory operands pointing at bench_data_address.
+static void bench_opcode(StackCPUDevice* cpu, uint8_t instr, uint8_t size) {
+    DecodedInstruction di = {};
+    di.instr = instr;
+    di.size = size;
+    di.handler = resolve_handler(instr, size);
+    uint64_t immediate = 0x0102030405060708ull;
+    memcpy(di.immediate, &immediate, sizeof(immediate));
+
+    uint32_t pops = 0, pushes = 0;
+    if (!stack_effect(di, pops, pushes)) {
+        pops = instr == 's' ? bench_shift_all_words : 0;
+    }
+
+    // Ones divide cleanly and make for valid jumps which aren't taken.
+    vector<uint32_t> image(pops, 1);
+    if ((instr == 'R' || instr == 'W') && pops >= 2) {
+        image[pops - 2] = uint32_t(bench_data_address);
+        image[pops - 1] = uint32_t(bench_data_address >> 32);
+    }
+    if (instr == 'J') {
+        image[0] = 0;
+    }
+    uint32_t unshift_count = bench_shift_all_words;
+    memcpy(&memory[bench_stack_address], &unshift_count, sizeof(unshift_count));
+
+    double ns = measure([&]() {
+        memcpy(cpu->stack, image.data(), pops * sizeof(uint32_t));
+        cpu->isp = pops;
+        cpu->sp = bench_stack_address;
+        di.handler(cpu, di);
+    });
+
+    char name[8];
+    if (instr >= 0x20 && instr < 0x7f && instr != '"' && instr != '\\') {
+        snprintf(name, sizeof(name), "%c", instr);
+    } else {
+        snprintf(name, sizeof(name), "0x%02x", instr);
+    }
+    printf("{\"suite\": \"stack-cpu\", \"bench\": \"opcode\", \"opcode\": \"%s\", ", name);
+    if (instr == 'z') {
+        printf("\"size\": \"%s->%s\", ", size_name(size & 7), size_name((size >> 3) & 7));
+    } else if (size_name(size) && instr != 'P' && instr != 'p') {
+        printf("\"size\": \"%s\", ", size_name(size));
+    } else {
+        printf("\"size\": %u, ", size);
+    }
+    printf("\"ns_per_op\": %.2f}\n", ns);
+    fflush(stdout);
+}
+
+static void bench_opcodes(StackCPUDevice* cpu) {
+    static const char sized[] = "+-*/&|^~_<>gl=!CDRrWSU$";
+    static const char unsized[] = "JIwsu";
+
+    bench_opcode(cpu, 0, 0);
+    for (const char* instr = sized; *instr; ++instr) {
+        for (uint8_t size = 2; size < 8; ++size) {
+            bench_opcode(cpu, *instr, size);
+        }
+    }
+    for (uint8_t from = 2; from < 8; ++from) {
+        for (uint8_t to = 2; to < 8; ++to) {
+            bench_opcode(cpu, 'z', from | (to << 3));
+        }
+    }
+    for (uint8_t reg : {0, 1, 2, 3, 4, 5, 7}) {
+        bench_opcode(cpu, 'P', reg);
+    }
+    for (const char* instr = unsized; *instr; ++instr) {
+        bench_opcode(cpu, *instr, 0);
+    }
+}
+
+// A software interrupt into a handler, and straight back out: the cost of entering and
+// leaving an interrupt, without queueing one.
+static void bench_interrupt_dispatch(StackCPUDevice* cpu) {
+    uint64_t handler = 0;
+    memcpy(&memory[bench_data_address], &handler, sizeof(handler));
+    cpu->interrupt_table = bench_data_address;
+    cpu->interrupt_count = 1;
+    cpu->interrupt_stack = bench_stack_address;
+    cpu->settings = 1 << 0;
+    cpu->isp = 0;
+
+    double ns = measure([&]() {
+        cpu->process_code(0);
+        cpu->return_from_interrupt();
+    });
+    cpu->interrupt_count = 0;
+
+    printf("{\"suite\": \"stack-cpu\", \"bench\": \"interrupt_dispatch\", "
+           "\"ns_per_op\": %.2f}\n", ns);
+    fflush(stdout);
+}
+
+// Percentile of sorted samples.
+static double percentile(const vector<double>& sorted, double p) {
+    return sorted[min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+static void print_latency(const char* bench, vector<double>& samples) {
+    sort(samples.begin(), samples.end());
+    double total = 0;
+    for (auto sample : samples) {
+        total += sample;
+    }
+    printf("{\"suite\": \"stack-cpu\", \"bench\": \"%s\", \"samples\": %zu, "
+           "\"mean_ns\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"max_ns\": %.0f}\n",
+           bench, samples.size(), total / samples.size(), percentile(samples, 0.5),
+           percentile(samples, 0.99), samples.back());
+    fflush(stdout);
+}
+
+// Guest code which waits for an interrupt, forever: w, then a jump back to 0.
+static void load_wait_loop() {
+    uint8_t code[] = {
+        'w', 0,
+        'r', 5, 1, 0, 0, 0,
+        'r', 6, 0, 0, 0, 0, 0, 0, 0, 0,
+        'J', 0,
+    };
+    memcpy(memory.data(), code, sizeof(code));
+}
+
+// An interrupt sent to a stepped CPU, then taken by its next step, on one thread.
+static void bench_stepped_interrupts(Device* dev) {
+    StackCPUDevice* cpu = static_cast<StackCPUDevice*>(dev->device);
+    cpu->ip = 0;
+    cpu->settings = 1 << 0;
+
+    vector<double> samples;
+    samples.reserve(interrupt_samples);
+    for (uint32_t i = 0; i < interrupt_samples; ++i) {
+        auto start = chrono::steady_clock::now();
+        dev->interrupt(cpu, i);
+        dev->step(cpu, 1);
+        samples.push_back(chrono::duration<double, nano>(
+            chrono::steady_clock::now() - start).count());
+    }
+    print_latency("interrupt_stepped", samples);
+}
+
+// An interrupt sent to a booted CPU parked in the wait instruction, until the CPU has
+// taken it and parked again. The CPU's own count of time from send to running follows.
+static void bench_parked_interrupts(Device* dev) {
+    StackCPUDevice* cpu = static_cast<StackCPUDevice*>(dev->device);
+    cpu->ip = 0;
+    cpu->settings = 1 << 0;
+    thread runner([dev]() { dev->boot(dev->device); });
+
+    StackCPUIdleStats before = {}, after = {};
+    bscomp_stackcpu_idle_stats(dev, &before);
+    vector<double> samples;
+    samples.reserve(interrupt_samples);
+    for (uint32_t i = 0; i < interrupt_samples; ++i) {
+        while (!cpu->parked.load(memory_order_seq_cst)) {
+            this_thread::yield();
+        }
+        uint64_t taken = cpu->published_counters[1].load(memory_order_relaxed);
+
+        auto start = chrono::steady_clock::now();
+        dev->interrupt(cpu, i);
+        while (cpu->published_counters[1].load(memory_order_relaxed) == taken) {
+            this_thread::yield();
+        }
+        samples.push_back(chrono::duration<double, nano>(
+            chrono::steady_clock::now() - start).count());
+    }
+    bscomp_stackcpu_idle_stats(dev, &after);
+    dev->halt(dev->device);
+    runner.join();
+
+    print_latency("interrupt_parked_round_trip", samples);
+    uint64_t wakeups = after.wakeups - before.wakeups;
+    printf("{\"suite\": \"stack-cpu\", \"bench\": \"interrupt_parked_wake\", \"samples\": %llu, "
+           "\"mean_ns\": %.0f, \"max_ns\": %llu}\n",
+           (unsigned long long)wakeups,
+           wakeups ? double(after.wake_latency_nanoseconds - before.wake_latency_nanoseconds)
+               / wakeups : 0.0,
+           (unsigned long long)after.max_wake_latency_nanoseconds);
+    fflush(stdout);
+}
+
+int main() {
+    StackCPUConfig config = {};
+    config.stack_size = 1024;
+    config.interrupt_vector_size = 64;
+    Device* dev = make_cpu(config);
+    if (!dev) {
+        fprintf(stderr, "Could not create a stack CPU\n");
+        return 1;
+    }
+
+    bench_opcodes(static_cast<StackCPUDevice*>(dev->device));
+    bench_interrupt_dispatch(static_cast<StackCPUDevice*>(dev->device));
+
+    load_wait_loop();
+    dev->reset(dev->device);
+    bench_stepped_interrupts(dev);
+    dev->reset(dev->device);
+    bench_parked_interrupts(dev);
+
+    bscomp_device_destroy(dev);
+    return 0;
+}
@@ -0,0 +1,690 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "stackcpu.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define BSCOMP_JIT_X86_64
+#endif
+
+using namespace std;
+
+// Address space reserved for each CPU's code. Only the pages actually used take memory.
+static const size_t jit_arena_size = 1 << 20;
+
+#ifdef BSCOMP_JIT_X86_64
+
+namespace {
+
+enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Condition codes for setcc and jcc.
+enum Cond {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7
+};
+
+// ALU opcodes taking (r/m, reg).
+enum AluOp {
+    ALU_ADD = 0x01,
+    ALU_OR = 0x09,
+    ALU_AND = 0x21,
+    ALU_SUB = 0x29,
+    ALU_XOR = 0x31,
+    ALU_CMP = 0x39
+};
+
+// [base + index * 2^scale + disp], with no index if index is negative.
+struct Mem {
+    int base;
+    int index;
+    int scale;
+    int32_t disp;
+};
+
+// Just enough of an x86-64 assembler for the code below. Memory operands are always
+// encoded with a 32 bit displacement.
+struct Emitter {
+    vector<uint8_t> code;
+
+    void byte(uint8_t b) {
+        code.push_back(b);
+    }
+
+    void dword(uint32_t v) {
+        for (int i = 0; i < 4; ++i) {
+            byte(v >> (8 * i));
+        }
+    }
+
+    void qword(uint64_t v) {
+        dword(v);
+        dword(v >> 32);
+    }
+
+    // Opcodes above 0xFF are two byte 0x0F opcodes.
+    void opcode(uint32_t op) {
+        if (op > 0xFF) {
+            byte(op >> 8);
+        }
+        byte(op);
+    }
+
+    // force is needed to reach the low byte of rsi, rdi, rbp and rsp.
+    void rex(bool wide, int reg, int index, int base, bool force = false) {
+        uint8_t prefix = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2)
+            | ((base & 8) >> 3);
+        if (prefix != 0x40 || force) {
+            byte(prefix);
+        }
+    }
+
+    void op_rr(uint32_t op, bool wide, int reg, int rm, bool byte_regs = false) {
+        rex(wide, reg, 0, rm, byte_regs);
+        opcode(op);
+        byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    void op_rm(uint32_t op, bool wide, int reg, const Mem& m) {
+        rex(wide, reg, m.index < 0 ? 0 : m.index, m.base);
+        opcode(op);
+        if (m.index < 0 && (m.base & 7) != RSP) {
+            byte(0x80 | (reg & 7) << 3 | (m.base & 7));
+        } else {
+            int index = m.index < 0 ? RSP : m.index;
+            byte(0x80 | (reg & 7) << 3 | RSP);
+            byte(m.scale << 6 | (index & 7) << 3 | (m.base & 7));
+        }
+        dword(m.disp);
+    }
+
+    void load(int reg, const Mem& m, bool wide) {
+        op_rm(0x8B, wide, reg, m);
+    }
+
+    void store(const Mem& m, int reg, bool wide) {
+        op_rm(0x89, wide, reg, m);
+    }
+
+    void lea(int reg, const Mem& m) {
+        op_rm(0x8D, false, reg, m);
+    }
+
+    void mov(int dest, int src, bool wide) {
+        op_rr(0x89, wide, src, dest);
+    }
+
+    void mov_imm(int reg, uint64_t value) {
+        bool wide = value > 0xFFFFFFFFull;
+        rex(wide, 0, 0, reg);
+        byte(0xB8 + (reg & 7));
+        if (wide) {
+            qword(value);
+        } else {
+            dword(value);
+        }
+    }
+
+    void alu(AluOp op, int dest, int src, bool wide) {
+        op_rr(op, wide, src, dest);
+    }
+
+    void imul(int dest, int src, bool wide) {
+        op_rr(0x0FAF, wide, dest, src);
+    }
+
+    void not_(int reg, bool wide) {
+        op_rr(0xF7, wide, 2, reg);
+    }
+
+    void neg(int reg, bool wide) {
+        op_rr(0xF7, wide, 3, reg);
+    }
+
+    // reg = condition ? 1 : 0, as 32 bits.
+    void setcc(Cond cond, int reg) {
+        op_rr(0x0F90 | cond, false, 0, reg, true);
+        op_rr(0x0FB6, false, reg, reg, true);
+    }
+
+    void push(int reg) {
+        rex(false, 0, 0, reg);
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(int reg) {
+        rex(false, 0, 0, reg);
+        byte(0x58 + (reg & 7));
+    }
+
+    void call(uint64_t target) {
+        mov_imm(RAX, target);
+        byte(0xFF);
+        byte(0xD0);
+    }
+
+    // Returns the position of the rel32 to patch.
+    size_t jcc(Cond cond) {
+        byte(0x0F);
+        byte(0x80 | cond);
+        dword(0);
+        return code.size() - 4;
+    }
+
+    void patch(const vector<size_t>& fixups) {
+        for (auto at : fixups) {
+            uint32_t rel = code.size() - (at + 4);
+            memcpy(&code[at], &rel, sizeof(rel));
+        }
+    }
+};
+
+// A live guest value cached in a host register.
+struct CachedValue {
+    int reg;
+    uint32_t words;
+};
+
+// A value pushed by compiled code which hasn't been written to the guest stack yet. The
+// interpreter leaves popped values in the stack memory above isp, and narrow pushes only
+// overwrite part of a slot, so every pushed value has to land in memory eventually unless
+// a later push covers it completely.
+struct PendingStore {
+    int32_t slot;
+    int reg;
+    uint32_t words;
+};
+
+// Registers free to hold guest values. Everything is written back to the guest stack
+// before any call, so caller-saved registers are fine.
+static const int cache_registers[] = {
+    RCX, RDX, RSI, RDI, R8, R9, R10, R11, R14, R15
+};
+
+// Compiles one basic block. While the code runs, rbx holds the CPU, r12 the guest stack
+// and r13 the isp the block was entered with; slots are numbered relative to r13.
+//
+// The top of the guest stack lives in `cached`, bottom first, starting at slot `depth`.
+// cpu->isp and cpu->ip are only brought up to date before falling back to a handler and
+// at the end of the block.
+struct BlockCompiler {
+    Emitter e;
+    const BasicBlock& block;
+    int32_t isp_offset;
+    int32_t ip_offset;
+    int32_t stack_offset;
+
+    vector<CachedValue> cached;
+    vector<PendingStore> pending;
+    // Registers popped by the instruction being compiled and not yet pushed or released.
+    vector<int> held;
+    int32_t depth;
+
+    // Exits returning eax, and returning 0.
+    vector<size_t> exit_fixups;
+    vector<size_t> exit_ok_fixups;
+
+    BlockCompiler(StackCPUDevice* cpu, const BasicBlock& block) : block(block), depth(0) {
+        const char* base = reinterpret_cast<const char*>(cpu);
+        isp_offset = reinterpret_cast<const char*>(&cpu->isp) - base;
+        ip_offset = reinterpret_cast<const char*>(&cpu->ip) - base;
+        stack_offset = reinterpret_cast<const char*>(&cpu->stack) - base;
+    }
+
+    Mem slot(int32_t at) {
+        return Mem{R12, R13, 2, at * 4};
+    }
+
+    Mem field(int32_t offset) {
+        return Mem{RBX, -1, 0, offset};
+    }
+
+    int32_t top() {
+        int32_t at = depth;
+        for (const auto& value : cached) {
+            at += value.words;
+        }
+        return at;
+    }
+
+    bool live(int reg) {
+        for (const auto& value : cached) {
+            if (value.reg == reg) {
+                return true;
+            }
+        }
+        return find(held.begin(), held.end(), reg) != held.end();
+    }
+
+    bool in_use(int reg) {
+        for (const auto& store : pending) {
+            if (store.reg == reg) {
+                return true;
+            }
+        }
+        return live(reg);
+    }
+
+    void emit_store(size_t i) {
+        e.store(slot(pending[i].slot), pending[i].reg, pending[i].words == 2);
+        pending.erase(pending.begin() + i);
+    }
+
+    void emit_stores() {
+        while (!pending.empty()) {
+            emit_store(0);
+        }
+    }
+
+    int allocate() {
+        while (true) {
+            for (int reg : cache_registers) {
+                if (!in_use(reg)) {
+                    held.push_back(reg);
+                    return reg;
+                }
+            }
+            // Write back a dead value if there is one, otherwise the deepest live value.
+            bool freed = false;
+            for (size_t i = 0; i < pending.size(); ++i) {
+                if (!live(pending[i].reg)) {
+                    emit_store(i);
+                    freed = true;
+                    break;
+                }
+            }
+            if (freed) {
+                continue;
+            }
+            auto spilled = cached.front();
+            for (size_t i = 0; i < pending.size(); ++i) {
+                if (pending[i].reg == spilled.reg) {
+                    emit_store(i);
+                    break;
+                }
+            }
+            cached.erase(cached.begin());
+            depth += spilled.words;
+        }
+    }
+
+    void release(int reg) {
+        held.erase(find(held.begin(), held.end(), reg));
+    }
+
+    // Write everything to the guest stack and forget what's in registers.
+    void flush() {
+        emit_stores();
+        depth = top();
+        cached.clear();
+    }
+
+    int pop(uint32_t words) {
+        if (!cached.empty() && cached.back().words == words) {
+            int reg = cached.back().reg;
+            cached.pop_back();
+            held.push_back(reg);
+            return reg;
+        }
+        // Cached as a value of another width.
+        if (!cached.empty()) {
+            flush();
+        }
+        // Nothing pending is below the top of the stack unless it's cached, so memory is
+        // up to date here.
+        int reg = allocate();
+        depth -= words;
+        e.load(reg, slot(depth), words == 2);
+        return reg;
+    }
+
+    // Make way for a push of `words` at the top of the stack. Must come before a popped
+    // register is modified to make the pushed value, in case that register still has to
+    // be written somewhere.
+    void prepare_push(uint32_t words) {
+        int32_t start = top();
+        int32_t end = start + words;
+        for (size_t i = 0; i < pending.size();) {
+            int32_t store_start = pending[i].slot;
+            int32_t store_end = store_start + pending[i].words;
+            bool overlaps = store_start < end && start < store_end;
+            bool covered = start <= store_start && store_end <= end;
+            if (covered) {
+                pending.erase(pending.begin() + i);
+            } else if (overlaps) {
+                emit_store(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    // About to modify reg in place.
+    void detach(int reg) {
+        for (size_t i = 0; i < pending.size();) {
+            if (pending[i].reg == reg) {
+                emit_store(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    void push(int reg, uint32_t words) {
+        prepare_push(words);
+        pending.push_back(PendingStore{top(), reg, words});
+        cached.push_back(CachedValue{reg, words});
+        release(reg);
+    }
+
+    void discard(uint32_t words) {
+        if (!cached.empty() && cached.back().words == words) {
+            // Still pending if it was, like any other popped value.
+            cached.pop_back();
+            return;
+        }
+        if (!cached.empty()) {
+            flush();
+        }
+        depth -= words;
+    }
+
+    // Write back everything the interpreter can see.
+    void sync(uint64_t ip) {
+        flush();
+        e.lea(RAX, Mem{R13, -1, 0, depth});
+        e.store(field(isp_offset), RAX, false);
+        e.mov_imm(RAX, ip);
+        e.store(field(ip_offset), RAX, true);
+    }
+
+    // Operand width of integer arithmetic, in words.
+    static uint32_t integer_words(uint8_t size) {
+        return size == 5 ? 1 : size == 6 ? 2 : 0;
+    }
+
+    // Operand width of bitwise operations and stack shuffles, which treat floats as
+    // integers of the same width.
+    static uint32_t bitwise_words(uint8_t size) {
+        return size == 2 || size == 5 ? 1 : size == 6 || size == 7 ? 2 : 0;
+    }
+
+    // b = a OP b, where a was on top. The result goes where b was, so b's register is
+    // reused.
+    void binary(uint8_t instr, uint32_t words) {
+        bool wide = words == 2;
+        int a = pop(words);
+        int b = pop(words);
+        prepare_push(words);
+        detach(b);
+        switch (instr) {
+        case '+': e.alu(ALU_ADD, b, a, wide); break;
+        case '-': e.neg(b, wide); e.alu(ALU_ADD, b, a, wide); break;
+        case '*': e.imul(b, a, wide); break;
+        case '&': e.alu(ALU_AND, b, a, wide); break;
+        case '|': e.alu(ALU_OR, b, a, wide); break;
+        case '^': e.alu(ALU_XOR, b, a, wide); break;
+        }
+        release(a);
+        push(b, words);
+    }
+
+    void compare(Cond cond, uint32_t words) {
+        int a = pop(words);
+        int b = pop(words);
+        prepare_push(1);
+        detach(b);
+        e.alu(ALU_CMP, a, b, words == 2);
+        e.setcc(cond, b);
+        release(a);
+        push(b, 1);
+    }
+
+    // Emits native code for the instruction if there is a native version of it.
+    bool native(const DecodedInstruction& di) {
+        uint32_t words = 0;
+        switch (di.instr) {
+        case 0:
+            return true;
+        case 'r':
+            if (!(words = bitwise_words(di.size))) {
+                return false;
+            }
+            {
+                uint64_t value = 0;
+                memcpy(&value, di.immediate, words * 4);
+                int reg = allocate();
+                e.mov_imm(reg, value);
+                push(reg, words);
+            }
+            return true;
+        case '+':
+        case '-':
+        case '*':
+            if (!(words = integer_words(di.size))) {
+                return false;
+            }
+            binary(di.instr, words);
+            return true;
+        case '&':
+        case '|':
+        case '^':
+            if (!(words = bitwise_words(di.size))) {
+                return false;
+            }
+            binary(di.instr, words);
+            return true;
+        case '~':
+        case '_':
+            words = di.instr == '~' ? bitwise_words(di.size) : integer_words(di.size);
+            if (!words) {
+                return false;
+            }
+            {
+                int a = pop(words);
+                prepare_push(words);
+                detach(a);
+                if (di.instr == '~') {
+                    e.not_(a, words == 2);
+                } else {
+                    e.neg(a, words == 2);
+                }
+                push(a, words);
+            }
+            return true;
+        case '<':
+        case '>':
+        case 'l':
+        case 'g':
+        case '=':
+        case '!':
+            if (!(words = integer_words(di.size))) {
+                return false;
+            }
+            switch (di.instr) {
+            case '<': compare(CC_B, words); break;
+            case '>': compare(CC_A, words); break;
+            case 'l': compare(CC_BE, words); break;
+            case 'g': compare(CC_AE, words); break;
+            case '=': compare(CC_E, words); break;
+            case '!': compare(CC_NE, words); break;
+            }
+            return true;
+        case 'C':
+            if (!(words = bitwise_words(di.size))) {
+                return false;
+            }
+            {
+                int a = pop(words);
+                push(a, words);
+                int b = allocate();
+                e.mov(b, a, words == 2);
+                push(b, words);
+            }
+            return true;
+        case 'D':
+            if (!(words = bitwise_words(di.size))) {
+                return false;
+            }
+            discard(words);
+            return true;
+        case '$':
+            if (!(words = bitwise_words(di.size))) {
+                return false;
+            }
+            {
+                int a = pop(words);
+                int b = pop(words);
+                push(a, words);
+                push(b, words);
+            }
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Run the instruction's handler, as the interpreter would.
+    void fall_back(const DecodedInstruction& di, uint64_t next_ip) {
+        uint32_t pops = 0, pushes = 0;
+        stack_effect(di, pops, pushes);
+        sync(next_ip);
+        e.mov(RDI, RBX, true);
+        e.mov_imm(RSI, reinterpret_cast<uint64_t>(&di));
+        e.call(reinterpret_cast<uint64_t>(di.handler));
+        // test eax, eax
+        e.byte(0x85);
+        e.byte(0xC0);
+        exit_fixups.push_back(e.jcc(CC_NE));
+        // The handler may have written over this block.
+        e.mov_imm(RAX, reinterpret_cast<uint64_t>(&block.valid));
+        // cmp byte [rax], 0
+        e.byte(0x80);
+        e.byte(0x38);
+        e.byte(0x00);
+        exit_ok_fixups.push_back(e.jcc(CC_E));
+        // Only the last instruction of a block can have an effect not known here, and
+        // nothing is compiled after it.
+        depth += int32_t(pushes) - int32_t(pops);
+    }
+
+    void compile() {
+        e.push(RBX);
+        e.push(R12);
+        e.push(R13);
+        e.push(R14);
+        e.push(R15);
+        e.mov(RBX, RDI, true);
+        e.load(R12, field(stack_offset), true);
+        e.load(R13, field(isp_offset), false);
+
+        uint64_t ip = block.start;
+        bool synced = true;
+        for (const auto& di : block.instructions) {
+            ip += di.length;
+            if (native(di)) {
+                synced = false;
+            } else {
+                fall_back(di, ip);
+                synced = true;
+            }
+        }
+        if (!synced) {
+            sync(ip);
+        }
+
+        e.patch(exit_ok_fixups);
+        // xor eax, eax
+        e.byte(0x31);
+        e.byte(0xC0);
+        e.patch(exit_fixups);
+        e.pop(R15);
+        e.pop(R14);
+        e.pop(R13);
+        e.pop(R12);
+        e.pop(RBX);
+        e.byte(0xC3);
+    }
+};
+
+} // end of anonymous namespace
+
+int32_t JitArena::init() {
+    used = 0;
+    size = jit_arena_size;
+    void* mapping = mmap(0, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        code = 0;
+        size = 0;
+        return -1;
+    }
+    code = static_cast<uint8_t*>(mapping);
+    return 0;
+}
+
+void JitArena::cleanup() {
+    if (code) {
+        munmap(code, size);
+        code = 0;
+    }
+    size = 0;
+    used = 0;
+}
+
+void JitArena::clear() {
+    used = 0;
+}
+
+NativeBlock JitArena::compile(StackCPUDevice* cpu, const BasicBlock& block) {
+    if (!code) {
+        return 0;
+    }
+    BlockCompiler compiler(cpu, block);
+    compiler.compile();
+    const auto& native = compiler.e.code;
+    if (native.size() > size - used) {
+        return 0;
+    }
+
+    // Never writable and executable at once.
+    if (mprotect(code, size, PROT_READ | PROT_WRITE)) {
+        return 0;
+    }
+    uint8_t* entry = code + used;
+    memcpy(entry, native.data(), native.size());
+    mprotect(code, size, PROT_READ | PROT_EXEC);
+    used += (native.size() + 15) & ~size_t(15);
+    return reinterpret_cast<NativeBlock>(entry);
+}
+
+#else // !BSCOMP_JIT_X86_64
+
+int32_t JitArena::init() {
+    code = 0;
+    size = 0;
+    used = 0;
+    return -1;
+}
+
+void JitArena::cleanup() {
+}
+
+void JitArena::clear() {
+}
+
+NativeBlock JitArena::compile(StackCPUDevice*, const BasicBlock&) {
+    return 0;
+}
+
+#endif // BSCOMP_JIT_X86_64
@@ -0,0 +1,36 @@
+#ifndef bscomp_jit_h
+#define bscomp_jit_h
+// Native code tier for hot basic blocks. Only available on x86-64; elsewhere nothing
+// compiles and every block stays in the interpreter.
+
+#include <cstddef>
+#include <cstdint>
+
+struct StackCPUDevice;
+struct BasicBlock;
+
+// Compiled code for one basic block. Has the same effect on the CPU as interpreting the
+// block, and returns a simulator error code the same way a handler does.
+//
+// Only valid to call when the stack holds at least block.stack_needed words and has room
+// for block.stack_growth more; compiled code does not check for underflow or overflow.
+typedef int32_t (*NativeBlock)(StackCPUDevice*);
+
+// Executable memory for one CPU's compiled blocks. Filled front to back and emptied all
+// at once.
+struct JitArena {
+    uint8_t* code;
+    size_t size;
+    size_t used;
+
+    // Returns nonzero if there is no JIT for this host or the memory can't be mapped.
+    int32_t init();
+    void cleanup();
+    // Forget all compiled code. Callers must drop every NativeBlock first.
+    void clear();
+
+    // Returns null if the arena is full.
+    NativeBlock compile(StackCPUDevice* cpu, const BasicBlock& block);
+};
+
+#endif // bscomp_jit_h
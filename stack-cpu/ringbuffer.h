@@ -0,0 +1,101 @@
+#ifndef bscomp_ringbuffer_h
+#define bscomp_ringbuffer_h
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+using namespace std;
+
+// Bounded lock-free queue for any number of producers and a single consumer.
+//
+// Each cell carries a sequence number saying whose turn it is: a producer may fill the
+// cell at position pos once its sequence is pos, and the consumer may empty it once its
+// sequence is pos + 1. Producers claim positions with a CAS on tail; the consumer owns
+// head outright.
+template<typename T>
+class RingBuffer {
+public:
+    RingBuffer() : mask(0), tail(0), padding(), head(0) {}
+
+    // Capacity is rounded up to a power of two. Not thread safe.
+    int32_t init(uint32_t capacity) {
+        uint64_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        try {
+            cells.reset(new Cell[size]);
+        } catch (const bad_alloc& ex) {
+            return -1;
+        }
+        mask = size - 1;
+        for (uint64_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+        tail.store(0, memory_order_relaxed);
+        head = 0;
+        return 0;
+    }
+
+    // Returns false, leaving the queue untouched, if it is full.
+    bool push(const T& value) {
+        uint64_t pos = tail.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            uint64_t sequence = cell->sequence.load(memory_order_acquire);
+            int64_t diff = int64_t(sequence - pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The consumer hasn't emptied this cell from the last time around.
+                return false;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the queue is empty.
+    bool pop(T& value) {
+        Cell& cell = cells[head & mask];
+        uint64_t sequence = cell.sequence.load(memory_order_acquire);
+        if (int64_t(sequence - (head + 1)) < 0) {
+            return false;
+        }
+        value = cell.value;
+        cell.sequence.store(head + mask + 1, memory_order_release);
+        ++head;
+        return true;
+    }
+
+    // Consumer only.
+    void clear() {
+        T value;
+        while (pop(value)) {
+        }
+    }
+
+private:
+    struct Cell {
+        atomic<uint64_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    uint64_t mask;
+    atomic<uint64_t> tail;
+    // Keep producers off the consumer's cache line. Padding rather than alignas, since
+    // the owner is allocated with plain new.
+    char padding[64];
+    uint64_t head;
+};
+
+#endif // bscomp_ringbuffer_h
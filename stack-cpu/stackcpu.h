@@ -0,0 +1,416 @@
+#ifndef bscomp_stackcpu_h
+#define bscomp_stackcpu_h
+// Internal to the stack CPU; shared between the interpreter and the JIT.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+extern "C" {
+#include "motherboard.h"
+}
+
+#include "stacker.h"
+#include "jit.h"
+#include "ringbuffer.h"
+#include "trace.h"
+
+using namespace std;
+
+// Code is tracked for invalidation in pages of 2^code_page_bits bytes. Basic blocks never
+// start an instruction past the end of the page they begin in.
+static const uint32_t code_page_bits = 8;
+static const uint64_t code_page_size = 1ull << code_page_bits;
+static const uint32_t block_cache_size = 256;
+static const uint32_t max_block_length = 32;
+// Opcode, size and the largest possible immediate.
+static const uint32_t max_instruction_length = 2 + 8;
+
+// Executions of a block before it is compiled, unless the config says otherwise.
+static const uint32_t default_jit_threshold = 64;
+
+// Pending hardware interrupts held, unless the config says otherwise.
+static const uint32_t default_interrupt_vector_size = 64;
+
+// How far a clocked CPU may fall behind its schedule, e.g. while the host is overloaded,
+// before it gives up on catching up. Anything past this is forgiven rather than run
+// flat out.
+static const chrono::milliseconds max_clock_lag(100);
+// Longest a clocked CPU sleeps before looking for a halt.
+static const chrono::milliseconds max_clock_sleep(10);
+
+// Simulator error returned when differential mode finds the tiers disagree.
+static const int32_t jit_mismatch_error = -100;
+
+// Windows of memory with a cached direct mapping.
+static const uint32_t memory_window_cache_size = 4;
+
+// Instructions a booted CPU runs between publishing its counters. Stepped CPUs publish
+// them after every step.
+static const uint64_t counter_publish_interval = 1 << 20;
+
+struct StackCPUDevice;
+struct DecodedInstruction;
+
+// Implementation of one opcode at one operand size.
+typedef int32_t (*Handler)(StackCPUDevice*, const DecodedInstruction&);
+
+// What a handler which keeps the top of the stack in a register hands on to the next.
+struct CachedResult {
+    int32_t result;
+    // Bytes of the top value in top, or 0 if it's in the stack array.
+    uint32_t bytes;
+    uint64_t top;
+};
+
+// The same again, given the top of the stack left by the previous instruction.
+typedef CachedResult (*CachedHandler)(StackCPUDevice*, const DecodedInstruction&, uint64_t top);
+
+// A guest instruction, decoded once when its block is first executed.
+struct DecodedInstruction {
+    Handler handler;
+    // The same without stack checks, for blocks entered with room for everything they do.
+    Handler unchecked;
+    // The same again, with as much of the top of the stack cached as the instructions
+    // before it in the block leave there.
+    CachedHandler cached;
+    // Superinstruction running this instruction and the next one together, cached, or
+    // null. Used in place of both cached handlers.
+    CachedHandler fused;
+    uint8_t instr;
+    uint8_t size;
+    // Encoded length of the instruction, including any immediate.
+    uint8_t length;
+    uint8_t immediate[8];
+};
+
+// A straight-line run of decoded instructions starting at `start`. A block ends at any
+// instruction which may transfer control, or at the end of its code page.
+struct BasicBlock {
+    bool valid;
+    uint64_t start;
+    // Range of code pages touched by the encoded instructions, inclusive.
+    uint64_t first_page;
+    uint64_t last_page;
+    vector<DecodedInstruction> instructions;
+
+    // Words the block may pop below, and push above, the stack depth it is entered at.
+    // Covers every instruction but a final one whose stack effect is only known at run
+    // time. Entering with at least stack_needed words and room for stack_growth more
+    // means none of those instructions can underflow or overflow.
+    uint32_t stack_needed;
+    uint32_t stack_growth;
+
+    // Times the interpreter has run the block since it was decoded, and the block's
+    // compiled code, if it has any.
+    uint32_t executions;
+    NativeBlock native;
+
+    // Times the block has run, in either tier, since its opcodes were last counted.
+    uint64_t runs;
+};
+
+// What the motherboard said about directly mapping one 2^32 byte window of memory.
+struct MemoryWindow {
+    bool resolved;
+    uint64_t window;
+    // Start of the window, or null if it isn't mapped.
+    uint8_t* base;
+    uint32_t length;
+    uint32_t flags;
+};
+
+// What taking an interrupt pushes on the interrupt stack, for the return from interrupt
+// to put back.
+struct InterruptFrame {
+    uint64_t ip;
+    uint32_t isp;
+    uint32_t spilled;
+    uint32_t settings;
+    uint32_t code;
+};
+
+// Registers and flags saved in a snapshot, ahead of the stack and waiting interrupts.
+// Bump the version whenever this changes.
+static const uint32_t saved_cpu_version = 3;
+
+struct SavedCPU {
+    uint32_t version;
+    uint32_t stack_size;
+    uint32_t isp;
+    uint32_t settings;
+    uint32_t errors;
+    uint32_t interrupt_count;
+    uint64_t ip;
+    uint64_t sp;
+    uint64_t interrupt_stack;
+    uint64_t interrupt_table;
+    uint64_t interrupt_mask;
+    uint64_t instructions;
+    uint32_t idle;
+    uint32_t interrupts_waiting;
+    uint32_t spilled;
+};
+
+struct StackCPUDevice {
+    // As created, for making clones.
+    StackCPUConfig config;
+
+    uint32_t stack_size;
+    // Internal stack pointer
+    uint32_t isp;
+    uint32_t* stack;
+    // Instruction pointer
+    uint64_t ip;
+    // Stack pointer
+    uint64_t sp;
+    // Words of the internal stack the stack cache has spilled to memory at sp.
+    uint32_t spilled;
+
+    uint64_t interrupt_stack;
+    uint64_t interrupt_table;
+    uint32_t interrupt_count;
+    // Interrupt lines which aren't taken while set. They stay pending until unmasked.
+    uint64_t interrupt_mask;
+
+    // Bitvector.
+    // 0: Interrupt Enable
+    // 1: Protect
+    // 2: Stack Cache
+    uint32_t settings;
+
+    // Bitvector.
+    // 0: Invalid Command
+    // 1: Invalid Command Argument
+    // 2: Stack Underflow
+    // 3: Stack Overflow
+    // 4: Protected Operation
+    // 5: Interrupt Overflow
+    uint32_t errors;
+
+    // Hardware interrupts on lines: a bit for each line with any waiting, and how many
+    // are, unless they're coalesced. Any thread may add to them; only the CPU takes them
+    // off.
+    atomic<uint64_t> pending_lines;
+    atomic<uint32_t> line_counts[stack_cpu_interrupt_lines];
+    uint32_t line_capacity;
+    bool coalesce_interrupts;
+    // Hardware interrupts with codes past the lines. Any thread may add to it; only the
+    // CPU takes them off.
+    RingBuffer<uint32_t> interrupts;
+    // Set whenever an interrupt arrives or is dropped, so the CPU only needs to look at
+    // the ring when there may be something there.
+    atomic<bool> interrupt_pending;
+    // Interrupts dropped because the vector was full, and how many of those the CPU has
+    // seen and reported in its errors.
+    atomic<uint64_t> interrupts_dropped;
+    uint64_t interrupts_reported;
+
+    atomic<bool> running;
+
+    // Set by the wait instruction; the CPU parks once the block finishes.
+    bool idle;
+    // Whether the CPU has started running since its last reset.
+    bool started;
+    // The CPU sleeps on wake while parked. Senders only need the lock, and only notify,
+    // if parked is set.
+    atomic<bool> parked;
+    mutex park_lock;
+    condition_variable wake;
+    // Steady clock time, in nanoseconds, at which the first sender saw the CPU parked,
+    // or 0.
+    atomic<int64_t> wake_requested;
+    // Written by the CPU thread only.
+    atomic<uint64_t> idle_waits;
+    atomic<uint64_t> idle_nanoseconds;
+    atomic<uint64_t> idle_wakeups;
+    atomic<uint64_t> wake_latency_nanoseconds;
+    atomic<uint64_t> max_wake_latency_nanoseconds;
+
+    void* motherboard;
+    MotherboardFunctions mbfuncs;
+    // Only valid while booted.
+    MemoryWindow memory_windows[memory_window_cache_size];
+    // Scratch space for the segments of a vectored access which can't be mapped.
+    vector<MemorySegment> memory_segments;
+
+    // Direct mapped cache of decoded blocks, indexed by a hash of the block start.
+    vector<BasicBlock> block_cache;
+    // Pages with at least one cached block on them, and a cheap filter over the same set
+    // so writes to data pages don't need a hash lookup.
+    unordered_set<uint64_t> code_pages;
+    uint64_t code_page_filter;
+
+    // One of the stack_cpu_jit_* modes.
+    uint32_t jit_mode;
+    uint32_t jit_threshold;
+    JitArena jit;
+
+    // Instructions run since the last reset, counting each hardware interrupt as one.
+    uint64_t instructions;
+    // 0 if unclocked.
+    uint32_t instructions_per_second;
+    uint32_t clock_quantum;
+    // Where the clock schedule was last anchored: the time at which the CPU had run
+    // clock_base_instructions.
+    chrono::steady_clock::time_point clock_base;
+    uint64_t clock_base_instructions;
+
+    // Written by the CPU thread only, and copied to published_counters every so often for
+    // anyone else to read. Opcodes are counted a block at a time, from the blocks' runs.
+    uint64_t interrupts_taken;
+    uint64_t opcode_counts[256];
+    uint64_t next_publish;
+    atomic<uint64_t> published_counters[stack_cpu_counter_count];
+
+    // Set while tracing. Traced CPUs interpret every block, so each instruction is seen.
+    unique_ptr<TraceWriter> tracer;
+
+    int32_t init();
+    int32_t cleanup();
+    int32_t reset();
+    int32_t boot();
+    int32_t halt();
+    int32_t interrupt(uint32_t code);
+    int32_t step(uint32_t budget);
+    int32_t snapshot(uint8_t* dest, uint32_t capacity, uint32_t* length);
+    int32_t restore(const uint8_t* src, uint32_t length);
+    int32_t clone(uint32_t count, Device* copies);
+    int32_t destroy();
+    int32_t register_motherboard(void* motherboard, MotherboardFunctions* mbfuncs);
+    uint32_t read_counters(uint64_t* dest, uint32_t capacity);
+
+    bool check_running();
+    void start();
+    int32_t run_next();
+    bool post_line(uint32_t line);
+    bool take_line(uint32_t line);
+    bool next_interrupt(uint32_t& code);
+    void clear_interrupts();
+    void wait_for_interrupt();
+    void wake_up();
+    void start_clock();
+    void keep_time();
+    void count_opcodes(BasicBlock& block);
+    void publish_counters();
+    void trace_instruction(const DecodedInstruction& di);
+    void trace_interrupt(uint32_t code);
+
+    int32_t process_code(uint32_t code);
+    int32_t process_block();
+    int32_t fetch_block(BasicBlock*& block);
+    int32_t decode_block(BasicBlock& block, uint64_t start);
+    int32_t interpret_block(BasicBlock& block);
+    template<bool checked>
+    int32_t run_block(BasicBlock& block);
+    int32_t run_cached_block(BasicBlock& block);
+    int32_t run_differential(BasicBlock& block);
+    void compile_block(BasicBlock& block);
+    void flush_native_code();
+    void track_code_pages(const BasicBlock& block);
+
+    const MemoryWindow& memory_window(uint64_t addr);
+    void forget_memory_windows();
+    int32_t read_memory(uint64_t addr, uint32_t len, uint8_t* dest);
+    int32_t write_memory(uint64_t addr, uint32_t len, uint8_t* src);
+    int32_t transfer_memory(const MemorySegment* segments, uint32_t count, bool write);
+
+    void note_code_write(uint64_t addr, uint32_t len);
+    void invalidate_code_page(uint64_t page);
+    void flush_block_cache();
+
+    // Checked pops and pushes set the Stack Underflow and Overflow errors, unless the
+    // stack cache can fill or spill the stack to make them fit. Handlers run unchecked
+    // inside a block whose stack use was checked on entry, and so do the operations
+    // below.
+    template<typename T, bool checked = true>
+    void pop(T& dest);
+
+    template<typename T, bool checked = true>
+    void push(T source);
+
+    bool fill_stack(uint32_t words);
+    bool spill_stack(uint32_t words);
+
+    template<typename T, bool checked = true>
+    int32_t add();
+    template<typename T, bool checked = true>
+    int32_t subtract();
+    template<typename T, bool checked = true>
+    int32_t multiply();
+    template<typename T, bool checked = true>
+    int32_t divide();
+    template<typename T, bool checked = true>
+    int32_t and_();
+    template<typename T, bool checked = true>
+    int32_t or_();
+    template<typename T, bool checked = true>
+    int32_t xor_();
+    template<typename T, bool checked = true>
+    int32_t not_();
+    template<typename T, bool checked = true>
+    int32_t negate();
+
+    template<typename T, bool checked = true>
+    int32_t ge();
+    template<typename T, bool checked = true>
+    int32_t gt();
+    template<typename T, bool checked = true>
+    int32_t eq();
+    template<typename T, bool checked = true>
+    int32_t neq();
+    template<typename T, bool checked = true>
+    int32_t lt();
+    template<typename T, bool checked = true>
+    int32_t le();
+
+    template<typename T, bool checked = true>
+    int32_t copy();
+    template<typename T, bool checked = true>
+    int32_t discard();
+
+    template<typename T, bool checked = true>
+    int32_t read();
+    template<typename T, bool checked = true>
+    int32_t read_immediate(const uint8_t* immediate);
+    template<typename T, bool checked = true>
+    int32_t write();
+    template<typename T, bool checked = true>
+    int32_t shift();
+    template<typename T, bool checked = true>
+    int32_t unshift();
+
+    int32_t shift_all();
+    int32_t unshift_all();
+
+    template<bool checked = true>
+    int32_t read_register(uint8_t argument);
+    int32_t write_register(uint8_t argument);
+
+    template<typename T, typename U, bool checked = true>
+    int32_t resize();
+    template<typename T, bool checked = true>
+    int32_t swap();
+    template<bool checked = true>
+    int32_t jump();
+
+    template<bool checked = true>
+    int32_t internal_interrupt();
+    int32_t return_from_interrupt();
+    int32_t wait();
+};
+
+// Words popped and then pushed by an instruction, assuming the stack neither underflows
+// nor overflows. Returns false if that depends on more than the instruction itself.
+bool stack_effect(const DecodedInstruction& di, uint32_t& pops, uint32_t& pushes);
+
+// Implementation of an instruction, as looked up when its block is decoded. Unchecked
+// handlers assume the stack won't underflow or overflow.
+Handler resolve_handler(uint8_t instr, uint8_t size, bool checked = true);
+
+#endif // bscomp_stackcpu_h
@@ -1,136 +1,25 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <mutex>
 #include <new>
-#include <queue>
+#include <thread>
 #include <type_traits>
+#include <unordered_set>
+#include <vector>
 
 extern "C" {
 #include "motherboard.h"
 }
 
 #include "stacker.h"
+#include "stackcpu.h"
 
 using namespace std;
 
-struct StackCPUDevice {
-    uint32_t stack_size;
-    // Internal stack pointer
-    uint32_t isp;
-    uint32_t* stack;
-    // Instruction pointer
-    uint64_t ip;
-    // Stack pointer
-    uint64_t sp;
-
-    uint64_t interrupt_stack;
-    uint64_t interrupt_table;
-    uint32_t interrupt_count;
-
-    // Bitvector.
-    // 0: Interrupt Enable
-    // 1: Protect
-    uint32_t settings;
-
-    // Bitvector.
-    // 0: Invalid Command
-    // 1: Invalid Command Argument
-    // 2: Stack Underflow
-    // 3: Stack Overflow
-    // 4: Protected Operation
-    uint32_t errors;
-
-    queue<uint32_t> interrupts;
-    mutex interrupt_lock;
-
-    bool running;
-    mutex running_lock;
-
-    void* motherboard;
-    MotherboardFunctions mbfuncs;
-
-    int32_t init();
-    int32_t cleanup();
-    int32_t reset();
-    int32_t boot();
-    int32_t halt();
-    int32_t interrupt(uint32_t code);
-    int32_t register_motherboard(void* motherboard, MotherboardFunctions* mbfuncs);
-
-    bool check_running();
-
-    int32_t process_code(uint32_t code);
-    int32_t process_instruction();
-
-    template<typename T>
-    void pop(T& dest);
-
-    template<typename T>
-    void push(T source);
-
-    template<typename T>
-    int32_t add();
-    template<typename T>
-    int32_t subtract();
-    template<typename T>
-    int32_t multiply();
-    template<typename T>
-    int32_t divide();
-    template<typename T>
-    int32_t and_();
-    template<typename T>
-    int32_t or_();
-    template<typename T>
-    int32_t xor_();
-    template<typename T>
-    int32_t not_();
-    template<typename T>
-    int32_t negate();
-
-    template<typename T>
-    int32_t ge();
-    template<typename T>
-    int32_t gt();
-    template<typename T>
-    int32_t eq();
-    template<typename T>
-    int32_t neq();
-    template<typename T>
-    int32_t lt();
-    template<typename T>
-    int32_t le();
-
-    template<typename T>
-    int32_t copy();
-    template<typename T>
-    int32_t discard();
-
-    template<typename T>
-    int32_t read();
-    template<typename T>
-    int32_t read_immediate();
-    template<typename T>
-    int32_t write();
-    template<typename T>
-    int32_t shift();
-    template<typename T>
-    int32_t unshift();
-
-    int32_t shift_all();
-    int32_t unshift_all();
-
-    int32_t read_register(uint8_t argument);
-    int32_t write_register(uint8_t argument);
-
-    template<typename T, typename U>
-    int32_t resize();
-    template<typename T>
-    int32_t swap();
-    int32_t jump();
-
-    int32_t internal_interrupt();
-};
-
 static uint32_t next_device_id = 0;
 
 extern "C" {
@@ -140,10 +29,16 @@ extern "C" {
     static int32_t boot(void*);
     static int32_t halt(void*);
     static int32_t interrupt(void*, uint32_t);
+    static int32_t step(void*, uint32_t);
+    static int32_t snapshot(void*, uint8_t*, uint32_t, uint32_t*);
+    static int32_t restore(void*, const uint8_t*, uint32_t);
+    static int32_t clone_device(void*, uint32_t, Device*);
+    static int32_t destroy(void*);
     static int32_t register_motherboard(void*, void*, MotherboardFunctions*);
+    static uint32_t read_counters(void*, uint64_t*, uint32_t);
 
     struct Device* bscomp_device_new(const struct StackCPUConfig* config) {
-        if (!config || !config->stack_size) {
+        if (!config || !config->stack_size || config->jit_mode > stack_cpu_jit_differential) {
             return 0;
         }
 
@@ -159,7 +54,27 @@ extern "C" {
             return 0;
         }
 
+        cpudev->config = *config;
         cpudev->stack_size = config->stack_size;
+        cpudev->jit_mode = config->jit_mode;
+        cpudev->jit_threshold = config->jit_threshold ? config->jit_threshold : default_jit_threshold;
+        cpudev->instructions_per_second = config->instructions_per_second;
+        cpudev->clock_quantum = config->clock_quantum
+            ? config->clock_quantum : max(config->instructions_per_second / 1000, 1u);
+        // Allocated up front, since other devices may interrupt us before init.
+        uint32_t vector_size = config->interrupt_vector_size
+            ? config->interrupt_vector_size : default_interrupt_vector_size;
+        if (cpudev->interrupts.init(vector_size)) {
+            delete dev;
+            delete cpudev;
+            return 0;
+        }
+        // Rounded up as the queue's is.
+        cpudev->line_capacity = 1;
+        while (cpudev->line_capacity < vector_size && cpudev->line_capacity < (1u << 31)) {
+            cpudev->line_capacity <<= 1;
+        }
+        cpudev->coalesce_interrupts = config->coalesce_interrupts;
 
         dev->device = cpudev;
         dev->init = &init;
@@ -168,7 +83,13 @@ extern "C" {
         dev->boot = &boot;
         dev->halt = &halt;
         dev->interrupt = &interrupt;
+        dev->step = &step;
+        dev->snapshot = &snapshot;
+        dev->restore = &restore;
+        dev->clone = &clone_device;
+        dev->destroy = &destroy;
         dev->register_motherboard = &register_motherboard;
+        dev->read_counters = &read_counters;
 
         dev->device_type = stack_cpu_device_type_id;
         dev->device_id = next_device_id++;
@@ -177,19 +98,78 @@ extern "C" {
         return dev;
     }
 
+    uint64_t bscomp_stackcpu_interrupts_dropped(const struct Device* dev) {
+        if (!dev || !dev->device) {
+            return 0;
+        }
+        StackCPUDevice* cpudev = static_cast<StackCPUDevice*>(dev->device);
+        return cpudev->interrupts_dropped.load(memory_order_relaxed);
+    }
+
+    int32_t bscomp_stackcpu_idle_stats(const struct Device* dev, struct StackCPUIdleStats* stats) {
+        if (!dev || !dev->device || dev->device_type != stack_cpu_device_type_id || !stats) {
+            return -1;
+        }
+        StackCPUDevice* cpudev = static_cast<StackCPUDevice*>(dev->device);
+        stats->waits = cpudev->idle_waits.load(memory_order_relaxed);
+        stats->idle_nanoseconds = cpudev->idle_nanoseconds.load(memory_order_relaxed);
+        stats->wakeups = cpudev->idle_wakeups.load(memory_order_relaxed);
+        stats->wake_latency_nanoseconds = cpudev->wake_latency_nanoseconds.load(memory_order_relaxed);
+        stats->max_wake_latency_nanoseconds
+            = cpudev->max_wake_latency_nanoseconds.load(memory_order_relaxed);
+        return 0;
+    }
+
+    int32_t bscomp_stackcpu_counters(const struct Device* dev, struct StackCPUCounters* counters) {
+        if (!dev || !dev->device || dev->device_type != stack_cpu_device_type_id || !counters) {
+            return -1;
+        }
+        StackCPUDevice* cpudev = static_cast<StackCPUDevice*>(dev->device);
+        cpudev->read_counters(reinterpret_cast<uint64_t*>(counters), stack_cpu_counter_count);
+        return 0;
+    }
+
+    int32_t bscomp_stackcpu_start_trace(struct Device* dev, const char* path) {
+        if (!dev || !dev->device || dev->device_type != stack_cpu_device_type_id || !path) {
+            return -1;
+        }
+        StackCPUDevice* cpudev = static_cast<StackCPUDevice*>(dev->device);
+        cpudev->tracer.reset();
+        unique_ptr<TraceWriter> tracer;
+        try {
+            tracer.reset(new TraceWriter());
+        } catch (const bad_alloc& ex) {
+            return -1;
+        }
+        if (tracer->open(path)) {
+            return -1;
+        }
+        cpudev->tracer = move(tracer);
+        return 0;
+    }
+
+    int32_t bscomp_stackcpu_stop_trace(struct Device* dev) {
+        if (!dev || !dev->device || dev->device_type != stack_cpu_device_type_id) {
+            return -1;
+        }
+        StackCPUDevice* cpudev = static_cast<StackCPUDevice*>(dev->device);
+        cpudev->tracer.reset();
+        return 0;
+    }
+
     void bscomp_device_destroy(struct Device* dev) {
         if (!dev) {
             return;
         }
 
         StackCPUDevice* cpudev = static_cast<StackCPUDevice*>(dev->device);
-        if (!cpudev || !cpudev->stack) {
+        if (!cpudev) {
             // Already messed up, don't mess up further by trying to do a partial free.
             return;
         }
 
-        delete[] cpudev->stack;
-        cpudev->stack = 0;
+        // The motherboard cleans devices up when it shuts down; doing it again is safe.
+        cpudev->cleanup();
 
         delete cpudev;
         dev->device = 0;
@@ -237,6 +217,14 @@ extern "C" {
         return cd->halt();
     }
 
+    static int32_t step(void* cpudev, uint32_t budget) {
+        if (!cpudev) {
+            return -1;
+        }
+        StackCPUDevice* cd = static_cast<StackCPUDevice*>(cpudev);
+        return cd->step(budget);
+    }
+
     static int32_t interrupt(void* cpudev, uint32_t code) {
         if (!cpudev) {
             return -1;
@@ -252,14 +240,60 @@ extern "C" {
         StackCPUDevice* cd = static_cast<StackCPUDevice*>(cpudev);
         return cd->register_motherboard(motherboard, mbfuncs);
     }
+
+    static uint32_t read_counters(void* cpudev, uint64_t* dest, uint32_t capacity) {
+        if (!cpudev) {
+            return 0;
+        }
+        StackCPUDevice* cd = static_cast<StackCPUDevice*>(cpudev);
+        return cd->read_counters(dest, capacity);
+    }
+
+    static int32_t snapshot(void* cpudev, uint8_t* dest, uint32_t capacity, uint32_t* length) {
+        if (!cpudev) {
+            return -1;
+        }
+        StackCPUDevice* cd = static_cast<StackCPUDevice*>(cpudev);
+        return cd->snapshot(dest, capacity, length);
+    }
+
+    static int32_t restore(void* cpudev, const uint8_t* src, uint32_t length) {
+        if (!cpudev) {
+            return -1;
+        }
+        StackCPUDevice* cd = static_cast<StackCPUDevice*>(cpudev);
+        return cd->restore(src, length);
+    }
+
+    static int32_t clone_device(void* cpudev, uint32_t count, Device* copies) {
+        if (!cpudev || (count && !copies)) {
+            return -1;
+        }
+        StackCPUDevice* cd = static_cast<StackCPUDevice*>(cpudev);
+        return cd->clone(count, copies);
+    }
+
+    static int32_t destroy(void* cpudev) {
+        if (!cpudev) {
+            return -1;
+        }
+        StackCPUDevice* cd = static_cast<StackCPUDevice*>(cpudev);
+        return cd->destroy();
+    }
 } // end of extern "C"
 
 int32_t StackCPUDevice::init() {
     try {
         stack = new uint32_t[stack_size];
+        block_cache.resize(block_cache_size);
     } catch(const bad_alloc& ex) {
         return -1;
     }
+    flush_block_cache();
+    if (jit_mode != stack_cpu_jit_off && jit.init()) {
+        cout << "Stack CPU JIT unavailable, interpreting" << endl;
+        jit_mode = stack_cpu_jit_off;
+    }
     return 0;
 }
 
@@ -268,6 +302,9 @@ int32_t StackCPUDevice::cleanup() {
         delete[] stack;
         stack = 0;
     }
+    vector<BasicBlock>().swap(block_cache);
+    code_pages.clear();
+    jit.cleanup();
     return 0;
 }
 
@@ -276,529 +313,1455 @@ int32_t StackCPUDevice::reset() {
         stack[i] = 0;
     }
 
-    interrupt_lock.lock();
-    queue<uint32_t>().swap(interrupts);
-    interrupt_lock.unlock();
+    clear_interrupts();
+    instructions = 0;
+    idle = false;
+    started = false;
+
+    flush_block_cache();
+    interrupts_taken = 0;
+    for (auto& block : block_cache) {
+        block.runs = 0;
+    }
+    memset(opcode_counts, 0, sizeof(opcode_counts));
+    publish_counters();
 
     return 0;
 }
 
 int32_t StackCPUDevice::boot() {
-    running = true;
+    running.store(true, memory_order_relaxed);
     cout << "Stack CPU Received BOOT" << endl;
+    start();
+    uint64_t next_tick = instructions + clock_quantum;
     while (check_running()) {
-        uint32_t code = 0;
-        bool has_code = false;
-        if (settings & (1 << 0)) {
-            // Don't pop a hardware interrupt if interrupts are disabled.
-            interrupt_lock.lock();
-            if (!interrupts.empty()) {
-                code = interrupts.front();
-                interrupts.pop();
-                has_code = true;
-            }
-            interrupt_lock.unlock();
+        if (instructions_per_second && instructions >= next_tick) {
+            keep_time();
+            next_tick = instructions + clock_quantum;
+        }
+        if (instructions >= next_publish) {
+            publish_counters();
         }
 
-        if (has_code) {
-            auto res = process_code(code);
-            if (res) {
-                cout << "Simulator error (code " << res << ") -- Stack CPU Halting." << endl;
-                return res;
-            }
-        } else {
-            auto res = process_instruction();
-            if (res) {
-                cout << "Simulator error (code " << res << ") -- Stack CPU Halting." << endl;
-                return res;
-            }
+        auto res = run_next();
+        if (res) {
+            cout << "Simulator error (code " << res << ") -- Stack CPU Halting." << endl;
+            publish_counters();
+            return res;
+        }
+        if (idle) {
+            idle = false;
+            publish_counters();
+            wait_for_interrupt();
         }
     }
+    publish_counters();
     cout << "Stack CPU Shutting Down" << endl;
     return 0;
 }
 
+// Runs at least budget instructions, unless the CPU goes idle first. Stepped CPUs aren't
+// clocked; the runtime decides how often to step them.
+int32_t StackCPUDevice::step(uint32_t budget) {
+    if (!started) {
+        start();
+    }
+    uint64_t limit = instructions + budget;
+    int32_t result = bscomp_step_ready;
+    while (instructions < limit) {
+        if (idle) {
+            if (!interrupt_pending.load(memory_order_acquire)) {
+                result = bscomp_step_idle;
+                break;
+            }
+            idle = false;
+        }
+        auto res = run_next();
+        if (res) {
+            cout << "Simulator error (code " << res << ") -- Stack CPU Halting." << endl;
+            result = res;
+            break;
+        }
+    }
+    publish_counters();
+    return result;
+}
+
+// Everything between a reset and the first instruction.
+void StackCPUDevice::start() {
+    // Other devices may have rewritten memory while we were stopped.
+    flush_block_cache();
+    forget_memory_windows();
+    start_clock();
+    started = true;
+}
+
+// Runs the next hardware interrupt if there is one to take, or else the next block.
+int32_t StackCPUDevice::run_next() {
+    uint32_t code = 0;
+    if (interrupt_pending.load(memory_order_relaxed) && next_interrupt(code)) {
+        if (tracer) {
+            trace_interrupt(code);
+        }
+        ++instructions;
+        ++interrupts_taken;
+        return process_code(code);
+    }
+    return process_block();
+}
+
 int32_t StackCPUDevice::halt() {
     cout << "Stack CPU Received HALT" << endl;
-    running_lock.lock();
-    running = false;
-    running_lock.unlock();
+    running.store(false, memory_order_seq_cst);
+    wake_up();
     return 0;
 }
 
 int32_t StackCPUDevice::interrupt(uint32_t code) {
-    cout << "Stack CPU Received INTERRUPT " << code << endl;
-    interrupt_lock.lock();
-    interrupts.push(code);
-    interrupt_lock.unlock();
+    // When the line or the vector is full the new interrupt is dropped. The CPU sees the
+    // count go up and sets its Interrupt Overflow error.
+    if (code < stack_cpu_interrupt_lines ? !post_line(code) : !interrupts.push(code)) {
+        interrupts_dropped.fetch_add(1, memory_order_relaxed);
+    }
+    interrupt_pending.store(true, memory_order_seq_cst);
+    wake_up();
     return 0;
 }
 
 int32_t StackCPUDevice::register_motherboard(void* motherboard, MotherboardFunctions* mbfuncs) {
     this->motherboard = motherboard;
     this->mbfuncs = *mbfuncs;
+    forget_memory_windows();
     return 0;
 }
 
-bool StackCPUDevice::check_running() {
-    bool result;
-    running_lock.lock();
-    result = running;
-    running_lock.unlock();
-    return result;
+// Copies out the counters as last published, in the order of StackCPUCounters. Safe from
+// any thread.
+uint32_t StackCPUDevice::read_counters(uint64_t* dest, uint32_t capacity) {
+    uint32_t count = min(capacity, stack_cpu_counter_count);
+    for (uint32_t i = 0; i < count; ++i) {
+        dest[i] = published_counters[i].load(memory_order_relaxed);
+    }
+    // Dropped interrupts are counted as they happen, so are always up to date.
+    if (count > 2) {
+        dest[2] = interrupts_dropped.load(memory_order_relaxed);
+    }
+    return stack_cpu_counter_count;
 }
 
-int32_t StackCPUDevice::process_code(uint32_t code) {
-    if (!(settings & (1 << 0))) {
-        // Ignore if interrupts disabled -- this only affects software
-        // interrupts. Interrupt disable prevents popping from the interrupt vector for
-        // "hardware" interrupts.
+// Snapshots are a SavedCPU, then the stack, then the codes of any interrupts waiting.
+int32_t StackCPUDevice::snapshot(uint8_t* dest, uint32_t capacity, uint32_t* length) {
+    // Lines go first, in the order they'd be taken, each as many times as it's waiting.
+    vector<uint32_t> waiting;
+    uint64_t lines = pending_lines.load(memory_order_acquire);
+    for (uint32_t line = 0; line < stack_cpu_interrupt_lines; ++line) {
+        if (lines & (1ull << line)) {
+            uint32_t count = coalesce_interrupts
+                ? 1 : line_counts[line].load(memory_order_relaxed);
+            waiting.insert(waiting.end(), count, line);
+        }
+    }
+
+    // Only the CPU thread takes interrupts off the ring, and it isn't running, so we can
+    // empty it to see what's there and then put it all back.
+    uint32_t queued = waiting.size();
+    uint32_t code;
+    while (interrupts.pop(code)) {
+        waiting.push_back(code);
+    }
+    for (uint32_t i = queued; i < waiting.size(); ++i) {
+        interrupts.push(waiting[i]);
+    }
+
+    uint64_t size = sizeof(SavedCPU) + uint64_t(stack_size) * sizeof(uint32_t)
+        + waiting.size() * sizeof(uint32_t);
+    if (size > UINT32_MAX) {
+        return -2;
+    }
+    *length = size;
+    if (!dest || capacity < size) {
         return 0;
     }
 
+    SavedCPU saved = {};
+    saved.version = saved_cpu_version;
+    saved.stack_size = stack_size;
+    saved.isp = isp;
+    saved.settings = settings;
+    saved.errors = errors;
+    saved.interrupt_count = interrupt_count;
+    saved.ip = ip;
+    saved.sp = sp;
+    saved.interrupt_stack = interrupt_stack;
+    saved.interrupt_table = interrupt_table;
+    saved.interrupt_mask = interrupt_mask;
+    saved.instructions = instructions;
+    saved.idle = idle;
+    saved.interrupts_waiting = waiting.size();
+    saved.spilled = spilled;
+
+    memcpy(dest, &saved, sizeof(saved));
+    dest += sizeof(saved);
+    memcpy(dest, stack, stack_size * sizeof(uint32_t));
+    dest += stack_size * sizeof(uint32_t);
+    memcpy(dest, waiting.data(), waiting.size() * sizeof(uint32_t));
+    return 0;
+}
 
+int32_t StackCPUDevice::restore(const uint8_t* src, uint32_t length) {
+    SavedCPU saved;
+    if (length < sizeof(saved)) {
+        return -2;
+    }
+    memcpy(&saved, src, sizeof(saved));
+    if (saved.version != saved_cpu_version || saved.stack_size != stack_size
+            || saved.isp > stack_size
+            || length != sizeof(saved) + uint64_t(stack_size) * sizeof(uint32_t)
+                + uint64_t(saved.interrupts_waiting) * sizeof(uint32_t)) {
+        return -2;
+    }
+    src += sizeof(saved);
+
+    isp = saved.isp;
+    settings = saved.settings;
+    errors = saved.errors;
+    interrupt_count = saved.interrupt_count;
+    ip = saved.ip;
+    sp = saved.sp;
+    spilled = saved.spilled;
+    interrupt_stack = saved.interrupt_stack;
+    interrupt_table = saved.interrupt_table;
+    interrupt_mask = saved.interrupt_mask;
+    instructions = saved.instructions;
+    idle = saved.idle;
+    memcpy(stack, src, stack_size * sizeof(uint32_t));
+    src += stack_size * sizeof(uint32_t);
+
+    clear_interrupts();
+    for (uint32_t i = 0; i < saved.interrupts_waiting; ++i) {
+        uint32_t code;
+        memcpy(&code, src + i * sizeof(code), sizeof(code));
+        interrupt(code);
+    }
 
+    // Memory has changed under any decoded code, and the clock starts over.
+    started = false;
+    flush_block_cache();
     return 0;
 }
 
-#define SIZE_SWITCH(OP, size) switch (size) {   \
-    case 2:                                     \
-        return OP<float>();                     \
-        break;                                  \
-    case 3:                                     \
-        return OP<uint8_t>();                   \
-        break;                                  \
-    case 4:                                     \
-        return OP<uint16_t>();                  \
-        break;                                  \
-    case 5:                                     \
-        return OP<uint32_t>();                  \
-        break;                                  \
-    case 6:                                     \
-        return OP<uint64_t>();                  \
-        break;                                  \
-    case 7:                                     \
-        return OP<double>();                    \
-        break;                                  \
-    default:                                    \
-        errors |= 1 << 1;                       \
-        break;                                  \
-    }
-
-#define SIZE_SWITCH_NOFLOAT(OP, size) switch (size) {   \
-    case 3:                                             \
-        return OP<uint8_t>();                           \
-        break;                                          \
-    case 4:                                             \
-        return OP<uint16_t>();                          \
-        break;                                          \
-    case 2:                                             \
-    case 5:                                             \
-        return OP<uint32_t>();                          \
-        break;                                          \
-    case 6:                                             \
-    case 7:                                             \
-        return OP<uint64_t>();                          \
-        break;                                          \
-    default:                                            \
-        errors |= 1 << 1;                               \
-        break;                                          \
-    }
-
-#define RESIZE_SWITCH_INNER(fromsize, from)                 \
-    case fromsize | (2 << 3):                               \
-        return resize<from, float>();                       \
-        break;                                              \
-    case fromsize | (3 << 3):                               \
-        return resize<from, uint8_t>();                     \
-        break;                                              \
-    case fromsize | (4 << 3):                               \
-        return resize<from, uint16_t>();                    \
-        break;                                              \
-    case fromsize | (5 << 3):                               \
-        return resize<from, uint32_t>();                    \
-        break;                                              \
-    case fromsize | (6 << 3):                               \
-        return resize<from, uint64_t>();                    \
-        break;                                              \
-    case fromsize | (7 << 3):                               \
-        return resize<from, double>();                      \
-        break;                                              \
-
-
-int32_t StackCPUDevice::process_instruction() {
-    uint8_t instruction[2];
-    auto read_result = mbfuncs.read_bytes(motherboard, ip, 2, instruction);
-    if (read_result) {
-        return read_result;
+// Clones are new CPUs with the same config, initialized and then restored from a
+// snapshot of this one.
+int32_t StackCPUDevice::clone(uint32_t count, Device* copies) {
+    uint32_t length = 0;
+    vector<uint8_t> saved;
+    int32_t result = snapshot(0, 0, &length);
+    if (result) {
+        return result;
+    }
+    try {
+        saved.resize(length);
+    } catch (const bad_alloc& ex) {
+        return -1;
+    }
+    result = snapshot(saved.data(), length, &length);
+    if (result) {
+        return result;
     }
-    ip += 2;
 
-    uint8_t& instr = instruction[0];
-    uint8_t& size = instruction[1];
+    for (uint32_t i = 0; i < count; ++i) {
+        Device* dev = bscomp_device_new(&config);
+        StackCPUDevice* copy = dev ? static_cast<StackCPUDevice*>(dev->device) : 0;
+        if (copy) {
+            result = copy->init();
+            if (!result) {
+                result = copy->restore(saved.data(), length);
+            }
+            if (result) {
+                copy->destroy();
+            } else {
+                copies[i] = *dev;
+            }
+            delete dev;
+        } else {
+            result = -1;
+        }
 
-    switch (instr) {
-    case 0: // NOP
-        break;
-    case '+': // add
-        SIZE_SWITCH(add, size)
-        break;
-    case '-': // subtract
-        SIZE_SWITCH(subtract, size)
-        break;
-    case '*': // multiply
-        SIZE_SWITCH(multiply, size)
-        break;
-    case '/': // divide
-        SIZE_SWITCH(divide, size)
-        break;
-    case '&': // and
-        SIZE_SWITCH_NOFLOAT(and_, size)
-        break;
-    case '|': // or
-        SIZE_SWITCH_NOFLOAT(or_, size)
-        break;
-    case '^': // xor
-        SIZE_SWITCH_NOFLOAT(xor_, size)
-        break;
-    case '~': // not
-        SIZE_SWITCH_NOFLOAT(not_, size)
-        break;
-    case '_': // negate
-        SIZE_SWITCH(negate, size)
-        break;
-    case '<': // less than
-        SIZE_SWITCH(lt, size)
-        break;
-    case '>': // greater than
-        SIZE_SWITCH(gt, size)
-        break;
-    case 'g': // greater than or equal to
-        SIZE_SWITCH(ge, size)
-        break;
-    case 'l': // less than or equal to
-        SIZE_SWITCH(le, size)
-        break;
-    case '=': // equal
-        SIZE_SWITCH(eq, size)
-        break;
-    case '!': // not equal
-        SIZE_SWITCH(neq, size)
-        break;
-    case 'C': // Copy
-        SIZE_SWITCH(copy, size)
-        break;
-    case 'D': // Discard
-        SIZE_SWITCH(discard, size)
-        break;
-    case 'R': // Read
-        SIZE_SWITCH(read, size)
-        break;
-    case 'r': // Read Immediate
-        SIZE_SWITCH(read_immediate, size)
-        break;
-    case 'W': // Write
-        SIZE_SWITCH(write, size)
-        break;
-    case 'S': // Shift
-        SIZE_SWITCH(shift, size)
-        break;
-    case 'U': // Unshift
-        SIZE_SWITCH(unshift, size)
-        break;
-    case 's': // Shift-All
-        shift_all();
-        break;
-    case 'u': // Unshift-All
-        unshift_all();
-        break;
-    case 'P': // Read Register
-        return read_register(size);
-        break;
-    case 'p': // Write Resister
-        return write_register(size);
-        break;
-    case 'z': // Resize
-        // OLDSIZE = size & 0b111, NEWSIZE = (size & 0b111000) >> 3
-        switch (size) {
-            RESIZE_SWITCH_INNER(2, float)
-            RESIZE_SWITCH_INNER(3, uint8_t)
-            RESIZE_SWITCH_INNER(4, uint16_t)
-            RESIZE_SWITCH_INNER(5, uint32_t)
-            RESIZE_SWITCH_INNER(6, uint64_t)
-            RESIZE_SWITCH_INNER(7, double)
-        default:
-            errors |= 1 << 1;
-            break;
+        if (result) {
+            for (uint32_t j = 0; j < i; ++j) {
+                static_cast<StackCPUDevice*>(copies[j].device)->destroy();
+            }
+            return result;
         }
-        break;
-    case '$': // Swap
-        SIZE_SWITCH(swap, size)
-        break;
-    case 'J': // Jump
-        return jump();
-        break;
-    case 'I': // Interrupt
-        return internal_interrupt();
-        break;
-    default:
-        errors |= 1 << 0;
     }
+    return 0;
+}
 
+// Frees a clone. The motherboard has already cleaned it up, but cleanup is safe to
+// repeat.
+int32_t StackCPUDevice::destroy() {
+    cleanup();
+    delete this;
     return 0;
 }
 
-#define PROTECT if (settings & (1<<1)) {        \
-        errors |= 1 << 4;                       \
-        return 0;                               \
-    } else {
+bool StackCPUDevice::check_running() {
+    return running.load(memory_order_relaxed);
+}
 
-#define ENDPROTECT }
+// Anchors the clock schedule at the current time, so time spent halted isn't made up.
+void StackCPUDevice::start_clock() {
+    clock_base = chrono::steady_clock::now();
+    clock_base_instructions = instructions;
+}
 
-template<typename T>
-void StackCPUDevice::pop(T& dest) {
-    static_assert(sizeof(T) <= sizeof(uint32_t), "Dest must be no more than 4 bytes.");
-    if (isp < 1) {
-        errors |= 1 << 2;
+// Waits until the clock schedule catches up with the instructions run so far. Times are
+// measured from the anchor rather than the last quantum, so rounding and oversleeping
+// don't accumulate.
+void StackCPUDevice::keep_time() {
+    chrono::duration<double> elapsed(
+        double(instructions - clock_base_instructions) / instructions_per_second);
+    auto due = clock_base + chrono::duration_cast<chrono::steady_clock::duration>(elapsed);
+
+    auto now = chrono::steady_clock::now();
+    if (now > due + max_clock_lag) {
+        start_clock();
         return;
     }
-    dest = *((T*)(&stack[--isp]));
+    while (now < due && check_running()) {
+        this_thread::sleep_until(min(due, now + max_clock_sleep));
+        now = chrono::steady_clock::now();
+    }
 }
 
-template<>
-void StackCPUDevice::pop<uint64_t>(uint64_t& dest) {
-    if (isp < 2) {
-        errors |= 1 << 2;
+// Adds the block's runs since it was last counted to the opcode counts.
+void StackCPUDevice::count_opcodes(BasicBlock& block) {
+    if (!block.runs) {
         return;
     }
-    uint32_t* blocks = (uint32_t*)(&dest);
-    blocks[1] = stack[--isp];
-    blocks[0] = stack[--isp];
+    for (const auto& di : block.instructions) {
+        opcode_counts[di.instr] += block.runs;
+    }
+    block.runs = 0;
 }
 
-template<>
-void StackCPUDevice::pop<double>(double& dest) {
-    if (isp < 2) {
-        errors |= 1 << 2;
-        return;
+// Brings the counters up to date and makes them visible to other threads.
+void StackCPUDevice::publish_counters() {
+    for (auto& block : block_cache) {
+        count_opcodes(block);
+    }
+    published_counters[0].store(instructions, memory_order_relaxed);
+    published_counters[1].store(interrupts_taken, memory_order_relaxed);
+    for (uint32_t i = 0; i < 256; ++i) {
+        published_counters[3 + i].store(opcode_counts[i], memory_order_relaxed);
     }
-    uint32_t* blocks = (uint32_t*)(&dest);
-    blocks[1] = stack[--isp];
-    blocks[0] = stack[--isp];
+    next_publish = instructions + counter_publish_interval;
 }
 
-template<typename T>
-void StackCPUDevice::push(T source) {
-    static_assert(sizeof(T) <= sizeof(uint32_t), "Source must be no more than 4 bytes.");
-    if (isp >= stack_size) {
-        errors |= 1 << 3;
-        return;
+// Records an instruction about to run. Memory addresses are read off the stacks as the
+// instruction will find them.
+void StackCPUDevice::trace_instruction(const DecodedInstruction& di) {
+    TraceRecord rec = {};
+    rec.ip = ip;
+    rec.isp = isp;
+    rec.instr = di.instr;
+    rec.size = di.size;
+    switch (di.instr) {
+    case 'R':
+    case 'W':
+        // The address is the 64 bit value on top of the stack.
+        if (isp >= 2) {
+            memcpy(&rec.address, &stack[isp - 2], sizeof(rec.address));
+            rec.flags |= trace_has_address;
+        }
+        break;
+    case 'S':
+    case 'U':
+    case 's':
+    case 'u':
+        rec.address = sp;
+        rec.flags |= trace_has_address;
+        break;
     }
-    *((T*)(&stack[isp++])) = source;
+    tracer->record(rec);
 }
 
-template<>
-void StackCPUDevice::push<uint64_t>(uint64_t source) {
-    if (isp >= stack_size - 1) {
-        errors |= 1 << 3;
-        return;
-    }
-    uint32_t* blocks = (uint32_t*)(&source);
-    stack[isp++] = blocks[0];
-    stack[isp++] = blocks[1];
+void StackCPUDevice::trace_interrupt(uint32_t code) {
+    TraceRecord rec = {};
+    rec.ip = ip;
+    rec.isp = isp;
+    rec.address = code;
+    rec.flags = trace_is_interrupt;
+    tracer->record(rec);
 }
 
-template<>
-void StackCPUDevice::push<double>(double source) {
-    if (isp >= stack_size - 1) {
-        errors |= 1 << 3;
-        return;
+// Counts an interrupt on its line, then marks the line pending, so the CPU never finds
+// the bit clear while the line has interrupts waiting. Returns false if the line is full.
+bool StackCPUDevice::post_line(uint32_t line) {
+    if (!coalesce_interrupts) {
+        uint32_t count = line_counts[line].load(memory_order_relaxed);
+        do {
+            if (count >= line_capacity) {
+                return false;
+            }
+        } while (!line_counts[line].compare_exchange_weak(count, count + 1,
+                                                          memory_order_relaxed));
     }
-    uint32_t* blocks = (uint32_t*)(&source);
-    stack[isp++] = blocks[0];
-    stack[isp++] = blocks[1];
+    pending_lines.fetch_or(1ull << line, memory_order_release);
+    return true;
 }
 
-#define BINARY_OPERATOR(opname, OP) template<typename T>   \
-    int32_t StackCPUDevice::opname() {                     \
-        T a, b;                                            \
-        pop<T>(a);                                         \
-        pop<T>(b);                                         \
-        push<T>(a OP b);                                   \
-        return 0;                                          \
+// Takes one interrupt off a pending line, or all of them if they're coalesced. Returns
+// false if the bit was left over from interrupts already taken.
+bool StackCPUDevice::take_line(uint32_t line) {
+    uint64_t bit = 1ull << line;
+    pending_lines.fetch_and(~bit, memory_order_acquire);
+    if (coalesce_interrupts) {
+        return true;
     }
+    uint32_t count = line_counts[line].load(memory_order_relaxed);
+    do {
+        if (!count) {
+            return false;
+        }
+    } while (!line_counts[line].compare_exchange_weak(count, count - 1,
+                                                      memory_order_relaxed));
+    if (count > 1) {
+        pending_lines.fetch_or(bit, memory_order_relaxed);
+    }
+    return true;
+}
 
-BINARY_OPERATOR(add, +)
-BINARY_OPERATOR(subtract, -)
-BINARY_OPERATOR(multiply, *)
-BINARY_OPERATOR(divide, /)
-BINARY_OPERATOR(and_, &)
-BINARY_OPERATOR(or_, |)
-BINARY_OPERATOR(xor_, ^)
-
-#define BINARY_COMPARISON(opname, OP) template<typename T> \
-    int32_t StackCPUDevice::opname() {                     \
-        T a, b;                                            \
-        pop<T>(a);                                         \
-        pop<T>(b);                                         \
-        push<int32_t>(a OP b);                             \
-        return 0;                                          \
+// Takes the next hardware interrupt, if interrupts are enabled and there is one: the
+// lowest unmasked line pending, or else the oldest in the queue. Only called when
+// interrupt_pending is set.
+bool StackCPUDevice::next_interrupt(uint32_t& code) {
+    uint64_t dropped = interrupts_dropped.load(memory_order_relaxed);
+    if (dropped != interrupts_reported) {
+        interrupts_reported = dropped;
+        errors |= 1 << 5;
     }
 
-BINARY_COMPARISON(le, <=)
-BINARY_COMPARISON(lt, <)
-BINARY_COMPARISON(eq, ==)
-BINARY_COMPARISON(neq, !=)
-BINARY_COMPARISON(gt, >)
-BINARY_COMPARISON(ge, >=)
+    if (!(settings & (1 << 0))) {
+        // Don't pop a hardware interrupt if interrupts are disabled. The flag stays set
+        // so we look again once they are enabled.
+        return false;
+    }
 
-template<typename T>
-int32_t StackCPUDevice::not_() {
-    T a;
-    pop<T>(a);
-    push<T>(~a);
-    return 0;
+    // Clear the flag before looking, so an interrupt which arrives in between sets it
+    // again rather than being missed.
+    interrupt_pending.exchange(false, memory_order_acquire);
+    uint64_t lines = pending_lines.load(memory_order_acquire) & ~interrupt_mask;
+    while (lines) {
+        uint32_t line = __builtin_ctzll(lines);
+        if (take_line(line)) {
+            code = line;
+            interrupt_pending.store(true, memory_order_relaxed);
+            return true;
+        }
+        lines &= lines - 1;
+    }
+    if (!interrupts.pop(code)) {
+        return false;
+    }
+    // There may be more behind it.
+    interrupt_pending.store(true, memory_order_relaxed);
+    return true;
 }
 
-template<typename T>
-int32_t StackCPUDevice::negate() {
-    T a;
-    pop<T>(a);
-    push<T>(-a);
-    return 0;
+// Drops every waiting hardware interrupt. Only called while the CPU isn't running.
+void StackCPUDevice::clear_interrupts() {
+    interrupts.clear();
+    pending_lines.store(0, memory_order_relaxed);
+    for (auto& count : line_counts) {
+        count.store(0, memory_order_relaxed);
+    }
+    interrupt_pending.store(false, memory_order_relaxed);
+    interrupts_reported = interrupts_dropped.load(memory_order_relaxed);
 }
 
-template<typename T>
-int32_t StackCPUDevice::copy() {
-    T a;
-    pop<T>(a);
-    push<T>(a);
-    push<T>(a);
-    return 0;
+static int64_t steady_nanoseconds() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-template<typename T>
-int32_t StackCPUDevice::discard() {
-    T a;
-    pop<T>(a);
-    return 0;
+// Parks the CPU thread until an interrupt is waiting or the CPU is halted. Returns at
+// once if an interrupt is already waiting, even if interrupts are disabled.
+//
+// The CPU sets parked before checking for interrupts, and senders set interrupt_pending
+// before checking parked, so at least one side always sees the other.
+void StackCPUDevice::wait_for_interrupt() {
+    int64_t start = steady_nanoseconds();
+    {
+        unique_lock<mutex> lock(park_lock);
+        wake_requested.store(0, memory_order_relaxed);
+        parked.store(true, memory_order_seq_cst);
+        while (!interrupt_pending.load(memory_order_seq_cst)
+                && running.load(memory_order_seq_cst)) {
+            wake.wait(lock);
+        }
+        parked.store(false, memory_order_relaxed);
+    }
+    int64_t end = steady_nanoseconds();
+
+    idle_waits.store(idle_waits.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    idle_nanoseconds.store(idle_nanoseconds.load(memory_order_relaxed) + (end - start),
+                           memory_order_relaxed);
+    int64_t requested = wake_requested.load(memory_order_relaxed);
+    if (requested && end >= requested) {
+        uint64_t latency = end - requested;
+        idle_wakeups.store(idle_wakeups.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        wake_latency_nanoseconds.store(
+            wake_latency_nanoseconds.load(memory_order_relaxed) + latency, memory_order_relaxed);
+        if (latency > max_wake_latency_nanoseconds.load(memory_order_relaxed)) {
+            max_wake_latency_nanoseconds.store(latency, memory_order_relaxed);
+        }
+    }
+
+    // Time spent parked isn't owed to the clock.
+    start_clock();
 }
 
-template<typename T>
-int32_t StackCPUDevice::read() {
-    uint64_t addr;
-    pop<uint64_t>(addr);
-    T val;
-    auto read_result = mbfuncs.read_bytes(motherboard, addr, sizeof(val), (uint8_t*)(&val));
+// Called by senders after setting interrupt_pending or clearing running.
+void StackCPUDevice::wake_up() {
+    if (!parked.load(memory_order_seq_cst)) {
+        return;
+    }
+    int64_t expected = 0;
+    wake_requested.compare_exchange_strong(expected, steady_nanoseconds(),
+                                           memory_order_relaxed);
+    lock_guard<mutex> lock(park_lock);
+    wake.notify_one();
+}
+
+// Interrupts go to the handler at entry code of interrupt_table, which holds
+// interrupt_count 64 bit addresses. What the return from interrupt needs is pushed on the
+// interrupt stack, which grows down from interrupt_stack as the memory stack does from sp.
+// The handler starts with interrupts disabled, unprotected, and the code on the stack.
+int32_t StackCPUDevice::process_code(uint32_t code) {
+    if (!(settings & (1 << 0))) {
+        // Ignore if interrupts disabled -- this only affects software
+        // interrupts. Interrupt disable prevents popping from the interrupt vector for
+        // "hardware" interrupts.
+        return 0;
+    }
+    if (code >= interrupt_count) {
+        errors |= 1 << 1;
+        return 0;
+    }
+
+    uint64_t handler = 0;
+    auto read_result = read_memory(interrupt_table + uint64_t(code) * sizeof(handler),
+                                   sizeof(handler), (uint8_t*)(&handler));
     if (read_result) {
         return read_result;
     }
-    push<T>(val);
+
+    InterruptFrame frame = {ip, isp, spilled, settings, code};
+    interrupt_stack -= sizeof(frame);
+    auto write_result = write_memory(interrupt_stack, sizeof(frame), (uint8_t*)(&frame));
+    if (write_result) {
+        return write_result;
+    }
+    note_code_write(interrupt_stack, sizeof(frame));
+
+    settings &= ~((1 << 0) | (1 << 1));
+    ip = handler;
+    push<uint32_t>(code);
     return 0;
 }
 
-template<typename T>
-int32_t StackCPUDevice::read_immediate() {
-    T val;
-    auto read_result = mbfuncs.read_bytes(motherboard, ip, sizeof(val), (uint8_t*)(&val));
-    ip += sizeof(val);
+// Number of immediate bytes following an instruction's opcode and size.
+static uint8_t immediate_length(uint8_t instr, uint8_t size) {
+    if (instr != 'r') {
+        return 0;
+    }
+    switch (size) {
+    case 2: return sizeof(float);
+    case 3: return sizeof(uint8_t);
+    case 4: return sizeof(uint16_t);
+    case 5: return sizeof(uint32_t);
+    case 6: return sizeof(uint64_t);
+    case 7: return sizeof(double);
+    default: return 0;
+    }
+}
+
+// Instructions after which the next instruction is not necessarily the next one in
+// memory, or whose effect on the stack depends on run-time state.
+static bool ends_block(const DecodedInstruction& di) {
+    switch (di.instr) {
+    case 'J':
+    case 'I':
+    case 'i':
+    case 's':
+    case 'u':
+    case 'p':
+    case 'w':
+        return true;
+    case 'P':
+        // Compiled blocks count their instructions up front, so reading the count is
+        // only exact at the end of a block.
+        return di.size == 7;
+    default:
+        return false;
+    }
+}
+
+// Words occupied by a value of the given operand size, or 0 if the size is invalid.
+static uint32_t size_words(uint8_t size) {
+    switch (size) {
+    case 2:
+    case 3:
+    case 4:
+    case 5:
+        return 1;
+    case 6:
+    case 7:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+bool stack_effect(const DecodedInstruction& di, uint32_t& pops, uint32_t& pushes) {
+    // Invalid sizes only set an error bit, which leaves the stack alone.
+    uint32_t words = size_words(di.size);
+    pops = 0;
+    pushes = 0;
+    switch (di.instr) {
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '&':
+    case '|':
+    case '^':
+        pops = 2 * words;
+        pushes = words;
+        break;
+    case '~':
+    case '_':
+        pops = words;
+        pushes = words;
+        break;
+    case '<':
+    case '>':
+    case 'g':
+    case 'l':
+    case '=':
+    case '!':
+        pops = 2 * words;
+        pushes = words ? 1 : 0;
+        break;
+    case 'C':
+        pops = words;
+        pushes = 2 * words;
+        break;
+    case 'D':
+    case 'S':
+        pops = words;
+        break;
+    case '$':
+        pops = 2 * words;
+        pushes = 2 * words;
+        break;
+    case 'R':
+        pops = words ? 2 : 0;
+        pushes = words;
+        break;
+    case 'r':
+    case 'U':
+        pushes = words;
+        break;
+    case 'W':
+        pops = words ? 2 + words : 0;
+        break;
+    case 'z':
+        if (!(di.size >> 6) && size_words(di.size & 7) && size_words((di.size >> 3) & 7)) {
+            pops = size_words(di.size & 7);
+            pushes = size_words((di.size >> 3) & 7);
+        }
+        break;
+    case 'P':
+        if (di.size <= 2 || di.size == 7 || di.size == 9) {
+            pushes = 2;
+        } else if (di.size <= 5 || di.size == 8) {
+            pushes = 1;
+        }
+        break;
+    case 'J':
+        pops = 3;
+        break;
+    case 'I':
+        pops = 1;
+        break;
+    case 'i':
+    case 's':
+    case 'u':
+    case 'p':
+        return false;
+    }
+    return true;
+}
+
+static void resolve_cached_handlers(vector<DecodedInstruction>& instructions);
+
+static inline uint32_t block_cache_index(uint64_t addr) {
+    return (addr ^ (addr >> code_page_bits)) & (block_cache_size - 1);
+}
+
+int32_t StackCPUDevice::process_block() {
+    BasicBlock* block;
+    auto fetch_result = fetch_block(block);
+    if (fetch_result) {
+        return fetch_result;
+    }
+    ++block->runs;
+
+    if (jit_mode != stack_cpu_jit_off && !tracer) {
+        if (!block->native && ++block->executions >= jit_threshold) {
+            compile_block(*block);
+        }
+        // Compiled code doesn't check the stack, so anything that might underflow or
+        // overflow is left to the interpreter to report.
+        if (block->native && isp >= block->stack_needed
+                && uint64_t(isp) + block->stack_growth <= stack_size) {
+            if (jit_mode == stack_cpu_jit_differential) {
+                return run_differential(*block);
+            }
+            // Close enough for the clock, even if the block is cut short.
+            instructions += block->instructions.size();
+            return block->native(this);
+        }
+    }
+    return interpret_block(*block);
+}
+
+int32_t StackCPUDevice::interpret_block(BasicBlock& block) {
+    // If the stack can take everything the block does to it, nothing inside can underflow
+    // or overflow and the handlers needn't check. Otherwise they do, so the errors come
+    // out just as they would one instruction at a time. Tracing looks at the stack array
+    // before each instruction, so it's kept up to date.
+    if (isp >= block.stack_needed && uint64_t(isp) + block.stack_growth <= stack_size) {
+        return tracer ? run_block<false>(block) : run_cached_block(block);
+    }
+    return run_block<true>(block);
+}
+
+template<bool checked>
+int32_t StackCPUDevice::run_block(BasicBlock& block) {
+    for (const auto& di : block.instructions) {
+        if (tracer) {
+            trace_instruction(di);
+        }
+        ip += di.length;
+        ++instructions;
+        auto res = checked ? di.handler(this, di) : di.unchecked(this, di);
+        if (res) {
+            return res;
+        }
+        // A write may have landed on this block; the rest of it is stale.
+        if (!block.valid) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int32_t StackCPUDevice::fetch_block(BasicBlock*& block) {
+    block = &block_cache[block_cache_index(ip)];
+    if (block->valid && block->start == ip) {
+        return 0;
+    }
+    return decode_block(*block, ip);
+}
+
+int32_t StackCPUDevice::decode_block(BasicBlock& block, uint64_t start) {
+    // Whatever was here before still has runs to count.
+    count_opcodes(block);
+    block.valid = false;
+    block.instructions.clear();
+
+    // Fetch the rest of the page in one go, plus enough to finish an instruction that
+    // straddles the end of it, but never past the end of the mapped block.
+    uint64_t to_page_end = code_page_size - (start & (code_page_size - 1));
+    uint64_t to_window_end = 0x100000000ull - (start & 0xFFFFFFFFull);
+    uint32_t fetch_length = min(to_page_end + max_instruction_length - 1, to_window_end);
+
+    // Bytes the motherboard can't fill decode as NOPs.
+    uint8_t code[code_page_size + max_instruction_length] = {0};
+    auto read_result = read_memory(start, fetch_length, code);
     if (read_result) {
-        throw read_result;
+        return read_result;
+    }
+
+    uint64_t offset = 0;
+    while (block.instructions.size() < max_block_length) {
+        DecodedInstruction di;
+        di.instr = code[offset];
+        di.size = code[offset + 1];
+        di.handler = resolve_handler(di.instr, di.size);
+        di.unchecked = resolve_handler(di.instr, di.size, false);
+        uint8_t imm_length = immediate_length(di.instr, di.size);
+        di.length = 2 + imm_length;
+        memset(di.immediate, 0, sizeof(di.immediate));
+        memcpy(di.immediate, &code[offset + 2], imm_length);
+
+        block.instructions.push_back(di);
+        offset += di.length;
+
+        if (ends_block(di) || offset >= to_page_end) {
+            break;
+        }
+    }
+    resolve_cached_handlers(block.instructions);
+
+    int64_t depth = 0, lowest = 0, highest = 0;
+    for (auto& di : block.instructions) {
+        uint32_t pops, pushes;
+        if (!stack_effect(di, pops, pushes)) {
+            // Only the last instruction can get here, and its stack use isn't covered by
+            // the check on entry, so it keeps its checks.
+            di.unchecked = di.handler;
+            break;
+        }
+        depth -= pops;
+        lowest = min(lowest, depth);
+        depth += pushes;
+        highest = max(highest, depth);
     }
-    push<T>(val);
+    block.stack_needed = -lowest;
+    block.stack_growth = highest;
+    block.executions = 0;
+    block.native = 0;
+
+    block.start = start;
+    block.first_page = start >> code_page_bits;
+    block.last_page = (start + offset - 1) >> code_page_bits;
+    track_code_pages(block);
+    block.valid = true;
     return 0;
 }
 
+void StackCPUDevice::track_code_pages(const BasicBlock& block) {
+    for (uint64_t page = block.first_page; page <= block.last_page; ++page) {
+        code_pages.insert(page);
+        code_page_filter |= 1ull << (page & 63);
+    }
+}
+
+void StackCPUDevice::compile_block(BasicBlock& block) {
+    block.native = jit.compile(this, block);
+    if (!block.native) {
+        // Out of room; start over with an empty arena.
+        flush_native_code();
+        block.native = jit.compile(this, block);
+    }
+}
+
+void StackCPUDevice::flush_native_code() {
+    for (auto& block : block_cache) {
+        block.native = 0;
+        block.executions = 0;
+    }
+    jit.clear();
+}
+
+// Differential mode
+//
+// Runs a compiled block through the interpreter first, then puts the CPU back and runs
+// the compiled code from the same state. The interpreter's memory accesses go to the
+// motherboard and are recorded; the compiled code's are answered from the recording, so
+// both tiers see the same memory and the rest of the machine only sees the block run once.
+
+struct MemoryAccess {
+    bool write;
+    uint64_t addr;
+    vector<uint8_t> data;
+    int32_t result;
+};
+
+struct MemoryLog {
+    void* motherboard;
+    MotherboardFunctions mbfuncs;
+    bool replaying;
+    size_t next;
+    // Set if the replayed accesses didn't match the recorded ones.
+    bool diverged;
+    vector<MemoryAccess> accesses;
+};
+
+static int32_t logged_access(void* log_ptr, bool write, uint64_t addr, uint32_t len, uint8_t* buf) {
+    MemoryLog* log = static_cast<MemoryLog*>(log_ptr);
+    if (!log->replaying) {
+        MemoryAccess access;
+        access.write = write;
+        access.addr = addr;
+        if (write) {
+            access.result = log->mbfuncs.write_bytes(log->motherboard, addr, len, buf);
+        } else {
+            access.result = log->mbfuncs.read_bytes(log->motherboard, addr, len, buf);
+        }
+        access.data.assign(buf, buf + len);
+        log->accesses.push_back(access);
+        return access.result;
+    }
+
+    if (log->next >= log->accesses.size()) {
+        log->diverged = true;
+        return jit_mismatch_error;
+    }
+    const auto& access = log->accesses[log->next++];
+    if (access.write != write || access.addr != addr || access.data.size() != len) {
+        log->diverged = true;
+        return jit_mismatch_error;
+    }
+    if (write) {
+        if (memcmp(access.data.data(), buf, len)) {
+            log->diverged = true;
+        }
+    } else {
+        memcpy(buf, access.data.data(), len);
+    }
+    return access.result;
+}
+
+static int32_t logged_read(void* log, uint64_t addr, uint32_t len, uint8_t* buf) {
+    return logged_access(log, false, addr, len, buf);
+}
+
+static int32_t logged_write(void* log, uint64_t addr, uint32_t len, uint8_t* buf) {
+    return logged_access(log, true, addr, len, buf);
+}
+
+// Everything about the CPU a block can change.
+struct CPUState {
+    uint32_t isp;
+    uint64_t ip;
+    uint64_t sp;
+    uint32_t spilled;
+    uint64_t interrupt_stack;
+    uint64_t interrupt_table;
+    uint32_t interrupt_count;
+    uint64_t interrupt_mask;
+    uint32_t settings;
+    uint32_t errors;
+    vector<uint32_t> stack;
+
+    void save(const StackCPUDevice& cpu) {
+        isp = cpu.isp;
+        ip = cpu.ip;
+        sp = cpu.sp;
+        spilled = cpu.spilled;
+        interrupt_stack = cpu.interrupt_stack;
+        interrupt_table = cpu.interrupt_table;
+        interrupt_count = cpu.interrupt_count;
+        interrupt_mask = cpu.interrupt_mask;
+        settings = cpu.settings;
+        errors = cpu.errors;
+        stack.assign(cpu.stack, cpu.stack + cpu.stack_size);
+    }
+
+    void load(StackCPUDevice& cpu) const {
+        cpu.isp = isp;
+        cpu.ip = ip;
+        cpu.sp = sp;
+        cpu.spilled = spilled;
+        cpu.interrupt_stack = interrupt_stack;
+        cpu.interrupt_table = interrupt_table;
+        cpu.interrupt_count = interrupt_count;
+        cpu.interrupt_mask = interrupt_mask;
+        cpu.settings = settings;
+        cpu.errors = errors;
+        copy(stack.begin(), stack.end(), cpu.stack);
+    }
+
+    bool operator==(const CPUState& other) const {
+        return isp == other.isp && ip == other.ip && sp == other.sp
+            && spilled == other.spilled && interrupt_stack == other.interrupt_stack
+            && interrupt_table == other.interrupt_table
+            && interrupt_count == other.interrupt_count
+            && interrupt_mask == other.interrupt_mask && settings == other.settings
+            && errors == other.errors && stack == other.stack;
+    }
+};
+
+int32_t StackCPUDevice::run_differential(BasicBlock& block) {
+    MemoryLog log;
+    log.motherboard = motherboard;
+    log.mbfuncs = mbfuncs;
+    log.replaying = false;
+    log.next = 0;
+    log.diverged = false;
+
+    // Direct mappings would bypass the log.
+    MemoryWindow windows[memory_window_cache_size];
+    memcpy(windows, memory_windows, sizeof(windows));
+    forget_memory_windows();
+    motherboard = &log;
+    mbfuncs.read_bytes = &logged_read;
+    mbfuncs.write_bytes = &logged_write;
+    mbfuncs.map_bytes = 0;
+    mbfuncs.read_bytes_v = 0;
+    mbfuncs.write_bytes_v = 0;
+
+    CPUState before, expected, actual;
+    before.save(*this);
+    auto expected_result = interpret_block(block);
+    expected.save(*this);
+    bool expected_valid = block.valid;
+
+    // Undo any invalidation too, so the compiled code sees its own writes land.
+    before.load(*this);
+    if (!block.valid) {
+        block.valid = true;
+        track_code_pages(block);
+    }
+    log.replaying = true;
+    auto actual_result = block.native(this);
+    actual.save(*this);
+
+    motherboard = log.motherboard;
+    mbfuncs = log.mbfuncs;
+    memcpy(memory_windows, windows, sizeof(windows));
+
+    if (log.diverged || log.next != log.accesses.size() || actual_result != expected_result
+            || block.valid != expected_valid || !(actual == expected)) {
+        cout << "Stack CPU JIT mismatch in block at 0x" << hex << block.start << dec
+             << ": interpreter ip " << expected.ip << " isp " << expected.isp
+             << " errors " << expected.errors << " result " << expected_result
+             << ", compiled ip " << actual.ip << " isp " << actual.isp
+             << " errors " << actual.errors << " result " << actual_result << endl;
+        return jit_mismatch_error;
+    }
+    return expected_result;
+}
+
+// Memory
+//
+// Reads and writes go straight to host memory when the motherboard can map them, and
+// through the motherboard's callbacks otherwise.
+
+const MemoryWindow& StackCPUDevice::memory_window(uint64_t addr) {
+    uint64_t window = addr >> 32;
+    MemoryWindow& entry = memory_windows[window % memory_window_cache_size];
+    if (entry.resolved && entry.window == window) {
+        return entry;
+    }
+
+    entry.resolved = true;
+    entry.window = window;
+    entry.base = 0;
+    entry.length = 0;
+    entry.flags = 0;
+    if (mbfuncs.map_bytes
+            && mbfuncs.map_bytes(motherboard, window << 32, &entry.base, &entry.length, &entry.flags)) {
+        // Leave errors for the callbacks to report.
+        entry.base = 0;
+        entry.length = 0;
+        entry.flags = 0;
+    }
+    return entry;
+}
+
+void StackCPUDevice::forget_memory_windows() {
+    for (auto& entry : memory_windows) {
+        entry.resolved = false;
+    }
+}
+
+int32_t StackCPUDevice::read_memory(uint64_t addr, uint32_t len, uint8_t* dest) {
+    const auto& window = memory_window(addr);
+    uint32_t offset = addr;
+    if ((window.flags & bscomp_map_readable) && offset < window.length
+            && len <= window.length - offset) {
+        memcpy(dest, window.base + offset, len);
+        return 0;
+    }
+    return mbfuncs.read_bytes(motherboard, addr, len, dest);
+}
+
+int32_t StackCPUDevice::write_memory(uint64_t addr, uint32_t len, uint8_t* src) {
+    const auto& window = memory_window(addr);
+    uint32_t offset = addr;
+    if ((window.flags & bscomp_map_writable) && offset < window.length
+            && len <= window.length - offset) {
+        memcpy(window.base + offset, src, len);
+        return 0;
+    }
+    return mbfuncs.write_bytes(motherboard, addr, len, src);
+}
+
+// Reads or writes several ranges at once. Mapped memory is copied directly, and the rest
+// goes to the motherboard in one vectored call, or one call per range if it can't take
+// vectors.
+int32_t StackCPUDevice::transfer_memory(const MemorySegment* segments, uint32_t count, bool write) {
+    uint32_t needed = write ? bscomp_map_writable : bscomp_map_readable;
+    memory_segments.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        MemorySegment segment = segments[i];
+        while (segment.length) {
+            // Split at window boundaries, so each piece belongs to one device.
+            uint32_t offset = segment.address;
+            uint32_t length = segment.length;
+            if (uint64_t(offset) + length > 1ull << 32) {
+                length = (1ull << 32) - offset;
+            }
+
+            const auto& window = memory_window(segment.address);
+            if ((window.flags & needed) && offset < window.length
+                    && length <= window.length - offset) {
+                if (write) {
+                    memcpy(window.base + offset, segment.buffer, length);
+                } else {
+                    memcpy(segment.buffer, window.base + offset, length);
+                }
+            } else {
+                memory_segments.push_back({segment.address, length, segment.buffer});
+            }
+            segment.address += length;
+            segment.length -= length;
+            segment.buffer += length;
+        }
+    }
+
+    if (memory_segments.empty()) {
+        return 0;
+    }
+    auto vectored = write ? mbfuncs.write_bytes_v : mbfuncs.read_bytes_v;
+    if (vectored) {
+        return vectored(motherboard, memory_segments.data(), memory_segments.size());
+    }
+    for (const auto& segment : memory_segments) {
+        auto result = write
+            ? mbfuncs.write_bytes(motherboard, segment.address, segment.length, segment.buffer)
+            : mbfuncs.read_bytes(motherboard, segment.address, segment.length, segment.buffer);
+        if (result) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+void StackCPUDevice::note_code_write(uint64_t addr, uint32_t len) {
+    if (!len) {
+        return;
+    }
+    uint64_t first_page = addr >> code_page_bits;
+    uint64_t last_page = (addr + len - 1) >> code_page_bits;
+    for (uint64_t page = first_page; page <= last_page; ++page) {
+        if ((code_page_filter & (1ull << (page & 63))) && code_pages.count(page)) {
+            invalidate_code_page(page);
+        }
+    }
+}
+
+void StackCPUDevice::invalidate_code_page(uint64_t page) {
+    for (auto& block : block_cache) {
+        if (block.valid && block.first_page <= page && page <= block.last_page) {
+            block.valid = false;
+        }
+    }
+    code_pages.erase(page);
+}
+
+void StackCPUDevice::flush_block_cache() {
+    for (auto& block : block_cache) {
+        block.valid = false;
+    }
+    code_pages.clear();
+    code_page_filter = 0;
+}
+
+#define PROTECT if (settings & (1<<1)) {        \
+        errors |= 1 << 4;                       \
+        return 0;                               \
+    } else {
+
+#define ENDPROTECT }
+
+// Values take one word, or two for 64 bit types. Unchecked pops and pushes are for blocks
+// whose stack use was checked on entry, and can't underflow or overflow.
 template<typename T>
+static constexpr uint32_t words_of() {
+    return sizeof(T) > sizeof(uint32_t) ? 2 : 1;
+}
+
+template<typename T, bool checked>
+void StackCPUDevice::pop(T& dest) {
+    static_assert(sizeof(T) <= sizeof(uint64_t), "Dest must be no more than 8 bytes.");
+    if (checked && isp < words_of<T>() && !fill_stack(words_of<T>())) {
+        errors |= 1 << 2;
+        return;
+    }
+    isp -= words_of<T>();
+    memcpy(&dest, &stack[isp], sizeof(T));
+}
+
+template<typename T, bool checked>
+void StackCPUDevice::push(T source) {
+    static_assert(sizeof(T) <= sizeof(uint64_t), "Source must be no more than 8 bytes.");
+    if (checked && isp + words_of<T>() > stack_size && !spill_stack(words_of<T>())) {
+        errors |= 1 << 3;
+        return;
+    }
+    memcpy(&stack[isp], &source, sizeof(T));
+    isp += words_of<T>();
+}
+
+// The stack cache moves half the internal stack at a time, so a stack going up and down
+// across the limit doesn't spill and fill on every push and pop. Spilled words go on the
+// memory stack most recent half first, each half in the same order as on the internal
+// stack, as shift_all would leave them but without the count.
+
+// Brings back the most recently spilled words, under what's left on the internal stack,
+// so at least words are there to pop. Returns false if there aren't enough.
+bool StackCPUDevice::fill_stack(uint32_t words) {
+    if (!(settings & (1 << 2)) || !spilled) {
+        return false;
+    }
+    uint32_t filled = min(spilled, stack_size / 2);
+    if (isp + filled < words || isp + filled > stack_size) {
+        return false;
+    }
+
+    memmove(&stack[filled], stack, isp * sizeof(uint32_t));
+    MemorySegment segment = {sp, filled * uint32_t(sizeof(uint32_t)), (uint8_t*)stack};
+    if (transfer_memory(&segment, 1, false)) {
+        memmove(stack, &stack[filled], isp * sizeof(uint32_t));
+        return false;
+    }
+    sp += segment.length;
+    spilled -= filled;
+    isp += filled;
+    return true;
+}
+
+// Writes out the bottom of the internal stack, in one go, to make room for words more.
+// Returns false if it can't.
+bool StackCPUDevice::spill_stack(uint32_t words) {
+    if (!(settings & (1 << 2))) {
+        return false;
+    }
+    uint32_t spill = stack_size / 2;
+    if (isp < spill || isp - spill + words > stack_size) {
+        return false;
+    }
+
+    MemorySegment segment = {sp - spill * sizeof(uint32_t), spill * uint32_t(sizeof(uint32_t)),
+                             (uint8_t*)stack};
+    if (transfer_memory(&segment, 1, true)) {
+        return false;
+    }
+    sp = segment.address;
+    spilled += spill;
+    note_code_write(sp, segment.length);
+
+    isp -= spill;
+    memmove(stack, &stack[spill], isp * sizeof(uint32_t));
+    return true;
+}
+
+#define BINARY_OPERATOR(opname, OP)                        \
+    template<typename T, bool checked>                     \
+    int32_t StackCPUDevice::opname() {                     \
+        T a = 0, b = 0;                                    \
+        pop<T, checked>(a);                                \
+        pop<T, checked>(b);                                \
+        push<T, checked>(a OP b);                          \
+        return 0;                                          \
+    }
+
+BINARY_OPERATOR(add, +)
+BINARY_OPERATOR(subtract, -)
+BINARY_OPERATOR(multiply, *)
+BINARY_OPERATOR(divide, /)
+BINARY_OPERATOR(and_, &)
+BINARY_OPERATOR(or_, |)
+BINARY_OPERATOR(xor_, ^)
+
+#define BINARY_COMPARISON(opname, OP)                      \
+    template<typename T, bool checked>                     \
+    int32_t StackCPUDevice::opname() {                     \
+        T a = 0, b = 0;                                    \
+        pop<T, checked>(a);                                \
+        pop<T, checked>(b);                                \
+        push<int32_t, checked>(a OP b);                    \
+        return 0;                                          \
+    }
+
+BINARY_COMPARISON(le, <=)
+BINARY_COMPARISON(lt, <)
+BINARY_COMPARISON(eq, ==)
+BINARY_COMPARISON(neq, !=)
+BINARY_COMPARISON(gt, >)
+BINARY_COMPARISON(ge, >=)
+
+template<typename T, bool checked>
+int32_t StackCPUDevice::not_() {
+    T a = 0;
+    pop<T, checked>(a);
+    push<T, checked>(~a);
+    return 0;
+}
+
+template<typename T, bool checked>
+int32_t StackCPUDevice::negate() {
+    T a = 0;
+    pop<T, checked>(a);
+    push<T, checked>(-a);
+    return 0;
+}
+
+template<typename T, bool checked>
+int32_t StackCPUDevice::copy() {
+    T a = 0;
+    pop<T, checked>(a);
+    push<T, checked>(a);
+    push<T, checked>(a);
+    return 0;
+}
+
+template<typename T, bool checked>
+int32_t StackCPUDevice::discard() {
+    T a = 0;
+    pop<T, checked>(a);
+    return 0;
+}
+
+template<typename T, bool checked>
+int32_t StackCPUDevice::read() {
+    uint64_t addr = 0;
+    pop<uint64_t, checked>(addr);
+    T val = 0;
+    auto read_result = read_memory(addr, sizeof(val), (uint8_t*)(&val));
+    if (read_result) {
+        return read_result;
+    }
+    push<T, checked>(val);
+    return 0;
+}
+
+template<typename T, bool checked>
+int32_t StackCPUDevice::read_immediate(const uint8_t* immediate) {
+    T val = 0;
+    memcpy(&val, immediate, sizeof(val));
+    push<T, checked>(val);
+    return 0;
+}
+
+template<typename T, bool checked>
 int32_t StackCPUDevice::write() {
-    uint64_t addr;
-    pop<uint64_t>(addr);
-    T val;
-    pop<T>(val);
-    auto write_result = mbfuncs.write_bytes(motherboard, addr, sizeof(val), (uint8_t*)(&val));
+    uint64_t addr = 0;
+    pop<uint64_t, checked>(addr);
+    T val = 0;
+    pop<T, checked>(val);
+    auto write_result = write_memory(addr, sizeof(val), (uint8_t*)(&val));
     if (write_result) {
         return write_result;
     }
+    note_code_write(addr, sizeof(val));
     return 0;
 }
 
-template<typename T>
+template<typename T, bool checked>
 int32_t StackCPUDevice::shift() {
-    T val;
-    pop<T>(val);
+    T val = 0;
+    pop<T, checked>(val);
     sp -= sizeof(val);
-    auto write_result = mbfuncs.write_bytes(motherboard, sp, sizeof(val), (uint8_t*)(&val));
+    auto write_result = write_memory(sp, sizeof(val), (uint8_t*)(&val));
     if (write_result) {
         return write_result;
     }
+    note_code_write(sp, sizeof(val));
     return 0;
 }
 
-template<typename T>
+template<typename T, bool checked>
 int32_t StackCPUDevice::unshift() {
-    T val;
-    auto read_result = mbfuncs.read_bytes(motherboard, sp, sizeof(val), (uint8_t*)(&val));
+    T val = 0;
+    auto read_result = read_memory(sp, sizeof(val), (uint8_t*)(&val));
     if (read_result) {
         return read_result;
     }
-    push<T>(val);
+    push<T, checked>(val);
     return 0;
 }
 
+// Popping every word onto the memory stack leaves them in memory in the same order as
+// on the internal stack, above the count, so it all goes in one write.
 int32_t StackCPUDevice::shift_all() {
-    uint32_t val;
     uint32_t stack_pointer = isp;
-    while (isp != 0) {
-        pop<uint32_t>(val);
-        sp -= sizeof(val);
-        auto write_result = mbfuncs.write_bytes(motherboard, sp, sizeof(val), (uint8_t*)(&val));
-        if (write_result) {
-            return write_result;
-        }
+    uint32_t length = (stack_pointer + 1) * sizeof(uint32_t);
+    sp -= length;
+    MemorySegment segments[] = {
+        {sp, sizeof(stack_pointer), (uint8_t*)(&stack_pointer)},
+        {sp + sizeof(stack_pointer), stack_pointer * uint32_t(sizeof(uint32_t)), (uint8_t*)stack},
+    };
+    auto write_result = transfer_memory(segments, 2, true);
+    if (write_result) {
+        return write_result;
     }
-    sp -= sizeof(stack_pointer);
-    auto write_result = mbfuncs.write_bytes(motherboard, sp, sizeof(stack_pointer), (uint8_t*)(&stack_pointer));
-    return write_result;
+    isp = 0;
+    note_code_write(sp, length);
+    return 0;
 }
 
+// Reads the count, then every word straight onto the internal stack. Words which don't
+// fit are skipped and overflow the stack, as pushing them one at a time would.
 int32_t StackCPUDevice::unshift_all() {
     uint32_t stack_pointer;
-    uint32_t val;
-    auto read_result = mbfuncs.read_bytes(motherboard, sp, sizeof(stack_pointer), (uint8_t*)(&stack_pointer));
+    auto read_result = read_memory(sp, sizeof(stack_pointer), (uint8_t*)(&stack_pointer));
     if (read_result) {
         return read_result;
     }
     sp += sizeof(stack_pointer);
-    for (uint32_t i = 0; i < stack_pointer; i++) {
-        read_result = mbfuncs.read_bytes(motherboard, sp, sizeof(val), (uint8_t*)(&val));
-        if (read_result) {
-            return read_result;
-        }
-        sp += sizeof(val);
-        push<uint32_t>(val);
+
+    uint32_t words = min(stack_pointer, stack_size - isp);
+    MemorySegment segment = {sp, words * uint32_t(sizeof(uint32_t)), (uint8_t*)(&stack[isp])};
+    read_result = transfer_memory(&segment, 1, false);
+    if (read_result) {
+        return read_result;
     }
+    isp += words;
+    if (words < stack_pointer) {
+        errors |= 1 << 3;
+    }
+    sp += uint64_t(stack_pointer) * sizeof(uint32_t);
     return 0;
 }
 
+template<bool checked>
 int32_t StackCPUDevice::read_register(uint8_t arg) {
     switch (arg) {
     case 0: // Stack Pointer
-        push<uint64_t>(sp);
+        push<uint64_t, checked>(sp);
         break;
     case 1: // Interrupt Stack Start
-        push<uint64_t>(interrupt_stack);
+        push<uint64_t, checked>(interrupt_stack);
         break;
     case 2: // Interrupt Table
-        push<uint64_t>(interrupt_table);
+        push<uint64_t, checked>(interrupt_table);
         break;
     case 3: // Interrupt Count
-        push<uint32_t>(interrupt_count);
+        push<uint32_t, checked>(interrupt_count);
         break;
     case 4: // Settings
-        push<uint32_t>(settings);
+        push<uint32_t, checked>(settings);
         break;
     case 5: // Errors
-        push<uint32_t>(errors);
+        push<uint32_t, checked>(errors);
+        break;
+    case 7: // Instructions
+        // Read-only. Instructions run since the last reset, including this one.
+        push<uint64_t, checked>(instructions);
+        break;
+    case 8: // Spilled Words
+        push<uint32_t, checked>(spilled);
+        break;
+    case 9: // Interrupt Mask
+        push<uint64_t, checked>(interrupt_mask);
         break;
     default:
         errors |= 1 << 1;
@@ -836,6 +1799,33 @@ int32_t StackCPUDevice::write_register(uint8_t arg) {
     case 5: // Errors
         pop<uint32_t>(errors);
         break;
+    case 6: // Instruction Cache
+        // Write-only. Drops any decoded code on the page holding the popped address, or
+        // all decoded code if the address is all ones. Needed after other devices write
+        // code into memory this CPU may already have run.
+        {
+            uint64_t addr = 0;
+            pop<uint64_t>(addr);
+            if (addr == ~0ull) {
+                flush_block_cache();
+            } else {
+                note_code_write(addr, 1);
+            }
+        }
+        break;
+    case 8: // Spilled Words
+        // Saved and restored with the stack pointer when switching stacks.
+        pop<uint32_t>(spilled);
+        break;
+    case 9: // Interrupt Mask
+        PROTECT
+        pop<uint64_t>(interrupt_mask);
+        // Lines left pending while masked are only looked for when something is sent.
+        if (pending_lines.load(memory_order_relaxed) & ~interrupt_mask) {
+            interrupt_pending.store(true, memory_order_relaxed);
+        }
+        ENDPROTECT
+        break;
     default:
         errors |= 1 << 1;
     }
@@ -843,39 +1833,762 @@ int32_t StackCPUDevice::write_register(uint8_t arg) {
     return 0;
 }
 
-template<typename T, typename U>
+template<typename T, typename U, bool checked>
 int32_t StackCPUDevice::resize() {
-    T original;
+    T original = 0;
     U replacement;
-    pop<T>(original);
+    pop<T, checked>(original);
     replacement = static_cast<U>(original);
-    push<U>(replacement);
+    push<U, checked>(replacement);
     return 0;
 }
 
-template<typename T>
+template<typename T, bool checked>
 int32_t StackCPUDevice::swap() {
-    T a, b;
-    pop<T>(a);
-    pop<T>(b);
-    push<T>(a);
-    push<T>(b);
+    T a = 0, b = 0;
+    pop<T, checked>(a);
+    pop<T, checked>(b);
+    push<T, checked>(a);
+    push<T, checked>(b);
     return 0;
 }
 
+template<bool checked>
 int32_t StackCPUDevice::jump() {
-    uint64_t addr;
-    int32_t condition;
-    pop(addr);
-    pop(condition);
+    uint64_t addr = 0;
+    int32_t condition = 0;
+    pop<uint64_t, checked>(addr);
+    pop<int32_t, checked>(condition);
     if (condition) {
         ip = addr;
     }
     return 0;
 }
 
+template<bool checked>
 int32_t StackCPUDevice::internal_interrupt() {
-    uint32_t code;
-    pop(code);
+    uint32_t code = 0;
+    pop<uint32_t, checked>(code);
     return process_code(code);
 }
+
+// Puts back the state the last interrupt taken saved, dropping whatever its handler left
+// on the stack.
+int32_t StackCPUDevice::return_from_interrupt() {
+    PROTECT
+    InterruptFrame frame;
+    auto read_result = read_memory(interrupt_stack, sizeof(frame), (uint8_t*)(&frame));
+    if (read_result) {
+        return read_result;
+    }
+    interrupt_stack += sizeof(frame);
+    ip = frame.ip;
+    settings = frame.settings;
+
+    // Anything the stack cache spilled while the handler ran comes back first, with the
+    // handler's words on top of it dropped to make room.
+    while (spilled > frame.spilled) {
+        uint64_t depth = uint64_t(frame.spilled) + frame.isp;
+        isp = depth > spilled ? min<uint64_t>(isp, depth - spilled) : 0;
+        if (!fill_stack(0)) {
+            errors |= 1 << 2;
+            break;
+        }
+    }
+    if (frame.isp <= stack_size) {
+        isp = frame.isp;
+    } else {
+        errors |= 1 << 1;
+    }
+    return 0;
+    ENDPROTECT
+}
+
+// Wait for interrupt. The CPU stops running instructions until a hardware interrupt is
+// waiting or it is halted, instead of spinning in an idle loop.
+int32_t StackCPUDevice::wait() {
+    idle = true;
+    return 0;
+}
+
+// Handlers
+//
+// Every opcode/size combination is resolved to one of these when its block is decoded, so
+// executing an instruction is a single indirect call.
+
+static int32_t handle_nop(StackCPUDevice*, const DecodedInstruction&) {
+    return 0;
+}
+
+static int32_t handle_invalid_command(StackCPUDevice* cpu, const DecodedInstruction&) {
+    cpu->errors |= 1 << 0;
+    return 0;
+}
+
+static int32_t handle_invalid_argument(StackCPUDevice* cpu, const DecodedInstruction&) {
+    cpu->errors |= 1 << 1;
+    return 0;
+}
+
+#define SIZED_HANDLER(OP)                                                   \
+    template<typename T, bool checked>                                      \
+    static int32_t handle_##OP(StackCPUDevice* cpu, const DecodedInstruction&) { \
+        return cpu->OP<T, checked>();                                       \
+    }
+
+SIZED_HANDLER(add)
+SIZED_HANDLER(subtract)
+SIZED_HANDLER(multiply)
+SIZED_HANDLER(divide)
+SIZED_HANDLER(and_)
+SIZED_HANDLER(or_)
+SIZED_HANDLER(xor_)
+SIZED_HANDLER(not_)
+SIZED_HANDLER(negate)
+SIZED_HANDLER(lt)
+SIZED_HANDLER(gt)
+SIZED_HANDLER(ge)
+SIZED_HANDLER(le)
+SIZED_HANDLER(eq)
+SIZED_HANDLER(neq)
+SIZED_HANDLER(copy)
+SIZED_HANDLER(discard)
+SIZED_HANDLER(read)
+SIZED_HANDLER(write)
+SIZED_HANDLER(shift)
+SIZED_HANDLER(unshift)
+SIZED_HANDLER(swap)
+
+template<typename T, bool checked>
+static int32_t handle_read_immediate(StackCPUDevice* cpu, const DecodedInstruction& di) {
+    return cpu->read_immediate<T, checked>(di.immediate);
+}
+
+template<typename T, typename U, bool checked>
+static int32_t handle_resize(StackCPUDevice* cpu, const DecodedInstruction&) {
+    return cpu->resize<T, U, checked>();
+}
+
+// Shift-all and unshift-all ignore simulator errors from the motherboard.
+static int32_t handle_shift_all(StackCPUDevice* cpu, const DecodedInstruction&) {
+    cpu->shift_all();
+    return 0;
+}
+
+static int32_t handle_unshift_all(StackCPUDevice* cpu, const DecodedInstruction&) {
+    cpu->unshift_all();
+    return 0;
+}
+
+template<bool checked>
+static int32_t handle_read_register(StackCPUDevice* cpu, const DecodedInstruction& di) {
+    return cpu->read_register<checked>(di.size);
+}
+
+static int32_t handle_write_register(StackCPUDevice* cpu, const DecodedInstruction& di) {
+    return cpu->write_register(di.size);
+}
+
+template<bool checked>
+static int32_t handle_jump(StackCPUDevice* cpu, const DecodedInstruction&) {
+    return cpu->jump<checked>();
+}
+
+template<bool checked>
+static int32_t handle_interrupt(StackCPUDevice* cpu, const DecodedInstruction&) {
+    return cpu->internal_interrupt<checked>();
+}
+
+static int32_t handle_return_from_interrupt(StackCPUDevice* cpu, const DecodedInstruction&) {
+    return cpu->return_from_interrupt();
+}
+
+static int32_t handle_wait(StackCPUDevice* cpu, const DecodedInstruction&) {
+    return cpu->wait();
+}
+
+// Sizes: 2 float, 3 u8, 4 u16, 5 u32, 6 u64, 7 double. ARG is the handlers' last
+// template argument.
+#define SIZED_ROW(instr, OP, ARG)            \
+    fill_sized(instr);                       \
+    sized[instr][2] = &OP<float, ARG>;       \
+    sized[instr][3] = &OP<uint8_t, ARG>;     \
+    sized[instr][4] = &OP<uint16_t, ARG>;    \
+    sized[instr][5] = &OP<uint32_t, ARG>;    \
+    sized[instr][6] = &OP<uint64_t, ARG>;    \
+    sized[instr][7] = &OP<double, ARG>;
+
+// Bitwise operations treat float sizes as integers of the same width.
+#define NOFLOAT_ROW(instr, OP, ARG)          \
+    fill_sized(instr);                       \
+    sized[instr][2] = &OP<uint32_t, ARG>;    \
+    sized[instr][3] = &OP<uint8_t, ARG>;     \
+    sized[instr][4] = &OP<uint16_t, ARG>;    \
+    sized[instr][5] = &OP<uint32_t, ARG>;    \
+    sized[instr][6] = &OP<uint64_t, ARG>;    \
+    sized[instr][7] = &OP<uint64_t, ARG>;
+
+#define RESIZE_ROW(from, T, OP, ARG)         \
+    resize[from][2] = &OP<T, float, ARG>;    \
+    resize[from][3] = &OP<T, uint8_t, ARG>;  \
+    resize[from][4] = &OP<T, uint16_t, ARG>; \
+    resize[from][5] = &OP<T, uint32_t, ARG>; \
+    resize[from][6] = &OP<T, uint64_t, ARG>; \
+    resize[from][7] = &OP<T, double, ARG>;
+
+// Handler for every opcode at every size below 8, built at compile time, either checked
+// or unchecked. Sizes above that are only meaningful to opcodes which ignore their size or
+// use it as a plain argument; those have the same handler in every column, so column 0
+// stands in for them.
+template<bool checked>
+struct HandlerTable {
+    Handler sized[256][8];
+    // Resize, indexed by [old size][new size].
+    Handler resize[8][8];
+
+    constexpr HandlerTable() : sized(), resize() {
+        for (int instr = 0; instr < 256; ++instr) {
+            fill(instr, &handle_invalid_command);
+        }
+        for (int from = 0; from < 8; ++from) {
+            for (int to = 0; to < 8; ++to) {
+                resize[from][to] = &handle_invalid_argument;
+            }
+        }
+
+        fill(0, &handle_nop);
+        SIZED_ROW('+', handle_add, checked)
+        SIZED_ROW('-', handle_subtract, checked)
+        SIZED_ROW('*', handle_multiply, checked)
+        SIZED_ROW('/', handle_divide, checked)
+        NOFLOAT_ROW('&', handle_and_, checked)
+        NOFLOAT_ROW('|', handle_or_, checked)
+        NOFLOAT_ROW('^', handle_xor_, checked)
+        NOFLOAT_ROW('~', handle_not_, checked)
+        SIZED_ROW('_', handle_negate, checked)
+        SIZED_ROW('<', handle_lt, checked)
+        SIZED_ROW('>', handle_gt, checked)
+        SIZED_ROW('g', handle_ge, checked)
+        SIZED_ROW('l', handle_le, checked)
+        SIZED_ROW('=', handle_eq, checked)
+        SIZED_ROW('!', handle_neq, checked)
+        SIZED_ROW('C', handle_copy, checked)
+        SIZED_ROW('D', handle_discard, checked)
+        SIZED_ROW('R', handle_read, checked)
+        SIZED_ROW('r', handle_read_immediate, checked)
+        SIZED_ROW('W', handle_write, checked)
+        SIZED_ROW('S', handle_shift, checked)
+        SIZED_ROW('U', handle_unshift, checked)
+        fill('s', &handle_shift_all);
+        fill('u', &handle_unshift_all);
+        fill('P', &handle_read_register<checked>);
+        fill('p', &handle_write_register);
+        // Resize is looked up in the resize table instead.
+        fill_sized('z');
+        SIZED_ROW('$', handle_swap, checked)
+        fill('J', &handle_jump<checked>);
+        fill('I', &handle_interrupt<checked>);
+        fill('i', &handle_return_from_interrupt);
+        fill('w', &handle_wait);
+
+        RESIZE_ROW(2, float, handle_resize, checked)
+        RESIZE_ROW(3, uint8_t, handle_resize, checked)
+        RESIZE_ROW(4, uint16_t, handle_resize, checked)
+        RESIZE_ROW(5, uint32_t, handle_resize, checked)
+        RESIZE_ROW(6, uint64_t, handle_resize, checked)
+        RESIZE_ROW(7, double, handle_resize, checked)
+    }
+
+    constexpr void fill(int instr, Handler handler) {
+        for (int size = 0; size < 8; ++size) {
+            sized[instr][size] = handler;
+        }
+    }
+
+    // Start a sized opcode off with every size invalid.
+    constexpr void fill_sized(int instr) {
+        fill(instr, &handle_invalid_argument);
+    }
+};
+
+static constexpr HandlerTable<true> handlers{};
+static constexpr HandlerTable<false> unchecked_handlers{};
+
+template<bool checked>
+static Handler lookup_handler(const HandlerTable<checked>& table, uint8_t instr, uint8_t size) {
+    if (instr == 'z') {
+        // OLDSIZE = size & 0b111, NEWSIZE = (size & 0b111000) >> 3
+        if (size >> 6) {
+            return &handle_invalid_argument;
+        }
+        return table.resize[size & 7][(size >> 3) & 7];
+    }
+    return table.sized[instr][size < 8 ? size : 0];
+}
+
+Handler resolve_handler(uint8_t instr, uint8_t size, bool checked) {
+    return checked ? lookup_handler(handlers, instr, size)
+        : lookup_handler(unchecked_handlers, instr, size);
+}
+
+// Top of stack caching
+//
+// A block entered with room for everything it does runs with the value on top of the
+// stack in a register: each handler takes it as an argument and hands it back with its
+// result, so the next instruction finds its top operand there instead of loading it back
+// from the stack array. 64 bit values are moved whole.
+//
+// The value is only written to the array, where push would have put it, once it's popped
+// or something else needs the array up to date. It still has to get there, as the
+// interpreter leaves popped values above isp and narrow pushes only overwrite part of a
+// slot, unless another push is about to cover it.
+//
+// How many bytes are cached before each instruction is known when its block is decoded,
+// and picks its handler, so none of them branch on it.
+//
+// Superinstructions
+//
+// Pairs of instructions which run one after the other often enough to be worth a handler
+// of their own, chosen from the opcode pairs `trace.py summary` reports for the fleet
+// corpus: a read-immediate feeding the operator after it, and a 64 bit read-immediate
+// giving the address for a jump, read or write. Between them they cover a quarter to a
+// third of the pairs in each workload. With the immediate pushed into the cached top, the
+// operator takes it straight back out, and the pair touches the array no more than the
+// operator alone would.
+
+static inline uint32_t value_words(size_t bytes) {
+    return bytes > sizeof(uint32_t) ? 2 : 1;
+}
+
+// Puts bytes of the top of the stack, cached in top, where push would have.
+template<uint32_t bytes>
+static inline void spill_top(StackCPUDevice* cpu, uint64_t top) {
+    if (bytes) {
+        memcpy(&cpu->stack[cpu->isp - value_words(bytes)], &top, bytes);
+    }
+}
+
+// Pops the value on top of the stack, whether it was cached or not. A cached value still
+// goes to the array, unless the caller is about to push at least as much over it.
+template<typename T, uint32_t bytes, bool replaced = false>
+static inline T pop_top(StackCPUDevice* cpu, uint64_t top) {
+    T value;
+    if (bytes == sizeof(T)) {
+        if (!replaced) {
+            spill_top<bytes>(cpu, top);
+        }
+        memcpy(&value, &top, sizeof(value));
+        cpu->isp -= words_of<T>();
+    } else {
+        spill_top<bytes>(cpu, top);
+        cpu->pop<T, false>(value);
+    }
+    return value;
+}
+
+// Pushes a value, leaving it cached. Anything cached before must be spilled first.
+template<typename T>
+static inline CachedResult push_top(StackCPUDevice* cpu, T value) {
+    uint64_t top = 0;
+    memcpy(&top, &value, sizeof(value));
+    cpu->isp += words_of<T>();
+    return {0, sizeof(value), top};
+}
+
+#define CACHED_OPERATOR(opname, OP, Result)                        \
+    template<typename T, uint32_t bytes>                           \
+    static CachedResult cached_##opname(StackCPUDevice* cpu, const DecodedInstruction&, \
+                                        uint64_t top) {            \
+        T a = pop_top<T, bytes>(cpu, top);                         \
+        T b = 0;                                                   \
+        cpu->pop<T, false>(b);                                     \
+        return push_top<Result>(cpu, a OP b);                      \
+    }
+
+// Arithmetic results are truncated to the operand type, as push<T> does.
+CACHED_OPERATOR(add, +, T)
+CACHED_OPERATOR(subtract, -, T)
+CACHED_OPERATOR(multiply, *, T)
+CACHED_OPERATOR(divide, /, T)
+CACHED_OPERATOR(and_, &, T)
+CACHED_OPERATOR(or_, |, T)
+CACHED_OPERATOR(xor_, ^, T)
+CACHED_OPERATOR(lt, <, int32_t)
+CACHED_OPERATOR(gt, >, int32_t)
+CACHED_OPERATOR(ge, >=, int32_t)
+CACHED_OPERATOR(le, <=, int32_t)
+CACHED_OPERATOR(eq, ==, int32_t)
+CACHED_OPERATOR(neq, !=, int32_t)
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_not_(StackCPUDevice* cpu, const DecodedInstruction&, uint64_t top) {
+    return push_top<T>(cpu, ~pop_top<T, bytes, true>(cpu, top));
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_negate(StackCPUDevice* cpu, const DecodedInstruction&,
+                                  uint64_t top) {
+    return push_top<T>(cpu, -pop_top<T, bytes, true>(cpu, top));
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_copy(StackCPUDevice* cpu, const DecodedInstruction&, uint64_t top) {
+    T a = pop_top<T, bytes, true>(cpu, top);
+    cpu->push<T, false>(a);
+    return push_top(cpu, a);
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_discard(StackCPUDevice* cpu, const DecodedInstruction&,
+                                   uint64_t top) {
+    pop_top<T, bytes>(cpu, top);
+    return {0, 0, 0};
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_swap(StackCPUDevice* cpu, const DecodedInstruction&, uint64_t top) {
+    // b ends up cached where a was.
+    T a = pop_top<T, bytes, true>(cpu, top);
+    T b = 0;
+    cpu->pop<T, false>(b);
+    cpu->push<T, false>(a);
+    return push_top(cpu, b);
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_read(StackCPUDevice* cpu, const DecodedInstruction&, uint64_t top) {
+    uint64_t addr = pop_top<uint64_t, bytes>(cpu, top);
+    T val = 0;
+    auto read_result = cpu->read_memory(addr, sizeof(val), (uint8_t*)(&val));
+    if (read_result) {
+        return {read_result, 0, 0};
+    }
+    return push_top(cpu, val);
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_read_immediate(StackCPUDevice* cpu, const DecodedInstruction& di,
+                                          uint64_t top) {
+    spill_top<bytes>(cpu, top);
+    T val;
+    memcpy(&val, di.immediate, sizeof(val));
+    return push_top(cpu, val);
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_write(StackCPUDevice* cpu, const DecodedInstruction&, uint64_t top) {
+    uint64_t addr = pop_top<uint64_t, bytes>(cpu, top);
+    T val = 0;
+    cpu->pop<T, false>(val);
+    auto write_result = cpu->write_memory(addr, sizeof(val), (uint8_t*)(&val));
+    if (write_result) {
+        return {write_result, 0, 0};
+    }
+    cpu->note_code_write(addr, sizeof(val));
+    return {0, 0, 0};
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_shift(StackCPUDevice* cpu, const DecodedInstruction&, uint64_t top) {
+    T val = pop_top<T, bytes>(cpu, top);
+    cpu->sp -= sizeof(val);
+    auto write_result = cpu->write_memory(cpu->sp, sizeof(val), (uint8_t*)(&val));
+    if (write_result) {
+        return {write_result, 0, 0};
+    }
+    cpu->note_code_write(cpu->sp, sizeof(val));
+    return {0, 0, 0};
+}
+
+template<typename T, uint32_t bytes>
+static CachedResult cached_unshift(StackCPUDevice* cpu, const DecodedInstruction&,
+                                   uint64_t top) {
+    spill_top<bytes>(cpu, top);
+    T val = 0;
+    auto read_result = cpu->read_memory(cpu->sp, sizeof(val), (uint8_t*)(&val));
+    if (read_result) {
+        return {read_result, 0, 0};
+    }
+    return push_top(cpu, val);
+}
+
+template<typename T, typename U, uint32_t bytes>
+static CachedResult cached_resize(StackCPUDevice* cpu, const DecodedInstruction&,
+                                  uint64_t top) {
+    constexpr bool replaced = sizeof(U) >= sizeof(T);
+    return push_top<U>(cpu, static_cast<U>(pop_top<T, bytes, replaced>(cpu, top)));
+}
+
+template<uint32_t bytes>
+static CachedResult cached_jump(StackCPUDevice* cpu, const DecodedInstruction&, uint64_t top) {
+    uint64_t addr = pop_top<uint64_t, bytes>(cpu, top);
+    int32_t condition = 0;
+    cpu->pop<int32_t, false>(condition);
+    if (condition) {
+        cpu->ip = addr;
+    }
+    return {0, 0, 0};
+}
+
+template<uint32_t bytes>
+static CachedResult cached_nop(StackCPUDevice*, const DecodedInstruction&, uint64_t top) {
+    return {0, bytes, top};
+}
+
+// Everything else puts the stack back in the array and runs the unchecked handler.
+template<uint32_t bytes>
+static CachedResult cached_fallback(StackCPUDevice* cpu, const DecodedInstruction& di,
+                                    uint64_t top) {
+    spill_top<bytes>(cpu, top);
+    return {di.unchecked(cpu, di), 0, 0};
+}
+
+// A read-immediate of type Immediate, then the instruction after it with the immediate
+// cached.
+template<uint32_t bytes, typename Immediate, CachedHandler second>
+static CachedResult run_pair(StackCPUDevice* cpu, const DecodedInstruction& di, uint64_t top) {
+    spill_top<bytes>(cpu, top);
+    Immediate immediate;
+    memcpy(&immediate, di.immediate, sizeof(immediate));
+    auto first = push_top(cpu, immediate);
+    return second(cpu, (&di)[1], first.top);
+}
+
+// The immediate is the operator's top operand.
+#define CACHED_PAIR(OP, Immediate)                                 \
+    template<typename T, uint32_t bytes>                           \
+    static CachedResult cached_pair_##OP(StackCPUDevice* cpu, const DecodedInstruction& di, \
+                                         uint64_t top) {           \
+        return run_pair<bytes, Immediate, &cached_##OP<T, sizeof(Immediate)>>(cpu, di, top); \
+    }
+
+CACHED_PAIR(add, T)
+CACHED_PAIR(subtract, T)
+CACHED_PAIR(multiply, T)
+CACHED_PAIR(divide, T)
+CACHED_PAIR(and_, T)
+CACHED_PAIR(or_, T)
+CACHED_PAIR(xor_, T)
+CACHED_PAIR(lt, T)
+CACHED_PAIR(gt, T)
+CACHED_PAIR(ge, T)
+CACHED_PAIR(le, T)
+CACHED_PAIR(eq, T)
+CACHED_PAIR(neq, T)
+CACHED_PAIR(read, uint64_t)
+CACHED_PAIR(write, uint64_t)
+
+// 64 bit read-immediate, then a jump there if the condition below it is set.
+template<uint32_t bytes>
+static CachedResult cached_pair_jump(StackCPUDevice* cpu, const DecodedInstruction& di,
+                                     uint64_t top) {
+    return run_pair<bytes, uint64_t, &cached_jump<sizeof(uint64_t)>>(cpu, di, top);
+}
+
+// Cached handlers for bytes of the top of the stack cached, laid out like HandlerTable,
+// and superinstructions by the second instruction of the pair, null where there isn't one.
+template<uint32_t bytes>
+struct CachedTable {
+    CachedHandler sized[256][8];
+    CachedHandler resize[8][8];
+
+    constexpr CachedTable() : sized(), resize() {
+        for (int instr = 0; instr < 256; ++instr) {
+            fill(instr, &cached_fallback<bytes>);
+        }
+        for (int from = 0; from < 8; ++from) {
+            for (int to = 0; to < 8; ++to) {
+                resize[from][to] = &cached_fallback<bytes>;
+            }
+        }
+
+        fill(0, &cached_nop<bytes>);
+        SIZED_ROW('+', cached_add, bytes)
+        SIZED_ROW('-', cached_subtract, bytes)
+        SIZED_ROW('*', cached_multiply, bytes)
+        SIZED_ROW('/', cached_divide, bytes)
+        NOFLOAT_ROW('&', cached_and_, bytes)
+        NOFLOAT_ROW('|', cached_or_, bytes)
+        NOFLOAT_ROW('^', cached_xor_, bytes)
+        NOFLOAT_ROW('~', cached_not_, bytes)
+        SIZED_ROW('_', cached_negate, bytes)
+        SIZED_ROW('<', cached_lt, bytes)
+        SIZED_ROW('>', cached_gt, bytes)
+        SIZED_ROW('g', cached_ge, bytes)
+        SIZED_ROW('l', cached_le, bytes)
+        SIZED_ROW('=', cached_eq, bytes)
+        SIZED_ROW('!', cached_neq, bytes)
+        SIZED_ROW('C', cached_copy, bytes)
+        SIZED_ROW('D', cached_discard, bytes)
+        SIZED_ROW('R', cached_read, bytes)
+        SIZED_ROW('r', cached_read_immediate, bytes)
+        SIZED_ROW('W', cached_write, bytes)
+        SIZED_ROW('S', cached_shift, bytes)
+        SIZED_ROW('U', cached_unshift, bytes)
+        SIZED_ROW('$', cached_swap, bytes)
+        fill('J', &cached_jump<bytes>);
+
+        RESIZE_ROW(2, float, cached_resize, bytes)
+        RESIZE_ROW(3, uint8_t, cached_resize, bytes)
+        RESIZE_ROW(4, uint16_t, cached_resize, bytes)
+        RESIZE_ROW(5, uint32_t, cached_resize, bytes)
+        RESIZE_ROW(6, uint64_t, cached_resize, bytes)
+        RESIZE_ROW(7, double, cached_resize, bytes)
+    }
+
+    constexpr void fill(int instr, CachedHandler handler) {
+        for (int size = 0; size < 8; ++size) {
+            sized[instr][size] = handler;
+        }
+    }
+
+    // Invalid sizes fall back to the unchecked handler, which reports them.
+    constexpr void fill_sized(int) {}
+};
+
+template<uint32_t bytes>
+struct CachedPairTable {
+    CachedHandler sized[256][8];
+
+    constexpr CachedPairTable() : sized() {
+        SIZED_ROW('+', cached_pair_add, bytes)
+        SIZED_ROW('-', cached_pair_subtract, bytes)
+        SIZED_ROW('*', cached_pair_multiply, bytes)
+        SIZED_ROW('/', cached_pair_divide, bytes)
+        NOFLOAT_ROW('&', cached_pair_and_, bytes)
+        NOFLOAT_ROW('|', cached_pair_or_, bytes)
+        NOFLOAT_ROW('^', cached_pair_xor_, bytes)
+        SIZED_ROW('<', cached_pair_lt, bytes)
+        SIZED_ROW('>', cached_pair_gt, bytes)
+        SIZED_ROW('g', cached_pair_ge, bytes)
+        SIZED_ROW('l', cached_pair_le, bytes)
+        SIZED_ROW('=', cached_pair_eq, bytes)
+        SIZED_ROW('!', cached_pair_neq, bytes)
+        SIZED_ROW('R', cached_pair_read, bytes)
+        SIZED_ROW('W', cached_pair_write, bytes)
+        for (int size = 0; size < 8; ++size) {
+            sized['J'][size] = &cached_pair_jump<bytes>;
+        }
+    }
+
+    // Sizes without a superinstruction stay null.
+    constexpr void fill_sized(int) {}
+};
+
+// Bytes of the top of the stack an instruction's cached handler leaves cached, given how
+// many were before it. Must agree with the tables above.
+static uint32_t cached_bytes_after(const DecodedInstruction& di, uint32_t before) {
+    // Bytes of a value of the instruction's size, as read-immediate takes.
+    uint32_t bytes = immediate_length('r', di.size);
+    switch (di.instr) {
+    case 0:
+        return before;
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '&':
+    case '|':
+    case '^':
+    case '~':
+    case '_':
+    case 'C':
+    case 'R':
+    case 'r':
+    case 'U':
+    case '$':
+        return bytes;
+    case '<':
+    case '>':
+    case 'g':
+    case 'l':
+    case '=':
+    case '!':
+        return bytes ? sizeof(int32_t) : 0;
+    case 'z':
+        if ((di.size >> 6) || !immediate_length('r', di.size & 7)) {
+            return 0;
+        }
+        return immediate_length('r', (di.size >> 3) & 7);
+    default:
+        return 0;
+    }
+}
+
+template<uint32_t bytes>
+static void resolve_cached(DecodedInstruction& di, const DecodedInstruction* next) {
+    static constexpr CachedTable<bytes> table{};
+    static constexpr CachedPairTable<bytes> pairs{};
+
+    if (di.instr == 'z') {
+        di.cached = (di.size >> 6) ? &cached_fallback<bytes>
+            : table.resize[di.size & 7][(di.size >> 3) & 7];
+    } else {
+        di.cached = table.sized[di.instr][di.size < 8 ? di.size : 0];
+    }
+
+    // Pairs start with a read-immediate of a valid size. J, R and W take it as an address,
+    // whatever their own size; operators need the same size as the immediate.
+    di.fused = 0;
+    if (next && di.instr == 'r' && immediate_length('r', di.size) && next->size < 8) {
+        bool address = next->instr == 'J' || next->instr == 'R' || next->instr == 'W';
+        if (address ? di.size == 6 : di.size == next->size) {
+            di.fused = pairs.sized[next->instr][next->size];
+        }
+    }
+}
+
+// Picks each instruction's cached handler, pairing instructions up from the start of
+// the block, each in at most one pair.
+static void resolve_cached_handlers(vector<DecodedInstruction>& instructions) {
+    uint32_t bytes = 0;
+    bool second = false;
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        auto& di = instructions[i];
+        auto next = !second && i + 1 < instructions.size() ? &instructions[i + 1] : nullptr;
+        switch (bytes) {
+        case 0: resolve_cached<0>(di, next); break;
+        case 1: resolve_cached<1>(di, next); break;
+        case 2: resolve_cached<2>(di, next); break;
+        case 4: resolve_cached<4>(di, next); break;
+        case 8: resolve_cached<8>(di, next); break;
+        }
+        second = di.fused != 0;
+        bytes = cached_bytes_after(di, bytes);
+    }
+}
+
+int32_t StackCPUDevice::run_cached_block(BasicBlock& block) {
+    const auto& code = block.instructions;
+    // Nothing is cached on the way in.
+    CachedResult step = {0, 0, 0};
+    for (size_t i = 0; i < code.size(); ++i) {
+        const auto& di = code[i];
+        if (di.fused) {
+            // Neither instruction of a pair reads ip, so it moves past both up front.
+            ip += di.length + code[i + 1].length;
+            instructions += 2;
+            step = di.fused(this, di, step.top);
+            ++i;
+        } else {
+            ip += di.length;
+            ++instructions;
+            step = di.cached(this, di, step.top);
+        }
+        if (step.result) {
+            return step.result;
+        }
+        // A write may have landed on this block; the rest of it is stale.
+        if (!block.valid) {
+            break;
+        }
+    }
+    // Or on the way out.
+    switch (step.bytes) {
+    case 1: spill_top<1>(this, step.top); break;
+    case 2: spill_top<2>(this, step.top); break;
+    case 4: spill_top<4>(this, step.top); break;
+    case 8: spill_top<8>(this, step.top); break;
+    }
+    return 0;
+}
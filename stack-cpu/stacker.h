@@ -15,13 +15,94 @@ extern "C" {
 
 static const uint64_t stack_cpu_device_type_id = 2l;
 
+// Values for StackCPUConfig.jit_mode.
+//
+// Interpret everything.
+static const uint32_t stack_cpu_jit_off = 0;
+// Compile blocks to native code once they have run jit_threshold times.
+static const uint32_t stack_cpu_jit_on = 1;
+// As stack_cpu_jit_on, but run every compiled block in both tiers and halt with a
+// simulator error if they disagree. For testing the JIT; slower than either tier alone.
+static const uint32_t stack_cpu_jit_differential = 2;
+
+// Hardware interrupts with codes below this are prioritised: each code is a line with its
+// own pending bit, and the lowest line pending is taken first, ahead of any higher code.
+// Codes from here up wait in one queue behind them, in the order they were sent. Guests
+// can mask lines with the Interrupt Mask register.
+static const uint32_t stack_cpu_interrupt_lines = 64;
+
 struct StackCPUConfig {
     uint32_t stack_size;
+    // One of the stack_cpu_jit_* values.
+    uint32_t jit_mode;
+    // Times a block runs before it's compiled. 0 picks a default.
+    uint32_t jit_threshold;
+    // Hardware interrupts which can be waiting at once on each line, and in the queue for
+    // codes past the lines. Rounded up to a power of two; 0 picks a default. Interrupts
+    // sent while their line or the queue is full are dropped, counted, and set the
+    // Interrupt Overflow error bit.
+    uint32_t interrupt_vector_size;
+    // Emulated clock rate. 0 runs as fast as the host allows. Only applies when the CPU
+    // is booted; on a runtime, the runtime's step budget sets the pace.
+    uint32_t instructions_per_second;
+    // Instructions run between checks against the clock. 0 picks about a millisecond's
+    // worth at the configured rate.
+    uint32_t clock_quantum;
+    // If nonzero, an interrupt sent on a line which is already pending is merged with the
+    // one waiting, so the handler runs once for both.
+    uint32_t coalesce_interrupts;
 };
 
 struct Device* bscomp_device_new(const struct StackCPUConfig* config);
 void bscomp_device_destroy(struct Device* dev);
 
+// Interrupts the CPU has dropped because its interrupt vector was full.
+uint64_t bscomp_stackcpu_interrupts_dropped(const struct Device* dev);
+
+// Time the CPU has spent parked in the wait-for-interrupt instruction.
+struct StackCPUIdleStats {
+    // Times the CPU has waited, and the total time spent waiting.
+    uint64_t waits;
+    uint64_t idle_nanoseconds;
+    // Waits ended by an interrupt, and the time from the interrupt being sent to the CPU
+    // running again: summed over all of them, and the worst seen.
+    uint64_t wakeups;
+    uint64_t wake_latency_nanoseconds;
+    uint64_t max_wake_latency_nanoseconds;
+};
+
+// Returns nonzero if dev is not a stack CPU.
+int32_t bscomp_stackcpu_idle_stats(const struct Device* dev, struct StackCPUIdleStats* stats);
+
+// The CPU's own performance counters, in the order it gives them to the motherboard.
+//
+// The opcode counts are brought up to date every so often rather than on every
+// instruction, and count whole blocks even when one is cut short, so they lag behind and
+// may not quite add up to the instructions run.
+struct StackCPUCounters {
+    // Instructions run since the last reset, counting each hardware interrupt as one.
+    uint64_t instructions;
+    // Hardware interrupts taken since the last reset, and dropped since the CPU was made.
+    uint64_t interrupts_taken;
+    uint64_t interrupts_dropped;
+    // Instructions run with each opcode byte.
+    uint64_t opcodes[256];
+};
+
+static const uint32_t stack_cpu_counter_count = sizeof(struct StackCPUCounters) / sizeof(uint64_t);
+
+// Returns nonzero if dev is not a stack CPU.
+int32_t bscomp_stackcpu_counters(const struct Device* dev, struct StackCPUCounters* counters);
+
+// Start writing a trace of every instruction the CPU runs, and every hardware interrupt it
+// takes, to the file at path, replacing any trace already being written. Read traces with
+// stack-cpu/trace.py. Only call these while the CPU is neither booted nor being stepped.
+//
+// Returns nonzero if dev is not a stack CPU or the file can't be created.
+int32_t bscomp_stackcpu_start_trace(struct Device* dev, const char* path);
+// Finish writing the trace, if there is one.
+int32_t bscomp_stackcpu_stop_trace(struct Device* dev);
+
 #ifdef __cplusplus
 } // End extern "C"
 #endif
@@ -0,0 +1,98 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+using namespace std;
+
+static const char trace_magic[8] = {'B', 'S', 'C', 'T', 'R', 'A', 'C', 'E'};
+
+// Records the writer gathers up before each fwrite.
+static const uint32_t trace_batch_size = 4096;
+
+// How long the writer sleeps when the ring is empty.
+static const chrono::milliseconds trace_poll_interval(1);
+
+TraceWriter::TraceWriter() : file(0), stopping(false), failed(false), dropped(0) {}
+
+// Stops the writer once it has written everything already recorded.
+TraceWriter::~TraceWriter() {
+    if (writer.joinable()) {
+        stopping.store(true, memory_order_release);
+        writer.join();
+    }
+    if (file) {
+        fclose(file);
+    }
+    if (dropped) {
+        cout << "Stack CPU trace dropped " << dropped << " records" << endl;
+    }
+}
+
+int32_t TraceWriter::open(const char* path) {
+    if (ring.init(trace_ring_size)) {
+        return -1;
+    }
+    file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+
+    uint32_t header[] = {trace_version, sizeof(TraceRecord)};
+    if (fwrite(trace_magic, sizeof(trace_magic), 1, file) != 1
+            || fwrite(header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        file = 0;
+        return -1;
+    }
+
+    try {
+        writer = thread(&TraceWriter::write_records, this);
+    } catch (const system_error& ex) {
+        fclose(file);
+        file = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Runs on the writer thread until stopped, then drains what's left in the ring. If the
+// file can't be written, keeps emptying the ring so the CPU never waits on it again.
+void TraceWriter::write_records() {
+    vector<TraceRecord> batch;
+    batch.reserve(trace_batch_size);
+    while (true) {
+        // Checked before draining, so nothing recorded before the stop is missed.
+        bool last = stopping.load(memory_order_acquire);
+
+        TraceRecord rec;
+        while (batch.size() < trace_batch_size && ring.pop(rec)) {
+            batch.push_back(rec);
+        }
+
+        if (!batch.empty()) {
+            if (!failed.load(memory_order_relaxed)
+                    && fwrite(batch.data(), sizeof(TraceRecord), batch.size(), file) != batch.size()) {
+                cout << "Stack CPU trace could not be written; dropping the rest" << endl;
+                failed.store(true, memory_order_relaxed);
+            }
+            bool full = batch.size() == trace_batch_size;
+            batch.clear();
+            if (full) {
+                continue;
+            }
+        }
+
+        if (last) {
+            break;
+        }
+        this_thread::sleep_for(trace_poll_interval);
+    }
+    fflush(file);
+}
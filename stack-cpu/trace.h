@@ -0,0 +1,72 @@
+#ifndef bscomp_trace_h
+#define bscomp_trace_h
+// Execution traces. The CPU fills a ring with fixed-size records, and a thread of the
+// trace's own writes them out to a file. trace.py reads them back.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+
+#include "ringbuffer.h"
+
+// A trace file is the magic bytes BSCTRACE, the format version and the size of a record
+// as u32s, and then records until the end of the file, all in host byte order.
+static const uint32_t trace_version = 1;
+
+// Values for TraceRecord.flags.
+//
+// address holds the memory the instruction touched: the address read or written by R or
+// W, or the memory stack pointer before S, U, s or u.
+static const uint16_t trace_has_address = 1 << 0;
+// The record is a hardware interrupt rather than an instruction; address holds its code.
+static const uint16_t trace_is_interrupt = 1 << 1;
+
+// One instruction run, as it was just before it ran.
+struct TraceRecord {
+    uint64_t ip;
+    uint64_t address;
+    uint32_t isp;
+    uint8_t instr;
+    uint8_t size;
+    uint16_t flags;
+};
+
+static_assert(sizeof(TraceRecord) == 24, "Trace records are written to files as is.");
+
+// Records waiting to be written, per trace.
+static const uint32_t trace_ring_size = 1 << 16;
+
+// One trace file being written. Records come from a single CPU thread.
+class TraceWriter {
+public:
+    TraceWriter();
+    ~TraceWriter();
+
+    // Creates the file and starts the writer thread. Returns nonzero if either fails.
+    int32_t open(const char* path);
+
+    // Waits for room rather than losing records, unless the writer has given up on the
+    // file, in which case the record is dropped and counted.
+    void record(const TraceRecord& rec) {
+        while (!ring.push(rec)) {
+            if (failed.load(memory_order_relaxed)) {
+                ++dropped;
+                return;
+            }
+            this_thread::yield();
+        }
+    }
+
+private:
+    void write_records();
+
+    FILE* file;
+    RingBuffer<TraceRecord> ring;
+    thread writer;
+    atomic<bool> stopping;
+    atomic<bool> failed;
+    uint64_t dropped;
+};
+
+#endif // bscomp_trace_h
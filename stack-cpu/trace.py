@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Reads stack CPU execution traces, as written by bscomp_stackcpu_start_trace.
+
+    trace.py summary TRACE [--top N]   Hot instructions, hot memory, and the mix of opcodes
+                                       and of pairs of opcodes run one after the other.
+    trace.py replay TRACE [--start IP] [--end IP]
+                                       Every record in order, one per line.
+"""
+import argparse
+import collections
+import struct
+import sys
+
+MAGIC = b'BSCTRACE'
+VERSION = 1
+HEADER = struct.Struct('@8sII')
+# ip, address, isp, instr, size, flags. Matches TraceRecord in trace.h.
+RECORD = struct.Struct('@QQIBBH')
+
+HAS_ADDRESS = 1 << 0
+IS_INTERRUPT = 1 << 1
+
+SIZE_NAMES = {2: 'f32', 3: 'u8', 4: 'u16', 5: 'u32', 6: 'u64', 7: 'f64'}
+# Bytes of immediate after a read-immediate instruction of each size.
+IMMEDIATE_LENGTHS = {2: 4, 3: 1, 4: 2, 5: 4, 6: 8, 7: 8}
+
+def read_records(path):
+    """Yields (ip, address, isp, instr, size, flags) for every record in the file."""
+    with open(path, 'rb') as f:
+        header = f.read(HEADER.size)
+        if len(header) < HEADER.size:
+            raise ValueError('{}: too short to be a trace'.format(path))
+        magic, version, record_size = HEADER.unpack(header)
+        if magic != MAGIC:
+            raise ValueError('{}: not a stack CPU trace'.format(path))
+        if version != VERSION or record_size != RECORD.size:
+            raise ValueError('{}: trace version {} with {} byte records is not supported'
+                             .format(path, version, record_size))
+
+        while True:
+            chunk = f.read(RECORD.size * 4096)
+            whole = len(chunk) - len(chunk) % RECORD.size
+            yield from RECORD.iter_unpack(chunk[:whole])
+            if len(chunk) < RECORD.size * 4096:
+                break
+
+def opcode_name(instr):
+    if instr == 0:
+        return 'nop'
+    if 0x20 < instr < 0x7f:
+        return chr(instr)
+    return '0x{:02x}'.format(instr)
+
+def instruction_name(instr, size):
+    name = opcode_name(instr)
+    if instr == ord('z'):
+        operand = '{}->{}'.format(SIZE_NAMES.get(size & 7, size & 7),
+                                  SIZE_NAMES.get((size >> 3) & 7, (size >> 3) & 7))
+    else:
+        operand = SIZE_NAMES.get(size, str(size))
+    return '{} {}'.format(name, operand)
+
+def instruction_length(instr, size):
+    if instr == ord('r'):
+        return 2 + IMMEDIATE_LENGTHS.get(size, 0)
+    return 2
+
+def describe(record):
+    ip, address, isp, instr, size, flags = record
+    if flags & IS_INTERRUPT:
+        return '{:#014x}  isp {:5}  interrupt {}'.format(ip, isp, address)
+
+    line = '{:#014x}  isp {:5}  {}'.format(ip, isp, instruction_name(instr, size))
+    if flags & HAS_ADDRESS:
+        line += '  @{:#x}'.format(address)
+    return line
+
+def summary(args):
+    instructions = 0
+    interrupts = 0
+    ips = collections.Counter()
+    opcodes = collections.Counter()
+    # Instructions run straight after the one before, without a jump or interrupt in
+    # between, counted by opcode and size.
+    pairs = collections.Counter()
+    reads = collections.Counter()
+    writes = collections.Counter()
+    previous = None
+    for record in read_records(args.trace):
+        ip, address, isp, instr, size, flags = record
+        if flags & IS_INTERRUPT:
+            interrupts += 1
+            previous = None
+            continue
+        instructions += 1
+        ips[ip] += 1
+        opcodes[instr] += 1
+        if previous and previous[0] + instruction_length(previous[1], previous[2]) == ip:
+            pairs[(previous[1], previous[2], instr, size)] += 1
+        previous = (ip, instr, size)
+        if flags & HAS_ADDRESS:
+            if instr in (ord('R'), ord('U'), ord('u')):
+                reads[address] += 1
+            else:
+                writes[address] += 1
+
+    print('{} instructions, {} hardware interrupts'.format(instructions, interrupts))
+
+    def show(title, counts, label):
+        if not counts:
+            return
+        print()
+        print(title)
+        total = sum(counts.values())
+        for key, count in counts.most_common(args.top):
+            print('  {:>20}  {:12}  {:6.2f}%'.format(label(key), count, 100 * count / total))
+
+    show('Opcodes', opcodes, opcode_name)
+    show('Opcode pairs', pairs,
+         lambda p: '{}, {}'.format(instruction_name(p[0], p[1]), instruction_name(p[2], p[3])))
+    show('Hot instructions', ips, hex)
+    show('Hot reads', reads, hex)
+    show('Hot writes', writes, hex)
+
+def replay(args):
+    for record in read_records(args.trace):
+        ip = record[0]
+        if args.start is not None and ip < args.start:
+            continue
+        if args.end is not None and ip >= args.end:
+            continue
+        print(describe(record))
+
+def main():
+    parser = argparse.ArgumentParser(description='Read stack CPU execution traces.')
+    commands = parser.add_subparsers(dest='command')
+    commands.required = True
+
+    summary_parser = commands.add_parser('summary', help='hot addresses and opcode mix')
+    summary_parser.add_argument('trace')
+    summary_parser.add_argument('--top', type=int, default=20,
+                                help='entries to show in each table')
+    summary_parser.set_defaults(run=summary)
+
+    replay_parser = commands.add_parser('replay', help='print the records in order')
+    replay_parser.add_argument('trace')
+    replay_parser.add_argument('--start', type=lambda s: int(s, 0),
+                               help='only show instructions at or above this address')
+    replay_parser.add_argument('--end', type=lambda s: int(s, 0),
+                               help='only show instructions below this address')
+    replay_parser.set_defaults(run=replay)
+
+    args = parser.parse_args()
+    try:
+        args.run(args)
+    except BrokenPipeError:
+        pass
+    except (OSError, ValueError) as ex:
+        print(ex, file=sys.stderr)
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())